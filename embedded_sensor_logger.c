@@ -9,10 +9,12 @@
 #include "pico/stdlib.h"
 #include "pico/binary_info.h"
 #include "pico/bootrom.h"
+#include "pico/multicore.h"
 #include "hardware/i2c.h"
 #include "hardware/pwm.h"
 #include "hardware/timer.h"
 #include "hardware/rtc.h"
+#include "hardware/sync.h"
 
 #include "ssd1306.h"
 #include "font.h"
@@ -23,11 +25,127 @@
 #include "my_debug.h"
 #include "rtc.h"
 #include "sd_card.h"
+#include "sd_raid.h"
+#include "sample_ring.h"
+#include "record_format.h"
+#include "log_format.h"
+#include "log_writer.h"
+#include "log_index.h"
+#include "disk_stats.h"
+#include "benchmarks.h"
 
 #define SENSOR_BUS i2c0
 #define SENSOR_DATA_PIN 0
 #define SENSOR_CLOCK_PIN 1
 static int SENSOR_ADDRESS = 0x68;
+#define SENSOR_REG_SMPLRT_DIV 0x19
+#define SENSOR_REG_CONFIG 0x1A
+#define SENSOR_REG_GYRO_CONFIG 0x1B
+#define SENSOR_REG_ACCEL_CONFIG 0x1C
+#define SENSOR_REG_FIFO_EN 0x23
+#define SENSOR_REG_INT_PIN_CFG 0x37
+#define SENSOR_REG_INT_ENABLE 0x38
+#define SENSOR_REG_INT_STATUS 0x3A
+#define SENSOR_REG_ACCEL_XOUT_H 0x3B
+#define SENSOR_REG_USER_CTRL 0x6A
+#define SENSOR_REG_FIFO_COUNTH 0x72
+#define SENSOR_REG_FIFO_R_W 0x74
+#define SENSOR_BURST_LENGTH 14
+
+#define SENSOR_INT_PIN 8
+
+// Acquisition modes: poll the data registers once per loop, read them on
+// every DATA_RDY pulse on SENSOR_INT_PIN, or let the sensor buffer frames in
+// its 1024-byte FIFO and drain them in bursts. DRDY needs the MPU6050 INT
+// pin wired to SENSOR_INT_PIN.
+// Select with e.g. add_compile_definitions(SENSOR_ACQUISITION_MODE=1)
+#define SENSOR_MODE_POLL 0
+#define SENSOR_MODE_FIFO 1
+#define SENSOR_MODE_DRDY 2
+#ifndef SENSOR_ACQUISITION_MODE
+#define SENSOR_ACQUISITION_MODE SENSOR_MODE_POLL
+#endif
+
+// Recording format: CSV text, or fixed-size binary records (lib/log_format.h)
+// at about half the size, converted on the host with tools/log2csv.c.
+// Select with e.g. add_compile_definitions(LOG_FORMAT=1)
+#define LOG_FORMAT_CSV 0
+#define LOG_FORMAT_BINARY 1
+#ifndef LOG_FORMAT
+#define LOG_FORMAT LOG_FORMAT_CSV
+#endif
+#if LOG_FORMAT == LOG_FORMAT_BINARY
+#define LOG_FILE_EXTENSION "bin"
+#define LOG_RECORD_BYTES LOG_RECORD_SIZE
+#else
+#define LOG_FILE_EXTENSION "csv"
+#define LOG_RECORD_BYTES RECORD_CSV_MAX_LENGTH
+#endif
+
+// Expected length of a recording, when known in advance. The region
+// preallocated (and pre-erased) for it is then sized as duration x sample
+// rate x record size instead of LOG_PREALLOCATE_MB. Longer recordings still
+// work, growing past it.
+#ifndef LOG_EXPECTED_SECONDS
+#define LOG_EXPECTED_SECONDS 0
+#endif
+
+// Size of the sequential read from the start of the card that measures its
+// throughput on mount (0 skips it)
+#ifndef MOUNT_READ_TEST_KB
+#define MOUNT_READ_TEST_KB 256
+#endif
+
+typedef enum {
+    SENSOR_DLPF_260HZ = 0,  // DLPF off: gyro output rate 8 kHz
+    SENSOR_DLPF_184HZ = 1,
+    SENSOR_DLPF_94HZ = 2,
+    SENSOR_DLPF_44HZ = 3,
+    SENSOR_DLPF_21HZ = 4,
+    SENSOR_DLPF_10HZ = 5,
+    SENSOR_DLPF_5HZ = 6
+} sensor_dlpf_t;
+
+typedef enum {
+    SENSOR_ACCEL_RANGE_2G = 0,
+    SENSOR_ACCEL_RANGE_4G = 1,
+    SENSOR_ACCEL_RANGE_8G = 2,
+    SENSOR_ACCEL_RANGE_16G = 3
+} sensor_accel_range_t;
+
+typedef enum {
+    SENSOR_GYRO_RANGE_250DPS = 0,
+    SENSOR_GYRO_RANGE_500DPS = 1,
+    SENSOR_GYRO_RANGE_1000DPS = 2,
+    SENSOR_GYRO_RANGE_2000DPS = 3
+} sensor_gyro_range_t;
+
+typedef struct {
+    uint16_t sample_rate_hz;  // Requested; the sensor divides its output rate
+    sensor_dlpf_t dlpf;
+    sensor_accel_range_t accel_range;
+    sensor_gyro_range_t gyro_range;
+    uint8_t sample_rate_divider;  // Assigned by sensor_configure()
+} sensor_config_t;
+
+// Per-deployment defaults, e.g. add_compile_definitions(SENSOR_ACCEL_RANGE=SENSOR_ACCEL_RANGE_8G)
+#ifndef SENSOR_SAMPLE_RATE_HZ
+#define SENSOR_SAMPLE_RATE_HZ 100
+#endif
+#ifndef SENSOR_DLPF
+#define SENSOR_DLPF SENSOR_DLPF_184HZ
+#endif
+#ifndef SENSOR_ACCEL_RANGE
+#define SENSOR_ACCEL_RANGE SENSOR_ACCEL_RANGE_2G
+#endif
+#ifndef SENSOR_GYRO_RANGE
+#define SENSOR_GYRO_RANGE SENSOR_GYRO_RANGE_250DPS
+#endif
+#define SENSOR_DATA_RDY_INT 0x01
+#define SENSOR_READY_QUEUE_SIZE 16
+#define SENSOR_FIFO_SIZE 1024
+#define SENSOR_FIFO_BATCH_FRAMES 36
+#define SENSOR_FIFO_OFLOW_INT 0x10
 
 #define SCREEN_BUS i2c1
 #define SCREEN_DATA_PIN 14
@@ -44,7 +162,7 @@ ssd1306_t display;
 #define SOUND_PRIMARY 21
 #define SOUND_SECONDARY 10
 
-char data_filename[20] = "sensor_log1.csv";
+char data_filename[32] = "sensor_log1." LOG_FILE_EXTENSION;
 volatile int file_counter = 1;
 
 volatile bool switch_primary_locked = true;
@@ -68,10 +186,46 @@ volatile bool recording_active = false;
 volatile int sample_count;
 volatile float elapsed_time;
 
+sensor_config_t sensor_config = {
+    .sample_rate_hz = SENSOR_SAMPLE_RATE_HZ,
+    .dlpf = SENSOR_DLPF,
+    .accel_range = SENSOR_ACCEL_RANGE,
+    .gyro_range = SENSOR_GYRO_RANGE
+};
+
+volatile uint32_t sensor_bus_time_us;
+volatile uint64_t sensor_bus_time_total_us;
+volatile uint32_t sensor_bus_reads;
+
+volatile uint32_t sensor_fifo_overflows;
+volatile uint32_t sensor_fifo_lost_frames;
+static uint32_t sensor_fifo_last_drain_time;
+static uint32_t sensor_fifo_pending_frames;
+
+typedef struct {
+    uint32_t sequence;
+    uint64_t time_us;
+} sensor_ready_event_t;
+
+static volatile sensor_ready_event_t sensor_ready_queue[SENSOR_READY_QUEUE_SIZE];
+static volatile uint32_t sensor_ready_head;
+static volatile uint32_t sensor_ready_tail;
+static volatile uint32_t sensor_ready_events;
+static volatile uint64_t sensor_ready_start_time;
+volatile uint32_t sensor_ready_missed;
+volatile uint32_t sensor_ready_skipped;
+
+// Core 1 runs the acquisition loop while acquisition_enabled is set and
+// feeds sample_ring; core 0 drains it to the card and the display.
+static sample_ring_t sample_ring;
+volatile bool acquisition_enabled = false;
+volatile bool acquisition_running = false;
+
 void refresh_screen(int screen_id, int message_id);
 void activate_sound(int duration, int repetitions);
 void set_light_color(bool red, bool green, bool blue);
 void blink_light(int red, int green, int blue);
+void gpio_interrupt_handler(uint gpio, uint32_t events);
 
 static void sensor_reset() {
     uint8_t reset_data[] = {0x6B, 0x80};
@@ -83,30 +237,284 @@ static void sensor_reset() {
     sleep_ms(10);
 }
 
-static void sensor_read_data(volatile int16_t motion[3], volatile int16_t rotation[3], volatile int16_t *heat) {
-    uint8_t data_buffer[6];
+static void sensor_write_register(uint8_t reg_addr, uint8_t value) {
+    uint8_t register_data[] = {reg_addr, value};
+    i2c_write_blocking(SENSOR_BUS, SENSOR_ADDRESS, register_data, 2, false);
+}
 
-    uint8_t reg_addr = 0x3B;
+static void sensor_read_registers(uint8_t reg_addr, uint8_t *data_buffer, size_t length) {
     i2c_write_blocking(SENSOR_BUS, SENSOR_ADDRESS, &reg_addr, 1, true);
-    i2c_read_blocking(SENSOR_BUS, SENSOR_ADDRESS, data_buffer, 6, false);
+    i2c_read_blocking(SENSOR_BUS, SENSOR_ADDRESS, data_buffer, length, false);
+}
 
+// Both the data registers (0x3B..0x48) and a FIFO frame with accel, temperature
+// and gyro enabled use the same 14-byte big-endian layout.
+static void sensor_decode_frame(const uint8_t *data_buffer, volatile int16_t motion[3], volatile int16_t rotation[3], volatile int16_t *heat) {
     for (int i = 0; i < 3; i++) {
         motion[i] = (data_buffer[i * 2] << 8 | data_buffer[(i * 2) + 1]);
     }
 
-    reg_addr = 0x43;
-    i2c_write_blocking(SENSOR_BUS, SENSOR_ADDRESS, &reg_addr, 1, true);
-    i2c_read_blocking(SENSOR_BUS, SENSOR_ADDRESS, data_buffer, 6, false);
+    *heat = data_buffer[6] << 8 | data_buffer[7];
 
     for (int i = 0; i < 3; i++) {
-        rotation[i] = (data_buffer[i * 2] << 8 | data_buffer[(i * 2) + 1]);
+        rotation[i] = (data_buffer[8 + (i * 2)] << 8 | data_buffer[8 + (i * 2) + 1]);
     }
+}
 
-    reg_addr = 0x41;
-    i2c_write_blocking(SENSOR_BUS, SENSOR_ADDRESS, &reg_addr, 1, true);
-    i2c_read_blocking(SENSOR_BUS, SENSOR_ADDRESS, data_buffer, 2, false);
+static void sensor_read_data(volatile int16_t motion[3], volatile int16_t rotation[3], volatile int16_t *heat) {
+    uint8_t data_buffer[SENSOR_BURST_LENGTH];
+
+    uint32_t start_time = time_us_32();
+    sensor_read_registers(SENSOR_REG_ACCEL_XOUT_H, data_buffer, SENSOR_BURST_LENGTH);
+    sensor_bus_time_us = time_us_32() - start_time;
+    sensor_bus_time_total_us += sensor_bus_time_us;
+    sensor_bus_reads += 1;
+
+    sensor_decode_frame(data_buffer, motion, rotation, heat);
+}
+
+static uint32_t sensor_output_rate_hz(const sensor_config_t *config) {
+    return config->dlpf == SENSOR_DLPF_260HZ ? 8000 : 1000;
+}
+
+float sensor_sample_rate_hz() {
+    return (float)sensor_output_rate_hz(&sensor_config) / (sensor_config.sample_rate_divider + 1);
+}
 
-    *heat = data_buffer[0] << 8 | data_buffer[1];
+float sensor_accel_lsb_per_g() {
+    return (float)(16384 >> sensor_config.accel_range);
+}
+
+float sensor_gyro_lsb_per_dps() {
+    return 131.0f / (1 << sensor_config.gyro_range);
+}
+
+// Validates and applies a configuration. The sample rate must be reachable
+// from the output rate (1 kHz, or 8 kHz for the gyro with the DLPF off) with
+// an 8-bit divider: 4 Hz..1 kHz, or 32 Hz..8 kHz. Note that the accelerometer
+// itself never updates faster than 1 kHz.
+bool sensor_configure(const sensor_config_t *config) {
+    if (config->dlpf > SENSOR_DLPF_5HZ || config->accel_range > SENSOR_ACCEL_RANGE_16G ||
+        config->gyro_range > SENSOR_GYRO_RANGE_2000DPS || config->sample_rate_hz == 0) {
+        printf("[ERROR] Invalid sensor configuration.\n");
+        return false;
+    }
+    uint32_t output_rate = sensor_output_rate_hz(config);
+    uint32_t divider = (output_rate + (config->sample_rate_hz / 2)) / config->sample_rate_hz;
+    if (divider < 1 || divider > 256) {
+        printf("[ERROR] Sample rate %u Hz out of range for output rate %lu Hz.\n", config->sample_rate_hz, (unsigned long)output_rate);
+        return false;
+    }
+
+    sensor_write_register(SENSOR_REG_CONFIG, config->dlpf);
+    sensor_write_register(SENSOR_REG_SMPLRT_DIV, divider - 1);
+    sensor_write_register(SENSOR_REG_GYRO_CONFIG, config->gyro_range << 3);
+    sensor_write_register(SENSOR_REG_ACCEL_CONFIG, config->accel_range << 3);
+
+    sensor_config = *config;
+    sensor_config.sample_rate_divider = divider - 1;
+    return true;
+}
+
+static void sensor_fifo_reset() {
+    sensor_write_register(SENSOR_REG_USER_CTRL, 0x00);
+    sensor_write_register(SENSOR_REG_USER_CTRL, 0x04);
+    sensor_write_register(SENSOR_REG_USER_CTRL, 0x40);
+    sensor_fifo_last_drain_time = time_us_32();
+    sensor_fifo_pending_frames = 0;
+}
+
+static void sensor_fifo_start() {
+    // TEMP_FIFO_EN | XG | YG | ZG | ACCEL_FIFO_EN
+    sensor_write_register(SENSOR_REG_FIFO_EN, 0xF8);
+    sensor_write_register(SENSOR_REG_INT_ENABLE, SENSOR_FIFO_OFLOW_INT);
+
+    uint8_t int_status;
+    sensor_read_registers(SENSOR_REG_INT_STATUS, &int_status, 1);
+
+    sensor_fifo_overflows = 0;
+    sensor_fifo_lost_frames = 0;
+    sensor_fifo_reset();
+}
+
+static void sensor_fifo_stop() {
+    sensor_write_register(SENSOR_REG_USER_CTRL, 0x00);
+    sensor_write_register(SENSOR_REG_FIFO_EN, 0x00);
+    sensor_write_register(SENSOR_REG_INT_ENABLE, 0x00);
+    sensor_write_register(SENSOR_REG_USER_CTRL, 0x04);
+}
+
+// Copies up to max_frames whole frames out of the FIFO with a single burst
+// read and returns how many were copied. On overflow the FIFO contents are no
+// longer frame aligned, so they are discarded, the FIFO is restarted and the
+// number of frames that were produced meanwhile is returned in lost_frames.
+static int sensor_fifo_drain(uint8_t *frames, int max_frames, uint32_t *lost_frames) {
+    uint8_t int_status;
+    uint8_t count_data[2];
+
+    *lost_frames = 0;
+    sensor_read_registers(SENSOR_REG_INT_STATUS, &int_status, 1);
+    sensor_read_registers(SENSOR_REG_FIFO_COUNTH, count_data, 2);
+    uint16_t fifo_count = count_data[0] << 8 | count_data[1];
+    uint32_t current_time = time_us_32();
+
+    if ((int_status & SENSOR_FIFO_OFLOW_INT) || fifo_count >= SENSOR_FIFO_SIZE) {
+        uint64_t elapsed_us = current_time - sensor_fifo_last_drain_time;
+        *lost_frames = sensor_fifo_pending_frames + (uint32_t)(elapsed_us * sensor_sample_rate_hz() / 1000000);
+        sensor_fifo_overflows += 1;
+        sensor_fifo_lost_frames += *lost_frames;
+        sensor_fifo_reset();
+        return 0;
+    }
+
+    int frame_total = fifo_count / SENSOR_BURST_LENGTH;
+    if (frame_total > max_frames)
+        frame_total = max_frames;
+    if (frame_total > 0) {
+        uint32_t start_time = time_us_32();
+        sensor_read_registers(SENSOR_REG_FIFO_R_W, frames, frame_total * SENSOR_BURST_LENGTH);
+        sensor_bus_time_total_us += time_us_32() - start_time;
+        sensor_bus_reads += frame_total;
+    }
+    sensor_fifo_last_drain_time = current_time;
+    sensor_fifo_pending_frames = (fifo_count / SENSOR_BURST_LENGTH) - frame_total;
+    return frame_total;
+}
+
+// Called from the GPIO IRQ on every DATA_RDY pulse: only timestamps the event.
+static void sensor_ready_push(uint64_t time_us) {
+    uint32_t sequence = sensor_ready_events;
+    sensor_ready_events = sequence + 1;
+    if (sequence == 0)
+        sensor_ready_start_time = time_us;
+    if (sensor_ready_head - sensor_ready_tail >= SENSOR_READY_QUEUE_SIZE) {
+        sensor_ready_missed += 1;
+        return;
+    }
+    volatile sensor_ready_event_t *event = &sensor_ready_queue[sensor_ready_head % SENSOR_READY_QUEUE_SIZE];
+    event->sequence = sequence;
+    event->time_us = time_us;
+    sensor_ready_head += 1;
+}
+
+// Takes the newest queued event. The data registers only hold the latest
+// sample, so older events still waiting behind it can no longer be read:
+// they are dropped and counted in sensor_ready_skipped, leaving a gap in
+// the sequence numbers instead of copies of the same sample.
+static bool sensor_ready_pop(sensor_ready_event_t *event) {
+    uint32_t head = sensor_ready_head;
+    if (sensor_ready_tail == head)
+        return false;
+    sensor_ready_skipped += head - sensor_ready_tail - 1;
+    volatile sensor_ready_event_t *queued = &sensor_ready_queue[(head - 1) % SENSOR_READY_QUEUE_SIZE];
+    event->sequence = queued->sequence;
+    event->time_us = queued->time_us;
+    sensor_ready_tail = head;
+    return true;
+}
+
+static void sensor_ready_start() {
+    sensor_ready_head = 0;
+    sensor_ready_tail = 0;
+    sensor_ready_events = 0;
+    sensor_ready_missed = 0;
+    sensor_ready_skipped = 0;
+
+    // Active high, push-pull, 50 us pulse on every new sample
+    sensor_write_register(SENSOR_REG_INT_PIN_CFG, 0x00);
+    sensor_write_register(SENSOR_REG_INT_ENABLE, SENSOR_DATA_RDY_INT);
+    gpio_set_irq_enabled_with_callback(SENSOR_INT_PIN, GPIO_IRQ_EDGE_RISE, true, &gpio_interrupt_handler);
+}
+
+static void sensor_ready_stop() {
+    gpio_set_irq_enabled(SENSOR_INT_PIN, GPIO_IRQ_EDGE_RISE, false);
+    sensor_write_register(SENSOR_REG_INT_ENABLE, 0x00);
+}
+
+static void run_acquisition() {
+    sensor_sample_t sample;
+    sensor_bus_time_total_us = 0;
+    sensor_bus_reads = 0;
+#if SENSOR_ACQUISITION_MODE == SENSOR_MODE_FIFO
+    static uint8_t fifo_frames[SENSOR_FIFO_BATCH_FRAMES * SENSOR_BURST_LENGTH];
+    uint32_t sequence = 0;
+    float sample_rate = sensor_sample_rate_hz();
+    sensor_fifo_start();
+    while (acquisition_enabled) {
+        uint32_t lost_frames;
+        int frame_total = sensor_fifo_drain(fifo_frames, SENSOR_FIFO_BATCH_FRAMES, &lost_frames);
+        sequence += lost_frames;
+        for (int frame = 0; frame < frame_total; frame++) {
+            sensor_decode_frame(&fifo_frames[frame * SENSOR_BURST_LENGTH], sample.motion, sample.rotation, &sample.heat);
+            sample.sequence = sequence;
+            sample.time_us = (uint64_t)(sequence * (1000000.0 / sample_rate));
+            sample_ring_push(&sample_ring, &sample);
+            sequence += 1;
+        }
+        if (frame_total == 0) {
+            sleep_ms(1);
+        }
+    }
+    sensor_fifo_stop();
+#elif SENSOR_ACQUISITION_MODE == SENSOR_MODE_DRDY
+    // The GPIO IRQ is enabled from this core, so DATA_RDY is serviced here
+    sensor_ready_start();
+    while (acquisition_enabled) {
+        sensor_ready_event_t ready_event;
+        if (!sensor_ready_pop(&ready_event)) {
+            tight_loop_contents();
+            continue;
+        }
+        sensor_read_data(sample.motion, sample.rotation, &sample.heat);
+        sample.sequence = ready_event.sequence;
+        sample.time_us = ready_event.time_us - sensor_ready_start_time;
+        sample_ring_push(&sample_ring, &sample);
+    }
+    sensor_ready_stop();
+#else
+    uint32_t sequence = 0;
+    uint64_t period_us = (uint64_t)(1000000.0f / sensor_sample_rate_hz());
+    uint64_t start_time = time_us_64();
+    absolute_time_t next_sample_time = get_absolute_time();
+    while (acquisition_enabled) {
+        sensor_read_data(sample.motion, sample.rotation, &sample.heat);
+        sample.sequence = sequence;
+        sample.time_us = time_us_64() - start_time;
+        sample_ring_push(&sample_ring, &sample);
+        sequence += 1;
+        next_sample_time = delayed_by_us(next_sample_time, period_us);
+        sleep_until(next_sample_time);
+    }
+#endif
+}
+
+static void acquisition_core_entry() {
+    while (true) {
+        while (!acquisition_enabled) {
+            __wfe();
+        }
+        acquisition_running = true;
+        __sev();
+        run_acquisition();
+        acquisition_running = false;
+        __sev();
+    }
+}
+
+static void start_acquisition() {
+    sample_ring_reset(&sample_ring);
+    acquisition_enabled = true;
+    __sev();
+    while (!acquisition_running) {
+        __wfe();
+    }
+}
+
+static void stop_acquisition() {
+    acquisition_enabled = false;
+    while (acquisition_running) {
+        __wfe();
+    }
 }
 
 static sd_card_t *get_card_by_name(const char *const name)
@@ -127,6 +535,14 @@ static FATFS *get_filesystem_by_name(const char *name)
     return NULL;
 }
 
+static log_index_t log_index;
+
+static void select_next_log_file()
+{
+    file_counter = log_index_next_number(&log_index);
+    sprintf(data_filename, LOG_INDEX_PREFIX "%d." LOG_FILE_EXTENSION, file_counter);
+}
+
 static void execute_format()
 {
     switch_primary_locked = true;
@@ -159,6 +575,8 @@ static void execute_format()
         light_blink_flag = false;
         return;
     }
+    log_index_reset(&log_index);
+    select_next_log_file();
     switch_primary_locked = false;
     switch_secondary_locked = false;
     refresh_screen(3, 4);
@@ -166,6 +584,34 @@ static void execute_format()
     light_blink_flag = false;
 }
 
+static log_writer_t log_writer;
+
+// Sequential read speed of the drive, in KB/s (0 if skipped or failed). The
+// data read goes to the log writer's staging buffers, idle while not
+// recording, or to a buffer of its own when there are none.
+static uint32_t measure_read_throughput(sd_card_t *card){
+#if LOG_STAGING_SECTORS > 0
+    uint8_t *buffer = (uint8_t *)log_writer.buffers;
+    const uint32_t count = sizeof(log_writer.buffers) / FF_MAX_SS;
+#else
+    static uint8_t buffer[8 * FF_MAX_SS];
+    const uint32_t count = sizeof(buffer) / FF_MAX_SS;
+#endif
+    const uint32_t total = MOUNT_READ_TEST_KB * 2;
+    if(total == 0 || total > card->sectors){
+        return 0;
+    }
+    uint64_t start_time = time_us_64();
+    for(uint32_t sector = 0; sector < total; sector += count){
+        uint32_t n = total - sector < count ? total - sector : count;
+        if(card->read_blocks(card, buffer, sector, n) != SD_BLOCK_DEVICE_ERROR_NONE){
+            return 0;
+        }
+    }
+    uint64_t elapsed_us = time_us_64() - start_time;
+    return elapsed_us ? (uint32_t)(MOUNT_READ_TEST_KB * 1000000ULL / elapsed_us) : 0;
+}
+
 static void execute_mount()
 {
     switch_primary_locked = true;
@@ -202,6 +648,39 @@ static void execute_mount()
     myASSERT(card);
     card->mounted = true;
     printf("SD card mount process ( %s ) completed\n", card->pcName);
+    if(card->raid){
+        printf("%s over %u cards (%u working), %llu MB\n", card->raid->level == SD_RAID_STRIPE ? "RAID-0" : "RAID-1",
+            (unsigned)card->raid->member_count, (unsigned)(card->raid->member_count - __builtin_popcount(card->raid->failed)),
+            (unsigned long long)(card->sectors / 2048));
+    }
+    for(size_t i = 0; i < sd_raid_member_count(card); i++){
+        sd_card_t *member = sd_raid_member(card, i);
+        if(member->m_Status & STA_NOINIT){
+            continue;
+        }
+        printf("SD clock%s%s: %lu kHz, %s\n", card->raid ? " " : "", card->raid ? member->pcName : "",
+            (unsigned long)(spi_get_baudrate(member->spi->hw_inst) / 1000), member->high_speed ? "high speed" : "default speed");
+    }
+    uint32_t read_throughput = measure_read_throughput(card);
+    if(read_throughput > 0){
+        printf("SD sequential read: %lu KB/s\n", (unsigned long)read_throughput);
+    }
+    if(card->au_sectors > 0){
+        printf("SD allocation unit: %lu KB\n", (unsigned long)(card->au_sectors / 2));
+    }
+    uint32_t scan_start_time = time_us_32();
+    result = log_index_scan(&log_index);
+    if (FR_OK != result)
+    {
+        printf("Log scan error: %s (%d)\n", FRESULT_str(result), result);
+    }
+    select_next_log_file();
+    printf("%lu logs on the card (%llu bytes), next is %s (scan %lu ms)\n", (unsigned long)log_index.log_count,
+        (unsigned long long)log_index.total_size, data_filename, (unsigned long)((time_us_32() - scan_start_time) / 1000));
+    if (log_index.truncated)
+    {
+        printf("[WARNING] Stopped scanning after %d entries.\n", LOG_INDEX_SCAN_LIMIT);
+    }
     switch_primary_locked = false;
     switch_secondary_locked = false;
     refresh_screen(2, 1);
@@ -543,9 +1022,10 @@ void refresh_screen(int screen_id, int message_id){
         float last_roll, last_pitch;
         const float accel_threshold = 1.0f;
 
-        float ax = motion_data[0] / 16384.0f;
-        float ay = motion_data[1] / 16384.0f;
-        float az = motion_data[2] / 16384.0f;
+        float accel_scale = sensor_accel_lsb_per_g();
+        float ax = motion_data[0] / accel_scale;
+        float ay = motion_data[1] / accel_scale;
+        float az = motion_data[2] / accel_scale;
 
         float roll = atan2(ay, az) * 180.0f / M_PI;
         float pitch = atan2(-ax, sqrt(ay * ay + az * az)) * 180.0f / M_PI;
@@ -665,9 +1145,10 @@ void refresh_screen(int screen_id, int message_id){
         float last_roll, last_pitch;
         const float accel_threshold = 1.0f;
 
-        float ax = motion_data[0] / 16384.0f;
-        float ay = motion_data[1] / 16384.0f;
-        float az = motion_data[2] / 16384.0f;
+        float accel_scale = sensor_accel_lsb_per_g();
+        float ax = motion_data[0] / accel_scale;
+        float ay = motion_data[1] / accel_scale;
+        float az = motion_data[2] / accel_scale;
 
         float roll = atan2(ay, az) * 180.0f / M_PI;
         float pitch = atan2(-ax, sqrt(ay * ay + az * az)) * 180.0f / M_PI;
@@ -707,13 +1188,88 @@ void refresh_screen(int screen_id, int message_id){
     ssd1306_send_data(&display);
 }
 
+// Busy time of the card after each block, one line per write size
+static void print_busy_histogram(const sd_busy_histogram_t *histogram){
+    for(int row = 0; row < SD_BUSY_SIZE_CLASSES; row++){
+        uint32_t blocks = 0;
+        for(int column = 0; column < SD_BUSY_TIME_BUCKETS; column++){
+            blocks += histogram->count[row][column];
+        }
+        if(blocks == 0){
+            continue;
+        }
+        if(row == 0){
+            printf("SD busy, 1-sector writes:");
+        }else if(row == SD_BUSY_SIZE_CLASSES - 1){
+            printf("SD busy, writes of %d+ sectors:", 1 << row);
+        }else{
+            printf("SD busy, writes of %d-%d sectors:", 1 << row, (2 << row) - 1);
+        }
+        printf(" %lu blocks, avg %lu us, max %lu us |", (unsigned long)blocks,
+            (unsigned long)(histogram->total_us[row] / blocks), (unsigned long)histogram->max_us[row]);
+        for(int column = 0; column < SD_BUSY_TIME_BUCKETS; column++){
+            if(histogram->count[row][column] == 0){
+                continue;
+            }
+            if(column == SD_BUSY_TIME_BUCKETS - 1){
+                printf(" >=%luus:%lu", 1UL << (column + 4), (unsigned long)histogram->count[row][column]);
+            }else{
+                printf(" <%luus:%lu", 1UL << (column + 5), (unsigned long)histogram->count[row][column]);
+            }
+        }
+        printf("\n");
+    }
+}
+
+static void abort_recording(FIL *data_file){
+    printf("[ERROR] Could not write to file. Mount the card.\n");
+    switch_primary_locked = false;
+    refresh_screen(4, 3);
+    activate_sound(100, 3);
+    light_blink_flag = false;
+    log_writer_abort(&log_writer);
+    f_close(data_file);
+}
+
+static bool store_sample(const sensor_sample_t *sample){
+    sample_count = sample->sequence;
+    elapsed_time = sample->time_us / 1000000.0f;
+    for (int i = 0; i < 3; i++) {
+        motion_data[i] = sample->motion[i];
+        rotation_data[i] = sample->rotation[i];
+    }
+    heat_reading = sample->heat;
+
+#if LOG_FORMAT == LOG_FORMAT_BINARY
+    uint8_t data_buffer[LOG_RECORD_SIZE];
+    log_record_encode(data_buffer, sample);
+    size_t length = LOG_RECORD_SIZE;
+#else
+    char data_buffer[RECORD_CSV_MAX_LENGTH];
+    size_t length = record_format_csv(data_buffer, sample);
+#endif
+    if (log_writer_append(&log_writer, data_buffer, length) != FR_OK)
+    {
+        abort_recording(log_writer.file);
+        return false;
+    }
+    return true;
+}
+
 void store_sensor_data(){
     switch_primary_locked = true;
     activate_sound(100, 1);
     blink_light(0, 0, 1);
 
     FIL data_file;
-    FRESULT result = f_open(&data_file, data_filename, FA_WRITE | FA_CREATE_ALWAYS);
+    FRESULT result = f_open(&data_file, data_filename, FA_WRITE | FA_CREATE_NEW);
+    while (result == FR_EXIST)
+    {
+        // Only when the scan was cut short or did not run: never overwrite a log.
+        log_index_add(&log_index, file_counter, 0);
+        select_next_log_file();
+        result = f_open(&data_file, data_filename, FA_WRITE | FA_CREATE_NEW);
+    }
     if (result != FR_OK)
     {
         printf("\n[ERROR] Could not open file for writing. Mount the card.\n");
@@ -724,54 +1280,184 @@ void store_sensor_data(){
         return;
     }
     recording_active = true;
-
-    char data_buffer[80];
-    sprintf(data_buffer, "sample_number,time_s,motion_x,motion_y,motion_z,rotation_x,rotation_y,rotation_z\n");   
-    UINT bytes_written;
-    result = f_write(&data_file, data_buffer, strlen(data_buffer), &bytes_written);
+    log_writer_init(&log_writer, &data_file);
+#if LOG_EXPECTED_SECONDS > 0
+    // Plus room for the header
+    result = log_writer_preallocate(&log_writer,
+        (FSIZE_t)(LOG_EXPECTED_SECONDS * sensor_sample_rate_hz()) * LOG_RECORD_BYTES + 4096);
+#elif LOG_PREALLOCATE_MB > 0
+    result = log_writer_preallocate(&log_writer, (FSIZE_t)LOG_PREALLOCATE_MB * 1024 * 1024);
+#endif
+#if LOG_EXPECTED_SECONDS > 0 || LOG_PREALLOCATE_MB > 0
     if (result != FR_OK)
     {
-        printf("[ERROR] Could not write to file. Mount the card.\n");
-        switch_primary_locked = false;
-        refresh_screen(4, 3);
-        activate_sound(100, 3);
-        light_blink_flag = false;
-        f_close(&data_file);
+        printf("[WARNING] Could not preallocate %s (%s), growing it as it is written.\n", data_filename, FRESULT_str(result));
+    }
+#endif
+    disk_stats_reset();
+    sd_card_t *card = sd_get_by_num(0);
+    for(size_t i = 0; i < sd_raid_member_count(card); i++){
+        sd_card_t *member = sd_raid_member(card, i);
+        member->write_commands = 0;
+        member->write_sectors = 0;
+        memset(&member->busy_histogram, 0, sizeof(member->busy_histogram));
+    }
+
+#if LOG_FORMAT == LOG_FORMAT_BINARY
+    log_header_t header;
+    log_header_init(&header);
+    header.sample_rate_hz = sensor_sample_rate_hz();
+    header.accel_lsb_per_g = sensor_accel_lsb_per_g();
+    header.gyro_lsb_per_dps = sensor_gyro_lsb_per_dps();
+    header.dlpf = sensor_config.dlpf;
+    header.accel_range_g = 2 << sensor_config.accel_range;
+    header.gyro_range_dps = 250 << sensor_config.gyro_range;
+    header.start_time_us = time_us_64();
+    uint8_t data_buffer[LOG_HEADER_SIZE];
+    log_header_encode(data_buffer, &header);
+    size_t length = LOG_HEADER_SIZE;
+#else
+    char data_buffer[200];
+    sprintf(data_buffer, "# sample_rate_hz=%.2f,dlpf_cfg=%d,accel_range_g=%d,gyro_range_dps=%d,accel_lsb_per_g=%.1f,gyro_lsb_per_dps=%.3f\n"
+        "sample_number,time_s,motion_x,motion_y,motion_z,rotation_x,rotation_y,rotation_z\n",
+        sensor_sample_rate_hz(), sensor_config.dlpf, 2 << sensor_config.accel_range, 250 << sensor_config.gyro_range,
+        sensor_accel_lsb_per_g(), sensor_gyro_lsb_per_dps());
+    size_t length = strlen(data_buffer);
+#endif
+    if (log_writer_append(&log_writer, data_buffer, length) != FR_OK)
+    {
+        abort_recording(&data_file);
         return;
     }
+    sensor_sample_t sample;
+    uint32_t last_refresh_time = time_us_32();
+    start_acquisition();
     while(recording_active){
-        sensor_read_data(motion_data, rotation_data, &heat_reading);
-
-        sprintf(data_buffer,"%d,%.1f,%d,%d,%d,%d,%d,%d\n", sample_count, elapsed_time, motion_data[0], motion_data[1], motion_data[2], rotation_data[0], rotation_data[1], rotation_data[2]);
-        result = f_write(&data_file, data_buffer, strlen(data_buffer), &bytes_written);
-        if (result != FR_OK)
+        for (int pending = 0; pending < 64 && sample_ring_pop(&sample_ring, &sample); pending++) {
+            if (!store_sample(&sample))
+            {
+                stop_acquisition();
+                return;
+            }
+            log_writer_poll(&log_writer);
+        }
+        log_writer_poll(&log_writer);
+        if (log_writer_checkpoint(&log_writer) != FR_OK)
         {
-            printf("[ERROR] Could not write to file. Mount the card.\n");
-            switch_primary_locked = false;
-            refresh_screen(4, 3);
-            activate_sound(100, 3);
-            light_blink_flag = false;
-            f_close(&data_file);
+            stop_acquisition();
+            abort_recording(&data_file);
             return;
         }
-        refresh_screen(6, 1);
-        sleep_ms(100);
-        sample_count += 1;
-        elapsed_time += 0.1;
+        if (time_us_32() - last_refresh_time > 100000) {
+            last_refresh_time = time_us_32();
+            refresh_screen(6, 1);
+        }
     }
+    stop_acquisition();
+    while (sample_ring_pop(&sample_ring, &sample)) {
+        if (!store_sample(&sample))
+        {
+            return;
+        }
+    }
+    if (log_writer_finish(&log_writer) != FR_OK)
+    {
+        abort_recording(&data_file);
+        return;
+    }
+    log_index_add(&log_index, file_counter, f_size(&data_file));
     f_close(&data_file);
-    printf("\nMPU data saved to file %s.\n\n", data_filename);
+    printf("\nMPU data saved to file %s.\n", data_filename);
+    if(elapsed_time > 0){
+        printf("Disk writes: %lu calls, %lu sectors (%.1f calls/s, %.1f sectors/s); reads: %lu calls, %lu sectors\n",
+            (unsigned long)disk_stats.write_calls, (unsigned long)disk_stats.write_sectors,
+            disk_stats.write_calls / elapsed_time, disk_stats.write_sectors / elapsed_time,
+            (unsigned long)disk_stats.read_calls, (unsigned long)disk_stats.read_sectors);
+    }
+    if(disk_stats.read_sectors > 0){
+        printf("Disk read commands: %lu for %lu calls, %lu sectors read ahead (%.1f commands saved/MB)\n",
+            (unsigned long)disk_stats.read_commands, (unsigned long)disk_stats.read_calls, (unsigned long)disk_stats.readahead_hits,
+            (disk_stats.read_calls - disk_stats.read_commands) / (disk_stats.read_sectors / 2048.0f));
+    }
+    if(disk_stats.cache_flush_runs > 0){
+        printf("Sector cache: %lu read hits, %lu write hits (%.1f%% of sectors written), %lu sectors written back in %lu runs (%.1f sectors/run)\n",
+            (unsigned long)disk_stats.cache_read_hits, (unsigned long)disk_stats.cache_write_hits,
+            disk_stats.write_sectors ? 100.0f * disk_stats.cache_write_hits / disk_stats.write_sectors : 0.0f,
+            (unsigned long)disk_stats.cache_flush_sectors, (unsigned long)disk_stats.cache_flush_runs,
+            (float)disk_stats.cache_flush_sectors / disk_stats.cache_flush_runs);
+    }
+    for(size_t i = 0; i < sd_raid_member_count(card); i++){
+        sd_card_t *member = sd_raid_member(card, i);
+        if(card->raid){
+            printf("Card %s:\n", member->pcName);
+        }
+        if(member->write_commands > 0){
+            printf("SD write commands: %lu, %.1f sectors/command\n", (unsigned long)member->write_commands,
+                (float)member->write_sectors / member->write_commands);
+        }
+        print_busy_histogram(&member->busy_histogram);
+        if(sd_busy_percentile_us(&member->busy_histogram, 100) > 0){
+            printf("SD busy per block: p50 < %lu us, p90 < %lu us, p99 < %lu us, max %lu us (pre-erase hint: ",
+                (unsigned long)sd_busy_percentile_us(&member->busy_histogram, 50), (unsigned long)sd_busy_percentile_us(&member->busy_histogram, 90),
+                (unsigned long)sd_busy_percentile_us(&member->busy_histogram, 99), (unsigned long)sd_busy_percentile_us(&member->busy_histogram, 100));
+            if(log_writer.pre_erase_sectors > 0){
+                printf("%lu sectors)\n", (unsigned long)log_writer.pre_erase_sectors);
+            }else{
+                printf("none)\n");
+            }
+        }
+    }
+    if(log_writer.syncs > 0){
+        printf("Checkpoints: %lu, f_sync avg %lu us, max %lu us\n", (unsigned long)log_writer.syncs,
+            (unsigned long)(log_writer.sync_time_total_us / log_writer.syncs), (unsigned long)log_writer.sync_time_max_us);
+    }
+    if(sensor_bus_reads > 0){
+        printf("Sensor bus time: %lu us/sample (%lu samples)\n", (unsigned long)(sensor_bus_time_total_us / sensor_bus_reads), (unsigned long)sensor_bus_reads);
+    }
+#if SENSOR_ACQUISITION_MODE == SENSOR_MODE_FIFO
+    printf("FIFO overflows: %lu, lost frames: %lu\n", (unsigned long)sensor_fifo_overflows, (unsigned long)sensor_fifo_lost_frames);
+#elif SENSOR_ACQUISITION_MODE == SENSOR_MODE_DRDY
+    printf("DATA_RDY events: %lu, missed: %lu, skipped: %lu\n", (unsigned long)sensor_ready_events, (unsigned long)sensor_ready_missed, (unsigned long)sensor_ready_skipped);
+#endif
+    printf("Sample ring: high-water %lu of %d, overruns %lu\n", (unsigned long)sample_ring.high_water, SAMPLE_RING_SIZE, (unsigned long)sample_ring.overruns);
+    printf("\n");
     switch_primary_locked = false;
     refresh_screen(4, 2);
     sample_count = 0;
     elapsed_time = 0.0;
-    file_counter += 1;
-    sprintf(data_filename, "sensor_log%d.csv", file_counter);
+    select_next_log_file();
     activate_sound(100, 2);
     light_blink_flag = false;
 }
 
+// Commands over USB stdio, between recordings: 's' prints the driver's
+// latency statistics and stall trace of each card, 'c' clears them
+static void process_console_input(){
+    int c = getchar_timeout_us(0);
+    if(c == PICO_ERROR_TIMEOUT){
+        return;
+    }
+    for(size_t i = 0; i < sd_get_num(); i++){
+        sd_card_t *drive = sd_get_by_num(i);
+        for(size_t j = 0; j < sd_raid_member_count(drive); j++){
+            sd_card_t *card = sd_raid_member(drive, j);
+            if(c == 's'){
+                sd_latency_print(&card->latency, card->pcName);
+                print_busy_histogram(&card->busy_histogram);
+            }else if(c == 'c'){
+                sd_latency_reset(&card->latency);
+                memset(&card->busy_histogram, 0, sizeof(card->busy_histogram));
+                printf("SD %s latency statistics cleared\n", card->pcName);
+            }
+        }
+    }
+}
+
 void gpio_interrupt_handler(uint gpio, uint32_t events){
+    if(gpio == SENSOR_INT_PIN){
+        sensor_ready_push(time_us_64());
+        return;
+    }
     uint32_t current_time = to_us_since_boot(get_absolute_time());
     if(current_time - last_click_time > 1000000){
         last_click_time = current_time;
@@ -840,6 +1526,9 @@ int main()
     gpio_init(SWITCH_JOYSTICK);
     gpio_set_dir(SWITCH_JOYSTICK, GPIO_IN);
     gpio_pull_up(SWITCH_JOYSTICK);
+    gpio_init(SENSOR_INT_PIN);
+    gpio_set_dir(SENSOR_INT_PIN, GPIO_IN);
+    gpio_pull_down(SENSOR_INT_PIN);
     gpio_set_irq_enabled_with_callback(SWITCH_PRIMARY, GPIO_IRQ_EDGE_FALL, true, &gpio_interrupt_handler);
     gpio_set_irq_enabled_with_callback(SWITCH_SECONDARY, GPIO_IRQ_EDGE_FALL, true, &gpio_interrupt_handler);
     gpio_set_irq_enabled_with_callback(SWITCH_JOYSTICK, GPIO_IRQ_EDGE_FALL, true, &gpio_interrupt_handler);
@@ -865,8 +1554,14 @@ int main()
     set_light_color(1, 1, 0);
     sleep_ms(2000);
 
+#if LOGGER_BENCHMARKS
+    run_benchmarks();
+#endif
+
     bi_decl(bi_2pins_with_func(SENSOR_DATA_PIN, SENSOR_CLOCK_PIN, GPIO_FUNC_I2C));
     sensor_reset();
+    sensor_configure(&sensor_config);
+    multicore_launch_core1(acquisition_core_entry);
     
     switch_primary_locked = false;
     switch_secondary_locked = false;
@@ -898,6 +1593,7 @@ int main()
             sensor_read_data(motion_data, rotation_data, &heat_reading);
             refresh_screen(5, 1);
         }
+        process_console_input();
 
         sleep_ms(100);
     }
@@ -5,6 +5,14 @@
 #include "hw_config.h"
 #include "ff.h"
 #include "diskio.h"
+#include "sd_raid.h"
+
+// Two cards as one drive, on spi0 and spi1: SD_RAID_STRIPE (RAID-0) for
+// bandwidth or SD_RAID_MIRROR (RAID-1) for redundancy. SD_RAID_NONE uses
+// the card on spi0 alone.
+#ifndef SD_RAID
+#define SD_RAID SD_RAID_NONE
+#endif
 
 static spi_t spi_controllers[] = {
     {
@@ -13,8 +21,19 @@ static spi_t spi_controllers[] = {
         .mosi_gpio = 19,
         .sck_gpio = 18,
         .baud_rate = 1000 * 1000
-    }};
+    },
+#if SD_RAID != SD_RAID_NONE
+    {
+        .hw_inst = spi1,
+        .miso_gpio = 28,
+        .mosi_gpio = 27,
+        .sck_gpio = 26,
+        .baud_rate = 1000 * 1000
+    },
+#endif
+};
 
+#if SD_RAID == SD_RAID_NONE
 static sd_card_t storage_devices[] = {
     {
         .pcName = "0:",
@@ -24,6 +43,37 @@ static sd_card_t storage_devices[] = {
         .card_detect_gpio = 22,
         .card_detected_true = -1
     }};
+#else
+// One card on each SPI bus, seen by FatFs as the single drive "0:"
+static sd_card_t raid_members[] = {
+    {
+        .pcName = "0:a",
+        .spi = &spi_controllers[0],
+        .ss_gpio = 17,
+        .use_card_detect = false,
+        .card_detect_gpio = 22,
+        .card_detected_true = -1
+    },
+    {
+        .pcName = "0:b",
+        .spi = &spi_controllers[1],
+        .ss_gpio = 20,
+        .use_card_detect = false,
+        .card_detected_true = -1
+    }};
+
+static sd_raid_t raid = {
+    .level = SD_RAID,
+    .member_count = count_of(raid_members),
+    .members = {&raid_members[0], &raid_members[1]}
+};
+
+static sd_card_t storage_devices[] = {
+    {
+        .pcName = "0:",
+        .raid = &raid
+    }};
+#endif
 
 size_t sd_get_num() { return count_of(storage_devices); }
 sd_card_t *sd_get_by_num(size_t num) {
@@ -0,0 +1,45 @@
+/* disk_async.h
+Licensed under the Apache License, Version 2.0 (the License); you may not use 
+this file except in compliance with the License. You may obtain a copy of the 
+License at
+
+   http://www.apache.org/licenses/LICENSE-2.0 
+Unless required by applicable law or agreed to in writing, software distributed 
+under the License is distributed on an AS IS BASIS, WITHOUT WARRANTIES OR 
+CONDITIONS OF ANY KIND, either express or implied. See the License for the 
+specific language governing permissions and limitations under the License.
+*/
+#pragma once
+
+#include <stddef.h>
+
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Background writes through FatFs.
+//
+// FatFs expects disk_write() to be finished with the buffer when it returns,
+// and reuses its own sector buffers right away. So the glue only writes
+// asynchronously (sd_write_blocks_async) when the data comes from a buffer
+// the application registered here. The application promises not to modify
+// that buffer until the write is complete. A buffer written with f_write()
+// is passed straight to disk_write() when the write covers whole, aligned
+// sectors.
+//
+// When disk_write() returns, every write from the buffer before its own is
+// complete, so the application may refill those parts. On a card, that is
+// the only write in flight; a RAID device (sd_raid.h) may also have its own
+// in flight on other members. Any other disk operation, f_sync() included,
+// first completes them and returns their error, if any. disk_async_poll()
+// moves them along in the meantime.
+void disk_async_register(BYTE pdrv, const void *buffer, size_t size);
+void disk_async_unregister(BYTE pdrv);
+void disk_async_poll(BYTE pdrv);
+
+#ifdef __cplusplus
+}
+#endif
+/* [] END OF FILE */
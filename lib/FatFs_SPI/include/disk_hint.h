@@ -0,0 +1,32 @@
+/* disk_hint.h
+Licensed under the Apache License, Version 2.0 (the License); you may not use 
+this file except in compliance with the License. You may obtain a copy of the 
+License at
+
+   http://www.apache.org/licenses/LICENSE-2.0 
+Unless required by applicable law or agreed to in writing, software distributed 
+under the License is distributed on an AS IS BASIS, WITHOUT WARRANTIES OR 
+CONDITIONS OF ANY KIND, either express or implied. See the License for the 
+specific language governing permissions and limitations under the License.
+*/
+#pragma once
+
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hints from the application about upcoming disk access, passed by the
+// glue (glue.c) to the driver.
+//
+// disk_pre_erase: count sectors from sector on will be written in sequence
+// and their current contents may be discarded, e.g. a region reserved with
+// f_expand. The card is asked to erase them ahead of the writes (ACMD23).
+// A count of 0 clears the hint.
+void disk_pre_erase(BYTE pdrv, LBA_t sector, LBA_t count);
+
+#ifdef __cplusplus
+}
+#endif
+/* [] END OF FILE */
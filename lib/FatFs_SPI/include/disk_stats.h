@@ -0,0 +1,47 @@
+/* disk_stats.h
+Licensed under the Apache License, Version 2.0 (the License); you may not use 
+this file except in compliance with the License. You may obtain a copy of the 
+License at
+
+   http://www.apache.org/licenses/LICENSE-2.0 
+Unless required by applicable law or agreed to in writing, software distributed 
+under the License is distributed on an AS IS BASIS, WITHOUT WARRANTIES OR 
+CONDITIONS OF ANY KIND, either express or implied. See the License for the 
+specific language governing permissions and limitations under the License.
+*/
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Counters kept by the diskio glue (glue.c) for every disk_read/disk_write
+// call FatFs makes, to see how application writes map to card transfers.
+typedef struct {
+    uint32_t read_calls;
+    uint32_t read_sectors;
+    uint32_t write_calls;
+    uint32_t write_sectors;
+    // Read commands sent to the card, and sectors served by the read-ahead
+    // window (DISK_READ_AHEAD_SECTORS) without one
+    uint32_t read_commands;
+    uint32_t readahead_hits;
+    // Sector cache (DISK_CACHE_SECTORS): sectors read from it, sector writes
+    // that replaced a cached sector not yet written, and the sectors written
+    // back to the card in how many runs of consecutive sectors
+    uint32_t cache_read_hits;
+    uint32_t cache_write_hits;
+    uint32_t cache_flush_sectors;
+    uint32_t cache_flush_runs;
+} disk_stats_t;
+
+extern disk_stats_t disk_stats;
+
+void disk_stats_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+/* [] END OF FILE */
@@ -84,33 +84,118 @@ static const unsigned short m_Crc16Table[256] = {0x0000, 0x1021, 0x2042,
 	0x8FD9, 0x9FF8, 0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1,
 	0x1EF0};
 
+// Slicing-by-N: CRC16 takes CRC16_SLICES (1, 4 or 8) and CRC7 takes
+// CRC7_SLICES (1 or 4) bytes per step, using tables derived from the ones
+// above the first time a CRC is computed. They cost (N - 1) * 512 bytes of
+// RAM for CRC16 and N * 256 bytes for CRC7. N = 1 is the plain byte-at-a-time
+// table lookup. Input bytes are treated as unsigned whatever the signedness
+// of char.
+#ifndef CRC16_SLICES
+#define CRC16_SLICES 4
+#endif
+#ifndef CRC7_SLICES
+#define CRC7_SLICES 4
+#endif
+
+#if CRC16_SLICES != 1 && CRC16_SLICES != 4 && CRC16_SLICES != 8
+#error "CRC16_SLICES must be 1, 4 or 8"
+#endif
+#if CRC7_SLICES != 1 && CRC7_SLICES != 4
+#error "CRC7_SLICES must be 1 or 4"
+#endif
+
+#if CRC16_SLICES > 1 || CRC7_SLICES > 1
+#include <stdbool.h>
+
+// m_Crc16Slices[k][x] is the CRC16 of byte x followed by k + 1 zero bytes.
+#if CRC16_SLICES > 1
+static unsigned short m_Crc16Slices[CRC16_SLICES - 1][256];
+#endif
+// m_Crc7Slices[k][x] is the CRC7 of byte x followed by k zero bytes, shifted
+// left by one so that the state is a left-aligned 8-bit CRC.
+#if CRC7_SLICES > 1
+static unsigned char m_Crc7Slices[CRC7_SLICES][256];
+#endif
+// Building the tables twice (e.g. from both cores) writes the same values.
+static volatile bool m_CrcSlicesReady;
+
+static void crc_init_slices(void)
+{
+	for (int x = 0; x < 256; x++) {
+#if CRC16_SLICES > 1
+		unsigned short c16 = m_Crc16Table[x];
+		for (int k = 0; k < CRC16_SLICES - 1; k++) {
+			c16 = (c16 << 8) ^ m_Crc16Table[c16 >> 8];
+			m_Crc16Slices[k][x] = c16;
+		}
+#endif
+#if CRC7_SLICES > 1
+		unsigned char c7 = m_Crc7Table[x] << 1;
+		m_Crc7Slices[0][x] = c7;
+		for (int k = 1; k < CRC7_SLICES; k++) {
+			c7 = m_Crc7Table[c7] << 1;
+			m_Crc7Slices[k][x] = c7;
+		}
+#endif
+	}
+	m_CrcSlicesReady = true;
+}
+#endif
+
 char crc7(const char* data, int length)
 {
 	//Calculate the CRC7 checksum for the specified data block
-	char crc = 0;
+	const unsigned char *p = (const unsigned char *)data;
+	unsigned char crc = 0;
+#if CRC7_SLICES > 1
+	if (!m_CrcSlicesReady)
+		crc_init_slices();
+	// Left-aligned state, 4 bytes per step
+	unsigned char state = 0;
+	for (; length >= 4; length -= 4, p += 4) {
+		state = m_Crc7Slices[3][state ^ p[0]] ^ m_Crc7Slices[2][p[1]] ^
+			m_Crc7Slices[1][p[2]] ^ m_Crc7Slices[0][p[3]];
+	}
+	crc = state >> 1;
+#endif
 	for (int i = 0; i < length; i++) {
-		crc = m_Crc7Table[(crc << 1) ^ data[i]];
+		crc = m_Crc7Table[(crc << 1) ^ p[i]];
 	}
 
 	//Return the calculated checksum
 	return crc;
 }
 
+void update_crc16(unsigned short *pCrc16, const char data[], size_t length) {
+	const unsigned char *p = (const unsigned char *)data;
+	unsigned short crc = *pCrc16;
+#if CRC16_SLICES > 1
+	if (!m_CrcSlicesReady)
+		crc_init_slices();
+	for (; length >= CRC16_SLICES; length -= CRC16_SLICES, p += CRC16_SLICES) {
+#if CRC16_SLICES == 8
+		crc = m_Crc16Slices[6][(crc >> 8) ^ p[0]] ^ m_Crc16Slices[5][(crc & 0xFF) ^ p[1]] ^
+			m_Crc16Slices[4][p[2]] ^ m_Crc16Slices[3][p[3]] ^ m_Crc16Slices[2][p[4]] ^
+			m_Crc16Slices[1][p[5]] ^ m_Crc16Slices[0][p[6]] ^ m_Crc16Table[p[7]];
+#else
+		crc = m_Crc16Slices[2][(crc >> 8) ^ p[0]] ^ m_Crc16Slices[1][(crc & 0xFF) ^ p[1]] ^
+			m_Crc16Slices[0][p[2]] ^ m_Crc16Table[p[3]];
+#endif
+	}
+#endif
+	for (size_t i = 0; i < length; i++) {
+		crc = (crc << 8) ^ m_Crc16Table[((crc >> 8) ^ p[i]) & 0x00FF];
+	}
+	*pCrc16 = crc;
+}
+
 unsigned short crc16(const char* data, int length)
 {
 	//Calculate the CRC16 checksum for the specified data block
 	unsigned short crc = 0;
-	for (int i = 0; i < length; i++) {
-		crc = (crc << 8) ^ m_Crc16Table[((crc >> 8) ^ data[i]) & 0x00FF];
-	}
+	update_crc16(&crc, data, length);
 
 	//Return the calculated checksum
 	return crc;
 }
-
-void update_crc16(unsigned short *pCrc16, const char data[], size_t length) {
-	for (size_t i = 0; i < length; i++) {
-		*pCrc16 = (*pCrc16 << 8) ^ m_Crc16Table[((*pCrc16 >> 8) ^ data[i]) & 0x00FF];
-	}    
-}
 /* [] END OF FILE */
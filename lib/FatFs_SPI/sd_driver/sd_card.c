@@ -163,13 +163,17 @@ specific language governing permissions and limitations under the License.
 #include <inttypes.h>
 #include <string.h>
 //
+#include "hardware/sync.h"
+#include "hardware/timer.h"
 #include "pico/mutex.h"
+#include "pico/time.h"
 //
 #include "hw_config.h"  // Hardware Configuration of the SPI and SD Card "objects"
 #include "my_debug.h"
 #include "sd_spi.h"
 //
 #include "sd_card.h"
+#include "sd_raid.h"
 //
 #include "ff.h" /* Obtains integer types */
 //
@@ -184,6 +188,63 @@ specific language governing permissions and limitations under the License.
 static bool crc_on = true;
 #endif
 
+// Route sd_write_blocks through a write session, so that consecutive writes
+// continue one open CMD25 instead of each paying for its own command, STOP_TRAN
+// and CMD13. The session is closed by the next read, a non-contiguous write or
+// sd_write_session_close() (called by the glue on CTRL_SYNC).
+#ifndef SD_WRITE_STREAMING
+#define SD_WRITE_STREAMING 1
+#endif
+
+// Asynchronous writes check the card's busy state from a timer alarm, every
+// SD_BUSY_POLL_US while the busy time is within the card's usual one (the
+// 90th percentile of busy_histogram), then at doubling intervals up to
+// SD_BUSY_POLL_MAX_US, so a stall costs a handful of checks.
+#ifndef SD_BUSY_POLL_US
+#define SD_BUSY_POLL_US 32
+#endif
+#ifndef SD_BUSY_POLL_MAX_US
+#define SD_BUSY_POLL_MAX_US 1024
+#endif
+
+// At init, raise the SPI clock above spi_t.baud_rate, up to SD_CLOCK_MAX_HZ,
+// as far as the card and the wiring pass CRC-checked reads, and writes to a
+// sector outside the partitions if there is one. The rate found is
+// remembered per card CID and bus mode (default or High Speed), in RAM and
+// in that sector if it held nothing else, so that remounting the card, or
+// mounting it after a reset, skips the calibration.
+#ifndef SD_CLOCK_AUTOTUNE
+#define SD_CLOCK_AUTOTUNE 1
+#endif
+#ifndef SD_CLOCK_MAX_HZ
+#define SD_CLOCK_MAX_HZ (25 * 1000 * 1000)
+#endif
+#ifndef SD_CLOCK_CACHE_SIZE
+#define SD_CLOCK_CACHE_SIZE 4
+#endif
+#define SD_CLOCK_PASSES 4 /*!< Reads (and write/read round trips) per clock rate */
+
+// At init, switch cards that support it to High Speed mode (CMD6), which
+// raises their clock limit from 25 to 50 MHz; the clock calibration then
+// goes up to SD_CLOCK_HS_MAX_HZ instead of SD_CLOCK_MAX_HZ.
+#ifndef SD_HIGH_SPEED
+#define SD_HIGH_SPEED 1
+#endif
+#ifndef SD_CLOCK_HS_MAX_HZ
+#define SD_CLOCK_HS_MAX_HZ (50 * 1000 * 1000)
+#endif
+
+// Largest pre-erase count sent with one ACMD23 (see sd_set_pre_erase): a
+// card may erase the whole count before it accepts the first block
+#ifndef SD_PRE_ERASE_MAX_SECTORS
+#define SD_PRE_ERASE_MAX_SECTORS 8192
+#endif
+
+// Erase timeout per AU for cards whose SD Status gives no erase timing
+#ifndef SD_ERASE_TIMEOUT_PER_AU_MS
+#define SD_ERASE_TIMEOUT_PER_AU_MS 250
+#endif
+
 #define TRACE_PRINTF(fmt, args...)
 // #define TRACE_PRINTF printf
 
@@ -373,8 +434,17 @@ static void sd_unlock(sd_card_t *pSD) {
     mutex_exit(&pSD->mutex);
 }
 
+#define SD_ASYNC_IDLE 0
+#define SD_ASYNC_DATA 1 /*!< DMA of a block in flight */
+#define SD_ASYNC_BUSY 2 /*!< Card programming a block */
+#define SD_ASYNC_DONE 3 /*!< Waiting for the starting core to finish it */
+
 // Locks the SD card and acquires its SPI
 static void sd_acquire(sd_card_t *pSD) {
+    // An asynchronous write started on this core holds the lock until it
+    // completes, so complete it rather than deadlock
+    if (SD_ASYNC_IDLE != pSD->async.state && get_core_num() == pSD->async.core)
+        sd_write_async_wait(pSD);
     sd_lock(pSD);
     sd_spi_acquire(pSD);
 }
@@ -614,6 +684,8 @@ static int sd_cmd(sd_card_t *pSD, const cmdSupported cmd, uint32_t arg,
 /* Return non-zero if the SD-card is present. */
 bool sd_card_detect(sd_card_t *pSD) {
     TRACE_PRINTF("> %s\r\n", __FUNCTION__);
+    if (pSD->raid)
+        return sd_raid_card_detect(pSD);
     if (!pSD->use_card_detect) {
         pSD->m_Status &= ~STA_NODISK;
         return true;
@@ -696,6 +768,7 @@ static uint32_t ext_bits(unsigned char *data, int msb, int lsb) {
 }
 
 static int sd_read_bytes(sd_card_t *pSD, uint8_t *buffer, uint32_t length);
+static int in_sd_write_session_close(sd_card_t *pSD);
 
 static uint64_t sd_sectors_nolock(sd_card_t *pSD) {
     uint32_t c_size, c_size_mult, read_bl_len;
@@ -753,7 +826,11 @@ static uint64_t sd_sectors_nolock(sd_card_t *pSD) {
     return blocks;
 }
 uint64_t sd_sectors(sd_card_t *pSD) {
+    if (pSD->raid)
+        return pSD->sectors;
     sd_acquire(pSD);
+    // CMD9 is not accepted in the middle of a CMD25
+    in_sd_write_session_close(pSD);
     uint64_t sectors = sd_sectors_nolock(pSD);
     sd_release(pSD);
     return sectors;
@@ -819,7 +896,18 @@ static int sd_read_block(sd_card_t *pSD, uint8_t *buffer, uint32_t length) {
     }
     // read data
     // bool spi_transfer(const uint8_t *tx, uint8_t *rx, size_t length)
-    if (!sd_spi_transfer(pSD, NULL, buffer, length)) {
+    uint16_t crc_result = 0;
+    bool ret;
+#if SD_CRC_ENABLED
+    if (crc_on) {
+        // Checksum computed during the transfer
+        ret = sd_spi_transfer_crc(pSD, NULL, buffer, length, &crc_result);
+    } else
+#endif
+    {
+        ret = sd_spi_transfer(pSD, NULL, buffer, length);
+    }
+    if (!ret) {
         return SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
     }
     // Read the CRC16 checksum for the data block
@@ -828,10 +916,8 @@ static int sd_read_block(sd_card_t *pSD, uint8_t *buffer, uint32_t length) {
 
 #if SD_CRC_ENABLED
     if (crc_on) {
-        uint32_t crc_result;
-        // Compute and verify checksum
-        crc_result = crc16((void *)buffer, length);
-        if ((uint16_t)crc_result != crc) {
+        // Verify checksum
+        if (crc_result != crc) {
             DBG_PRINTF("%s: Invalid CRC received 0x%" PRIx16
                        " result of computation 0x%" PRIx16 "\r\n",
                        __FUNCTION__, crc, (uint16_t)crc_result);
@@ -843,6 +929,13 @@ static int sd_read_block(sd_card_t *pSD, uint8_t *buffer, uint32_t length) {
     return SD_BLOCK_DEVICE_ERROR_NONE;
 }
 
+// Counts an operation that started at start_us in the card's latency statistics
+static void sd_latency_done(sd_card_t *pSD, sd_op_t op, uint64_t sector, uint32_t blocks,
+                            uint64_t start_us) {
+    uint64_t end_us = time_us_64();
+    sd_latency_record(&pSD->latency, op, sector, blocks, end_us - start_us, end_us);
+}
+
 static int in_sd_read_blocks(sd_card_t *pSD, uint8_t *buffer,
                              uint64_t ulSectorNumber, uint32_t ulSectorCount) {
     uint32_t blockCnt = ulSectorCount;
@@ -893,13 +986,47 @@ int sd_read_blocks(sd_card_t *pSD, uint8_t *buffer, uint64_t ulSectorNumber,
     sd_acquire(pSD);
     TRACE_PRINTF("sd_read_blocks(0x%p, 0x%llx, 0x%lx)\r\n", buffer,
                  ulSectorNumber, ulSectorCount);
-    int status = in_sd_read_blocks(pSD, buffer, ulSectorNumber, ulSectorCount);
+    uint64_t start_us = time_us_64();
+    int status = in_sd_write_session_close(pSD);
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+        status = in_sd_read_blocks(pSD, buffer, ulSectorNumber, ulSectorCount);
+    sd_latency_done(pSD, SD_OP_READ, ulSectorNumber, ulSectorCount, start_us);
     sd_release(pSD);
     return status;
 }
 
+// Counts a busy time of the card after a block of a write of blocks blocks
+static void sd_busy_record(sd_card_t *pSD, uint32_t blocks, uint32_t busy_us) {
+    sd_busy_histogram_t *histogram = &pSD->busy_histogram;
+    uint row = 31 - __builtin_clz(blocks);
+    if (row >= SD_BUSY_SIZE_CLASSES) row = SD_BUSY_SIZE_CLASSES - 1;
+    uint column = busy_us < 32 ? 0 : 32 - __builtin_clz(busy_us) - 5;
+    if (column >= SD_BUSY_TIME_BUCKETS) column = SD_BUSY_TIME_BUCKETS - 1;
+    histogram->count[row][column]++;
+    histogram->total_us[row] += busy_us;
+    if (busy_us > histogram->max_us[row]) histogram->max_us[row] = busy_us;
+}
+
+uint32_t sd_busy_percentile_us(const sd_busy_histogram_t *histogram, unsigned percent) {
+    uint64_t total = 0;
+    uint32_t max_us = 0;
+    for (int row = 0; row < SD_BUSY_SIZE_CLASSES; row++) {
+        for (int column = 0; column < SD_BUSY_TIME_BUCKETS; column++)
+            total += histogram->count[row][column];
+        if (histogram->max_us[row] > max_us) max_us = histogram->max_us[row];
+    }
+    if (!total || percent >= 100) return total ? max_us : 0;
+    uint64_t target = (total * percent + 99) / 100, seen = 0;
+    for (int column = 0; column < SD_BUSY_TIME_BUCKETS - 1; column++) {
+        for (int row = 0; row < SD_BUSY_SIZE_CLASSES; row++)
+            seen += histogram->count[row][column];
+        if (seen >= target) return 1u << (column + 5);
+    }
+    return max_us;
+}
+
 static uint8_t sd_write_block(sd_card_t *pSD, const uint8_t *buffer,
-                              uint8_t token, uint32_t length) {
+                              uint8_t token, uint32_t length, uint32_t blocks) {
     uint16_t crc = (~0);
     uint8_t response = 0xFF;
 
@@ -907,15 +1034,17 @@ static uint8_t sd_write_block(sd_card_t *pSD, const uint8_t *buffer,
     sd_spi_write(pSD, token);
 
     // write the data
-    bool ret = sd_spi_transfer(pSD, buffer, NULL, length);
-    myASSERT(ret);
-
+    bool ret;
 #if SD_CRC_ENABLED
     if (crc_on) {
-        // Compute CRC
-        crc = crc16((void *)buffer, length);
-    }
+        // Compute CRC during the transfer
+        ret = sd_spi_transfer_crc(pSD, buffer, NULL, length, &crc);
+    } else
 #endif
+    {
+        ret = sd_spi_transfer(pSD, buffer, NULL, length);
+    }
+    myASSERT(ret);
 
     // write the checksum CRC16
     sd_spi_write(pSD, crc >> 8);
@@ -925,12 +1054,38 @@ static uint8_t sd_write_block(sd_card_t *pSD, const uint8_t *buffer,
     response = sd_spi_write(pSD, SPI_FILL_CHAR);
 
     // Wait for last block to be written
+    uint64_t busy_start = time_us_64();
     if (false == sd_wait_ready(pSD, SD_COMMAND_TIMEOUT)) {
         DBG_PRINTF("%s:%d: Card not ready yet\r\n", __FILE__, __LINE__);
+    } else {
+        sd_busy_record(pSD, blocks, time_us_64() - busy_start);
     }
     return (response & SPI_DATA_RESPONSE_MASK);
 }
 
+void sd_set_pre_erase(sd_card_t *pSD, uint64_t sector, uint64_t count) {
+    if (pSD->raid) {
+        sd_raid_set_pre_erase(pSD, sector, count);
+        return;
+    }
+    pSD->pre_erase_sector = sector;
+    pSD->pre_erase_count = count;
+}
+
+// Blocks to pre-erase for a multiple block write of blockCnt blocks at
+// sector: the rest of the hinted span if the write starts in it
+static uint32_t sd_pre_erase_count(sd_card_t *pSD, uint64_t sector, uint32_t blockCnt) {
+    uint64_t count = blockCnt;
+    if (sector >= pSD->pre_erase_sector &&
+        sector - pSD->pre_erase_sector < pSD->pre_erase_count) {
+        uint64_t rest = pSD->pre_erase_sector + pSD->pre_erase_count - sector;
+        if (rest > SD_PRE_ERASE_MAX_SECTORS) rest = SD_PRE_ERASE_MAX_SECTORS;
+        if (rest > count) count = rest;
+    }
+    return (uint32_t)count;
+}
+
+#if !SD_WRITE_STREAMING
 /** Program blocks to a block device
  *
  *
@@ -954,6 +1109,7 @@ static int in_sd_write_blocks(sd_card_t *pSD, const uint8_t *buffer,
         return SD_BLOCK_DEVICE_ERROR_PARAMETER;
 
     int status = SD_BLOCK_DEVICE_ERROR_NONE;
+    const uint32_t blocks = blockCnt;
     uint8_t response;
     uint64_t addr;
 
@@ -964,6 +1120,8 @@ static int in_sd_write_blocks(sd_card_t *pSD, const uint8_t *buffer,
     } else {
         addr = ulSectorNumber * _block_size;
     }
+    pSD->write_commands++;
+    pSD->write_sectors += blockCnt;
     // Send command to perform write operation
     if (blockCnt == 1) {
         // Single block write command
@@ -972,7 +1130,7 @@ static int in_sd_write_blocks(sd_card_t *pSD, const uint8_t *buffer,
             return status;
         }
         // Write data
-        response = sd_write_block(pSD, buffer, SPI_START_BLOCK, _block_size);
+        response = sd_write_block(pSD, buffer, SPI_START_BLOCK, _block_size, 1);
 
         // Only CRC and general write error are communicated via response token
         if (response != SPI_DATA_ACCEPTED) {
@@ -981,7 +1139,8 @@ static int in_sd_write_blocks(sd_card_t *pSD, const uint8_t *buffer,
         }
     } else {
         // Pre-erase setting prior to multiple block write operation
-        sd_cmd(pSD, ACMD23_SET_WR_BLK_ERASE_COUNT, blockCnt, 1, 0);
+        sd_cmd(pSD, ACMD23_SET_WR_BLK_ERASE_COUNT,
+               sd_pre_erase_count(pSD, ulSectorNumber, blockCnt), 1, 0);
 
         // Some SD cards want to be deselected between every bus transaction:
         sd_spi_deselect_pulse(pSD);
@@ -993,7 +1152,8 @@ static int in_sd_write_blocks(sd_card_t *pSD, const uint8_t *buffer,
         }
         // Write the data: one block at a time
         do {
-            response = sd_write_block(pSD, buffer, SPI_START_BLK_MUL_WRITE, _block_size);
+            response = sd_write_block(pSD, buffer, SPI_START_BLK_MUL_WRITE, _block_size,
+                                      blocks);
             if (response != SPI_DATA_ACCEPTED) {
                 DBG_PRINTF("Multiple Block Write failed: 0x%x\r\n", response);
                 status = SD_BLOCK_DEVICE_ERROR_WRITE;
@@ -1014,16 +1174,352 @@ static int in_sd_write_blocks(sd_card_t *pSD, const uint8_t *buffer,
     return status;
 }
 
+#endif
+
+/* Write sessions
+ * --------------
+ * A session is one open CMD25 multiple block write. Blocks are pushed to it
+ * as they arrive and the transaction is only ended, with the Stop Tran token
+ * and a single CMD13 status check, when the session is closed. The card
+ * is deselected between calls, which the SPI protocol allows between data
+ * blocks, so other cards on the same bus can still be used meanwhile.
+ */
+static int in_sd_write_session_open(sd_card_t *pSD, uint64_t ulSectorNumber) {
+    if (ulSectorNumber >= pSD->sectors)
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    if (pSD->m_Status & (STA_NOINIT | STA_NODISK))
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    if (pSD->write_session_open)
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+
+    uint64_t addr;
+    // SDSC Card (CCS=0) uses byte unit address
+    // SDHC and SDXC Cards (CCS=1) use block unit address (512 Bytes unit)
+    if (SDCARD_V2HC == pSD->card_type) {
+        addr = ulSectorNumber;
+    } else {
+        addr = ulSectorNumber * _block_size;
+    }
+    // The session's length is not known, but a pre-erase hint may say
+    uint32_t pre_erase = sd_pre_erase_count(pSD, ulSectorNumber, 0);
+    if (pre_erase) {
+        sd_cmd(pSD, ACMD23_SET_WR_BLK_ERASE_COUNT, pre_erase, true, 0);
+        // Some SD cards want to be deselected between every bus transaction:
+        sd_spi_deselect_pulse(pSD);
+    }
+    int status = sd_cmd(pSD, CMD25_WRITE_MULTIPLE_BLOCK, addr, false, 0);
+    if (SD_BLOCK_DEVICE_ERROR_NONE != status) {
+        return status;
+    }
+    pSD->write_commands++;
+    pSD->write_session_open = true;
+    pSD->write_session_sector = ulSectorNumber;
+    return SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+static int in_sd_write_session_close(sd_card_t *pSD) {
+    if (!pSD->write_session_open)
+        return SD_BLOCK_DEVICE_ERROR_NONE;
+    pSD->write_session_open = false;
+    sd_spi_write(pSD, SPI_STOP_TRAN);
+    uint32_t stat = 0;
+    // Some SD cards want to be deselected between every bus transaction:
+    sd_spi_deselect_pulse(pSD);
+    return sd_cmd(pSD, CMD13_SEND_STATUS, 0, false, &stat);
+}
+
+static int in_sd_write_session_push(sd_card_t *pSD, const uint8_t *buffer,
+                                    uint32_t blockCnt) {
+    if (!pSD->write_session_open)
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    if (pSD->write_session_sector + blockCnt > pSD->sectors)
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+
+    const uint32_t blocks = blockCnt;
+    while (blockCnt--) {
+        uint8_t response =
+            sd_write_block(pSD, buffer, SPI_START_BLK_MUL_WRITE, _block_size, blocks);
+        if (response != SPI_DATA_ACCEPTED) {
+            DBG_PRINTF("Write session block failed: 0x%x\r\n", response);
+            in_sd_write_session_close(pSD);
+            return SD_BLOCK_DEVICE_ERROR_WRITE;
+        }
+        buffer += _block_size;
+        pSD->write_session_sector++;
+        pSD->write_sectors++;
+    }
+    return SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+int sd_write_session_open(sd_card_t *pSD, uint64_t ulSectorNumber) {
+    if (pSD->raid)
+        return sd_raid_write_session_open(pSD, ulSectorNumber);
+    sd_acquire(pSD);
+    int status = in_sd_write_session_close(pSD);
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+        status = in_sd_write_session_open(pSD, ulSectorNumber);
+    sd_release(pSD);
+    return status;
+}
+
+int sd_write_session_push(sd_card_t *pSD, const uint8_t *buffer,
+                          uint32_t blockCnt) {
+    if (pSD->raid)
+        return sd_raid_write_session_push(pSD, buffer, blockCnt);
+    sd_acquire(pSD);
+    uint64_t start_us = time_us_64();
+    uint64_t sector = pSD->write_session_sector;
+    int status = in_sd_write_session_push(pSD, buffer, blockCnt);
+    sd_latency_done(pSD, SD_OP_WRITE, sector, blockCnt, start_us);
+    sd_release(pSD);
+    return status;
+}
+
+int sd_write_session_close(sd_card_t *pSD) {
+    if (pSD->raid)
+        return sd_raid_write_session_close(pSD);
+    if (!pSD->write_session_open)
+        return SD_BLOCK_DEVICE_ERROR_NONE;
+    sd_acquire(pSD);
+    uint64_t start_us = time_us_64();
+    bool was_open = pSD->write_session_open;
+    int status = in_sd_write_session_close(pSD);
+    if (was_open)
+        sd_latency_done(pSD, SD_OP_CLOSE, pSD->write_session_sector, 0, start_us);
+    sd_release(pSD);
+    return status;
+}
+
 int sd_write_blocks(sd_card_t *pSD, const uint8_t *buffer,
                     uint64_t ulSectorNumber, uint32_t blockCnt) {
     sd_acquire(pSD);
     TRACE_PRINTF("sd_write_blocks(0x%p, 0x%llx, 0x%lx)\r\n", buffer,
                  ulSectorNumber, blockCnt);
+    uint64_t start_us = time_us_64();
+#if SD_WRITE_STREAMING
+    int status = SD_BLOCK_DEVICE_ERROR_NONE;
+    if (!pSD->write_session_open || pSD->write_session_sector != ulSectorNumber) {
+        status = in_sd_write_session_close(pSD);
+        if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+            status = in_sd_write_session_open(pSD, ulSectorNumber);
+    }
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+        status = in_sd_write_session_push(pSD, buffer, blockCnt);
+#else
     int status = in_sd_write_blocks(pSD, buffer, ulSectorNumber, blockCnt);
+#endif
+    sd_latency_done(pSD, SD_OP_WRITE, ulSectorNumber, blockCnt, start_us);
     sd_release(pSD);
     return status;
 }
 
+/* Asynchronous writes
+ * -------------------
+ * Built on a write session and driven by interrupts: each block is sent with
+ * sd_spi_transfer_start(), whose completion callback runs from the DMA IRQ
+ * handler, sends the CRC and checks the response token. The busy time that
+ * follows is checked one byte at a time from a timer alarm, which sends the
+ * next block once the card is ready. Only the end of the write, which
+ * releases the card and may have to close the session after an error, is
+ * left to the starting core, in sd_write_async_poll().
+ */
+static void sd_async_dma_done(void *context);
+
+static void sd_async_send_block(sd_card_t *pSD) {
+    sd_async_write_t *async = &pSD->async;
+    bool crc = false;
+#if SD_CRC_ENABLED
+    crc = crc_on;
+#endif
+    sd_spi_write(pSD, SPI_START_BLK_MUL_WRITE);
+    async->timeout = make_timeout_time_ms(SPI_TRANSFER_TIMEOUT_MS);
+    async->state = SD_ASYNC_DATA;
+    sd_spi_transfer_start(pSD, async->buffer, NULL, _block_size, crc, sd_async_dma_done, pSD);
+}
+
+// Hands the end of the write over to the starting core
+static void sd_async_done(sd_card_t *pSD, int status) {
+    sd_latency_done(pSD, SD_OP_WRITE_ASYNC, pSD->async.sector, pSD->async.blocks,
+                    pSD->async.start_us);
+    pSD->async.status = status;
+    pSD->async.state = SD_ASYNC_DONE;
+    __sev();
+}
+
+// One busy check; returns true while the card is still programming the block
+static bool sd_async_check_busy(sd_card_t *pSD) {
+    sd_async_write_t *async = &pSD->async;
+    // The card holds DO low while it programs the block
+    if (0x00 == sd_spi_write(pSD, SPI_FILL_CHAR)) {
+        if (0 < absolute_time_diff_us(get_absolute_time(), async->timeout))
+            return true;
+        sd_async_done(pSD, SD_BLOCK_DEVICE_ERROR_NO_RESPONSE);
+        return false;
+    }
+    sd_busy_record(pSD, async->blocks, time_us_64() - async->busy_start_us);
+    pSD->write_session_sector++;
+    pSD->write_sectors++;
+    async->buffer += _block_size;
+    if (--async->remaining)
+        sd_async_send_block(pSD);
+    else
+        sd_async_done(pSD, SD_BLOCK_DEVICE_ERROR_NONE);
+    return false;
+}
+
+static int64_t sd_async_busy_alarm(alarm_id_t id, void *user_data) {
+    (void)id;
+    sd_card_t *pSD = user_data;
+    sd_async_write_t *async = &pSD->async;
+    if (!sd_async_check_busy(pSD))
+        return 0;
+    // Check closely while the card is within its usual busy time, and back
+    // off past it, in a stall
+    if (time_us_64() - async->busy_start_us >= async->busy_usual_us &&
+        async->busy_poll_us < SD_BUSY_POLL_MAX_US)
+        async->busy_poll_us *= 2;
+    return async->busy_poll_us;
+}
+
+static void sd_async_dma_done(void *context) {
+    sd_card_t *pSD = context;
+    sd_async_write_t *async = &pSD->async;
+    uint16_t crc = (~0);
+    sd_spi_transfer_finish(pSD, &crc);
+    // write the checksum CRC16
+    sd_spi_write(pSD, crc >> 8);
+    sd_spi_write(pSD, crc);
+    // check the response token
+    uint8_t response = sd_spi_write(pSD, SPI_FILL_CHAR) & SPI_DATA_RESPONSE_MASK;
+    if (response != SPI_DATA_ACCEPTED) {
+        sd_async_done(pSD, SD_BLOCK_DEVICE_ERROR_WRITE);
+        return;
+    }
+    async->busy_start_us = time_us_64();
+    async->timeout = make_timeout_time_ms(SD_COMMAND_TIMEOUT);
+    async->busy_poll_us = SD_BUSY_POLL_US;
+    async->state = SD_ASYNC_BUSY;
+    // The card may already be done, then there is no need for an alarm
+    if (!sd_async_check_busy(pSD))
+        return;
+    // With no alarm slot free, sd_write_async_poll() checks instead
+    async->busy_alarm =
+        0 <= add_alarm_in_us(async->busy_poll_us, sd_async_busy_alarm, pSD, true);
+}
+
+static int sd_async_complete(sd_card_t *pSD, int status) {
+    sd_async_write_t *async = &pSD->async;
+    if (SD_BLOCK_DEVICE_ERROR_NONE != status) {
+        DBG_PRINTF("Asynchronous Block Write failed: %d\r\n", status);
+        in_sd_write_session_close(pSD);
+    }
+    async->state = SD_ASYNC_IDLE;
+    async->status = status;
+    sd_release(pSD);
+    if (async->callback)
+        async->callback(pSD, status, async->user_data);
+    return status;
+}
+
+int sd_write_blocks_async(sd_card_t *pSD, const uint8_t *buffer,
+                          uint64_t ulSectorNumber, uint32_t blockCnt,
+                          sd_write_callback_t callback, void *user_data) {
+    if (!blockCnt)
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    if (pSD->raid)
+        return sd_raid_write_async(pSD, buffer, ulSectorNumber, blockCnt, callback, user_data);
+    sd_acquire(pSD);
+    uint64_t start_us = time_us_64();
+    int status = SD_BLOCK_DEVICE_ERROR_NONE;
+    if (!pSD->write_session_open || pSD->write_session_sector != ulSectorNumber) {
+        status = in_sd_write_session_close(pSD);
+        if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+            status = in_sd_write_session_open(pSD, ulSectorNumber);
+    }
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status &&
+        ulSectorNumber + blockCnt > pSD->sectors)
+        status = SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    if (SD_BLOCK_DEVICE_ERROR_NONE != status) {
+        sd_release(pSD);
+        return status;
+    }
+    sd_async_write_t *async = &pSD->async;
+    async->core = get_core_num();
+    async->sector = ulSectorNumber;
+    async->start_us = start_us;
+    async->buffer = buffer;
+    async->blocks = blockCnt;
+    async->remaining = blockCnt;
+    async->callback = callback;
+    async->user_data = user_data;
+    async->busy_alarm = false;
+    async->busy_usual_us = sd_busy_percentile_us(&pSD->busy_histogram, 90);
+    sd_async_send_block(pSD);
+    return SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+int sd_write_async_poll(sd_card_t *pSD) {
+    if (pSD->raid)
+        return sd_raid_write_async_poll(pSD);
+    sd_async_write_t *async = &pSD->async;
+    switch (async->state) {
+        case SD_ASYNC_IDLE: {
+            int status = async->status;
+            async->status = SD_BLOCK_DEVICE_ERROR_NONE;
+            return status;
+        }
+        case SD_ASYNC_DATA: {
+            if (0 < absolute_time_diff_us(get_absolute_time(), async->timeout))
+                return SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK;
+            // The DMA never completed: stop it before the session is closed
+            // with blocking transfers on the same bus
+            uint32_t save = save_and_disable_interrupts();
+            if (SD_ASYNC_DATA == async->state) {
+                sd_spi_transfer_abort(pSD);
+                sd_async_done(pSD, SD_BLOCK_DEVICE_ERROR_NO_RESPONSE);
+            }
+            restore_interrupts(save);
+            return SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK;
+        }
+        case SD_ASYNC_BUSY:
+            if (!async->busy_alarm)
+                sd_async_check_busy(pSD);
+            return SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK;
+        case SD_ASYNC_DONE:
+            return sd_async_complete(pSD, async->status);
+        default:
+            myASSERT(false);
+            return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    }
+}
+
+bool sd_write_async_busy(sd_card_t *pSD) {
+    if (pSD->raid)
+        return sd_raid_write_async_busy(pSD);
+    return SD_ASYNC_IDLE != pSD->async.state;
+}
+
+int sd_write_async_wait(sd_card_t *pSD) {
+    if (pSD->raid)
+        return sd_raid_write_async_wait(pSD);
+    int status;
+    while (SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK == (status = sd_write_async_poll(pSD))) {
+        // The interrupts that advance the write wake the core, and the end
+        // of the write sends an event
+        if (SD_ASYNC_BUSY == pSD->async.state && !pSD->async.busy_alarm)
+            tight_loop_contents();
+        else
+            __wfe();
+    }
+    return status;
+}
+
+int sd_write_async_wait_earlier(sd_card_t *pSD) {
+    if (pSD->raid)
+        return sd_raid_write_async_wait_earlier(pSD);
+    return SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
 static int sd_init_medium(sd_card_t *pSD) {
     int32_t status = SD_BLOCK_DEVICE_ERROR_NONE;
     uint32_t response, arg;
@@ -1139,6 +1635,24 @@ static void sd_ctor(sd_card_t *pSD) {
     pSD->read_blocks = sd_read_blocks;
     pSD->sd_test_com = sd_test_com;
 }
+static void sd_setup(sd_card_t *pSD) {
+    sd_ctor(pSD);
+
+    if (pSD->use_card_detect) {
+        gpio_init(pSD->card_detect_gpio);
+        gpio_pull_up(pSD->card_detect_gpio);
+        gpio_set_dir(pSD->card_detect_gpio, GPIO_IN);
+    }
+    if (pSD->set_drive_strength) {
+        gpio_set_drive_strength(pSD->ss_gpio, pSD->ss_gpio_drive_strength);
+    }
+    // Chip select is active-low, so we'll initialise it to a
+    // driven-high state.
+    gpio_put(pSD->ss_gpio, 1);  // Avoid any glitches when enabling output
+    gpio_init(pSD->ss_gpio);
+    gpio_set_dir(pSD->ss_gpio, GPIO_OUT);
+    gpio_put(pSD->ss_gpio, 1);  // In case set_dir does anything
+}
 bool sd_init_driver() {
     static bool initialized;
     auto_init_mutex(sd_init_driver_mutex);
@@ -1146,23 +1660,11 @@ bool sd_init_driver() {
     if (!initialized) {
         for (size_t i = 0; i < sd_get_num(); ++i) {
             sd_card_t *pSD = sd_get_by_num(i);
-
-            sd_ctor(pSD);
-
-            if (pSD->use_card_detect) {
-                gpio_init(pSD->card_detect_gpio);
-                gpio_pull_up(pSD->card_detect_gpio);
-                gpio_set_dir(pSD->card_detect_gpio, GPIO_IN);
-            }
-            if (pSD->set_drive_strength) {
-                gpio_set_drive_strength(pSD->ss_gpio, pSD->ss_gpio_drive_strength);
-            }
-            // Chip select is active-low, so we'll initialise it to a
-            // driven-high state.
-            gpio_put(pSD->ss_gpio, 1);  // Avoid any glitches when enabling output
-            gpio_init(pSD->ss_gpio);
-            gpio_set_dir(pSD->ss_gpio, GPIO_OUT);
-            gpio_put(pSD->ss_gpio, 1);  // In case set_dir does anything
+            // A virtual device's members are not listed themselves
+            for (size_t j = 0; j < sd_raid_member_count(pSD); ++j)
+                sd_setup(sd_raid_member(pSD, j));
+            if (pSD->raid)
+                sd_raid_ctor(pSD);
         }
         for (size_t i = 0; i < spi_get_num(); ++i) {
             spi_t *pSPI = spi_get_by_num(i);
@@ -1176,6 +1678,351 @@ bool sd_init_driver() {
     mutex_exit(&sd_init_driver_mutex);
     return true;
 }
+/* Erase
+ * -----
+ * The allocation unit (AU) is the card's erase and recording unit; the
+ * SD Status read at init gives its size and how long erasing takes, as
+ * ERASE_TIMEOUT seconds for every ERASE_SIZE AUs plus ERASE_OFFSET.
+ */
+static void sd_read_sd_status(sd_card_t *pSD) {
+    // AU_SIZE codes 1 to 15, in KiB
+    static const uint32_t au_kib[16] = {0,    16,   32,    64,    128,   256,   512,   1024,
+                                        2048, 4096, 8192, 12288, 16384, 24576, 32768, 65536};
+    uint8_t status[64];
+    pSD->au_sectors = 0;
+    pSD->erase_size = 0;
+    // ACMD13, Response R2 (R1 byte + status byte) and a 64-byte data block
+    if (sd_cmd(pSD, ACMD13_SD_STATUS, 0x0, true, 0) != SD_BLOCK_DEVICE_ERROR_NONE ||
+        sd_read_bytes(pSD, status, sizeof status) != 0) {
+        DBG_PRINTF("Couldn't read the SD Status\r\n");
+        return;
+    }
+    pSD->au_sectors = au_kib[status[10] >> 4] * 2;                   // AU_SIZE [431:428]
+    pSD->erase_size = (uint16_t)(status[11] << 8 | status[12]);      // ERASE_SIZE [423:408]
+    pSD->erase_timeout = status[13] >> 2;                            // ERASE_TIMEOUT [407:402]
+    pSD->erase_offset = status[13] & 0x3;                            // ERASE_OFFSET [401:400]
+}
+
+#if SD_HIGH_SPEED
+/* High Speed
+ * ----------
+ * CMD6 in check mode reports, in its 64-byte switch function status, which
+ * functions of each group the card supports; in set mode it also switches
+ * to them. Access mode (group 1) function 1 is High Speed.
+ */
+#define SD_SWITCH_CHECK 0x00FFFFF1 /*!< Query group 1 function 1, others unchanged */
+#define SD_SWITCH_SET 0x80FFFFF1   /*!< Switch group 1 to function 1 */
+
+static int sd_switch_function(sd_card_t *pSD, uint32_t arg, uint8_t status[64]) {
+    // Response R1 and a 64-byte data block
+    int err = sd_cmd(pSD, CMD6_SWITCH_FUNC, arg, false, 0);
+    if (SD_BLOCK_DEVICE_ERROR_NONE == err)
+        err = sd_read_bytes(pSD, status, 64);
+    return err;
+}
+
+static void sd_switch_high_speed(sd_card_t *pSD) {
+    uint8_t status[64];
+    pSD->high_speed = false;
+    // CMD6 is only in SD 1.10 and later: older cards reject it
+    if (SD_BLOCK_DEVICE_ERROR_NONE != sd_switch_function(pSD, SD_SWITCH_CHECK, status)) {
+        DBG_PRINTF("No CMD6: default speed\r\n");
+        return;
+    }
+    if (!(status[13] & 0x02))  // Group 1 support bits [415:400], function 1
+        return;
+    if (SD_BLOCK_DEVICE_ERROR_NONE != sd_switch_function(pSD, SD_SWITCH_SET, status))
+        return;
+    // Group 1 function selected [379:376]; 0xF if the switch failed
+    pSD->high_speed = 1 == (status[16] & 0x0F);
+    // The new mode applies 8 clocks after the status block
+    sd_spi_write(pSD, SPI_FILL_CHAR);
+}
+#endif
+
+static int sd_erase_timeout_ms(sd_card_t *pSD, uint64_t count) {
+    uint64_t aus = pSD->au_sectors ? (count + pSD->au_sectors - 1) / pSD->au_sectors : 1;
+    uint64_t ms;
+    if (pSD->erase_size && pSD->erase_timeout)
+        ms = aus * pSD->erase_timeout * 1000 / pSD->erase_size + pSD->erase_offset * 1000;
+    else
+        ms = aus * SD_ERASE_TIMEOUT_PER_AU_MS;
+    if (ms < SD_COMMAND_TIMEOUT) ms = SD_COMMAND_TIMEOUT;
+    return ms > INT32_MAX ? INT32_MAX : (int)ms;
+}
+
+int sd_erase(sd_card_t *pSD, uint64_t first, uint64_t last) {
+    if (last < first || last >= pSD->sectors)
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    if (pSD->m_Status & (STA_NOINIT | STA_NODISK))
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    if (pSD->raid)
+        return sd_raid_erase(pSD, first, last);
+    sd_acquire(pSD);
+    // SDSC Card (CCS=0) uses byte unit address
+    // SDHC and SDXC Cards (CCS=1) use block unit address (512 Bytes unit)
+    uint64_t first_addr = first, last_addr = last;
+    if (SDCARD_V2HC != pSD->card_type) {
+        first_addr *= _block_size;
+        last_addr *= _block_size;
+    }
+    uint64_t start_us = time_us_64();
+    int status = in_sd_write_session_close(pSD);
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+        status = sd_cmd(pSD, CMD32_ERASE_WR_BLK_START_ADDR, first_addr, false, 0);
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+        status = sd_cmd(pSD, CMD33_ERASE_WR_BLK_END_ADDR, last_addr, false, 0);
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+        status = sd_cmd(pSD, CMD38_ERASE, 0x0, false, 0);
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status &&
+        !sd_wait_ready(pSD, sd_erase_timeout_ms(pSD, last - first + 1))) {
+        DBG_PRINTF("Erase of %" PRIu64 " sectors timed out\r\n", last - first + 1);
+        status = SD_BLOCK_DEVICE_ERROR_ERASE;
+    }
+    sd_latency_done(pSD, SD_OP_ERASE, first, last - first + 1, start_us);
+    sd_release(pSD);
+    return status;
+}
+
+#if SD_CLOCK_AUTOTUNE
+/* SPI clock calibration
+ * ---------------------
+ * Starting from spi_t.baud_rate, the clock is doubled while sector 0, read
+ * SD_CLOCK_PASSES times with its data CRC checked, matches the copy read at
+ * spi_t.baud_rate. Writes are only tested if the MBR in sector 0 leaves a
+ * gap before the first partition, as card formatters and f_mkfs do: a test
+ * pattern is then also written to and read back from the last sector of
+ * the gap, which belongs to no volume. After the first failure the last
+ * good rate is checked again and, should that fail too, halved until it
+ * passes. The scratch sector's contents are saved first and written back at
+ * the chosen rate; sectors of a volume are never written.
+ * If the scratch sector held only zeros, or a record from an earlier
+ * calibration, a record of the chosen rate is written there instead. Later
+ * inits that find a record for the card and mode only check the rate with
+ * reads of sector 0, and the sector is not written again.
+ */
+// The rate found for a card holds for the bus mode it was found in only
+typedef struct {
+    uint8_t cid[16];
+    bool high_speed;
+    uint baud_rate;  // 0: unused entry
+} sd_clock_entry_t;
+static sd_clock_entry_t sd_clock_cache[SD_CLOCK_CACHE_SIZE];
+static size_t sd_clock_cache_next;  // Entry to replace, round robin
+
+// Scratch buffers, shared by all cards: do not initialize two cards from
+// both cores at once.
+static uint8_t sd_clock_mbr[BLOCK_SIZE_HC];
+static uint8_t sd_clock_saved[BLOCK_SIZE_HC];
+static uint8_t sd_clock_pattern[BLOCK_SIZE_HC];
+static uint8_t sd_clock_readback[BLOCK_SIZE_HC];
+
+// Record in the scratch sector: magic, CID, mode, rate (little endian)
+static const uint8_t sd_clock_magic[8] = {'S', 'D', 'C', 'L', 'O', 'C', 'K', '1'};
+#define SD_CLOCK_RECORD_CID 8
+#define SD_CLOCK_RECORD_MODE 24
+#define SD_CLOCK_RECORD_RATE 25
+
+// The rate recorded for the card in its current mode, or 0
+static uint sd_clock_record_rate(sd_card_t *pSD, const uint8_t *sector) {
+    if (memcmp(sector, sd_clock_magic, sizeof sd_clock_magic) ||
+        memcmp(sector + SD_CLOCK_RECORD_CID, pSD->cid, sizeof pSD->cid) ||
+        sector[SD_CLOCK_RECORD_MODE] != pSD->high_speed)
+        return 0;
+    const uint8_t *rate = sector + SD_CLOCK_RECORD_RATE;
+    return rate[0] | rate[1] << 8 | rate[2] << 16 | (uint)rate[3] << 24;
+}
+
+// A sector the record may overwrite: all zeros, or a record
+static bool sd_clock_record_fits(const uint8_t *sector) {
+    if (0 == memcmp(sector, sd_clock_magic, sizeof sd_clock_magic))
+        return true;
+    for (size_t i = 0; i < _block_size; i++)
+        if (sector[i])
+            return false;
+    return true;
+}
+
+static void sd_clock_record_make(sd_card_t *pSD, uint baud_rate, uint8_t *sector) {
+    memset(sector, 0, _block_size);
+    memcpy(sector, sd_clock_magic, sizeof sd_clock_magic);
+    memcpy(sector + SD_CLOCK_RECORD_CID, pSD->cid, sizeof pSD->cid);
+    sector[SD_CLOCK_RECORD_MODE] = pSD->high_speed;
+    for (int i = 0; i < 4; i++)
+        sector[SD_CLOCK_RECORD_RATE + i] = baud_rate >> (8 * i);
+}
+
+static int sd_read_cid(sd_card_t *pSD) {
+    // CMD10, Response R2 (R1 byte + 16-byte block read)
+    int status = sd_cmd(pSD, CMD10_SEND_CID, 0x0, false, 0);
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+        status = sd_read_bytes(pSD, pSD->cid, sizeof pSD->cid);
+    return status;
+}
+
+// The last sector before the first partition of the MBR in sector 0, or 0
+// if there is no such gap (no MBR, a boot sector of an unpartitioned
+// volume, a GPT, or a partition starting at sector 1)
+static uint64_t sd_clock_scratch_sector(sd_card_t *pSD, const uint8_t *mbr) {
+    if (0x55 != mbr[510] || 0xAA != mbr[511])
+        return 0;
+    // A jump instruction starts the boot sector of a volume, not an MBR
+    if (0xEB == mbr[0] || 0xE9 == mbr[0])
+        return 0;
+    uint64_t first = pSD->sectors;
+    for (int i = 0; i < 4; i++) {
+        const uint8_t *entry = mbr + 446 + 16 * i;
+        // Boot flag other than 0x00/0x80, or a GPT protective partition
+        if ((entry[0] & 0x7F) || 0xEE == entry[4])
+            return 0;
+        if (!entry[4])
+            continue;
+        uint32_t start = entry[8] | entry[9] << 8 | entry[10] << 16 | (uint32_t)entry[11] << 24;
+        if (start < first)
+            first = start;
+    }
+    return 2 <= first && first < pSD->sectors ? first - 1 : 0;
+}
+
+static int sd_clock_write(sd_card_t *pSD, uint64_t sector, const uint8_t *buffer) {
+    int status = in_sd_write_session_open(pSD, sector);
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+        status = in_sd_write_session_push(pSD, buffer, 1);
+    int close_status = in_sd_write_session_close(pSD);
+    return SD_BLOCK_DEVICE_ERROR_NONE == status ? close_status : status;
+}
+
+static bool sd_clock_read_matches(sd_card_t *pSD, uint64_t sector, const uint8_t *buffer) {
+    if (SD_BLOCK_DEVICE_ERROR_NONE != in_sd_read_blocks(pSD, sd_clock_readback, sector, 1))
+        return false;
+    return 0 == memcmp(buffer, sd_clock_readback, _block_size);
+}
+
+static bool sd_clock_roundtrip(sd_card_t *pSD, uint64_t sector, const uint8_t *buffer) {
+    if (SD_BLOCK_DEVICE_ERROR_NONE != sd_clock_write(pSD, sector, buffer))
+        return false;
+    return sd_clock_read_matches(pSD, sector, buffer);
+}
+
+// scratch is the sector to test writes on, 0 for reads only
+static bool sd_clock_test(sd_card_t *pSD, uint64_t scratch, uint baud_rate) {
+    pSD->baud_rate = baud_rate;
+    sd_spi_go_high_frequency(pSD);
+    // A card left mid-transfer by an earlier failure gets its clocks here
+    sd_wait_ready(pSD, SD_COMMAND_TIMEOUT);
+    for (int pass = 0; pass < SD_CLOCK_PASSES; pass++) {
+        if (!sd_clock_read_matches(pSD, 0, sd_clock_mbr)) {
+            DBG_PRINTF("%s: read failed at %u Hz\r\n", __FUNCTION__, baud_rate);
+            return false;
+        }
+        if (!scratch)
+            continue;
+        // Pseudo-random data, different on every pass
+        uint32_t x = 0x9E3779B9u * (pass + 1) ^ baud_rate;
+        for (size_t i = 0; i < _block_size; i++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            sd_clock_pattern[i] = x;
+        }
+        if (!sd_clock_roundtrip(pSD, scratch, sd_clock_pattern)) {
+            DBG_PRINTF("%s: write failed at %u Hz\r\n", __FUNCTION__, baud_rate);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Highest clock rate to try on the card in its current mode
+static uint sd_clock_max_hz(sd_card_t *pSD) {
+    return pSD->high_speed ? SD_CLOCK_HS_MAX_HZ : SD_CLOCK_MAX_HZ;
+}
+
+// Returns the chosen rate, or the one recorded on the card if it still
+// passes reads, or 0 if the card failed even at spi_t.baud_rate
+static uint sd_clock_calibrate(sd_card_t *pSD) {
+    const uint floor = pSD->spi->baud_rate;
+    const uint max_hz = sd_clock_max_hz(pSD);
+    pSD->baud_rate = 0;
+    sd_spi_go_high_frequency(pSD);
+    if (SD_BLOCK_DEVICE_ERROR_NONE != in_sd_read_blocks(pSD, sd_clock_mbr, 0, 1))
+        return 0;
+    uint64_t scratch = sd_clock_scratch_sector(pSD, sd_clock_mbr);
+    if (scratch &&
+        SD_BLOCK_DEVICE_ERROR_NONE != in_sd_read_blocks(pSD, sd_clock_saved, scratch, 1))
+        return 0;
+    uint recorded = scratch ? sd_clock_record_rate(pSD, sd_clock_saved) : 0;
+    if (floor < recorded && recorded <= max_hz && sd_clock_test(pSD, 0, recorded))
+        return recorded;
+    uint good = floor;
+    while (good < max_hz) {
+        uint rate = good * 2 < max_hz ? good * 2 : max_hz;
+        if (!sd_clock_test(pSD, scratch, rate))
+            break;
+        good = rate;
+    }
+    // Back off until the rate passes on a card that may have been upset
+    while (!sd_clock_test(pSD, scratch, good)) {
+        if (good <= floor) {
+            good = 0;
+            break;
+        }
+        good = good / 2 > floor ? good / 2 : floor;
+    }
+    if (!scratch)
+        return good;
+    // Put the scratch sector back, or the record of the rate if it held
+    // nothing else, at the configured clock if need be
+    const uint8_t *contents = sd_clock_saved;
+    if (good && sd_clock_record_fits(sd_clock_saved)) {
+        sd_clock_record_make(pSD, good, sd_clock_pattern);
+        contents = sd_clock_pattern;
+    }
+    pSD->baud_rate = good;
+    sd_spi_go_high_frequency(pSD);
+    if (!good || !sd_clock_roundtrip(pSD, scratch, contents)) {
+        pSD->baud_rate = 0;
+        sd_spi_go_high_frequency(pSD);
+        sd_wait_ready(pSD, SD_COMMAND_TIMEOUT);
+        if (!sd_clock_roundtrip(pSD, scratch, sd_clock_saved))
+            printf("SD clock calibration could not restore sector %" PRIu64 "\r\n", scratch);
+        return 0;
+    }
+    return good;
+}
+
+// Sets pSD->baud_rate, from the cache if this card has been seen before in
+// the same mode since reset
+static void sd_clock_select(sd_card_t *pSD) {
+    pSD->baud_rate = 0;
+    if (pSD->spi->baud_rate >= sd_clock_max_hz(pSD))
+        return;
+    if (SD_BLOCK_DEVICE_ERROR_NONE != sd_read_cid(pSD))
+        return;
+    for (size_t i = 0; i < SD_CLOCK_CACHE_SIZE; i++) {
+        sd_clock_entry_t *entry = &sd_clock_cache[i];
+        if (entry->baud_rate && entry->high_speed == pSD->high_speed &&
+            0 == memcmp(entry->cid, pSD->cid, sizeof entry->cid)) {
+            pSD->baud_rate = entry->baud_rate;
+            sd_spi_go_high_frequency(pSD);
+            return;
+        }
+    }
+    uint baud_rate = sd_clock_calibrate(pSD);
+    if (!baud_rate) {
+        // Stay at the configured clock, and try again next time
+        pSD->baud_rate = 0;
+        sd_spi_go_high_frequency(pSD);
+        return;
+    }
+    sd_clock_entry_t *entry = &sd_clock_cache[sd_clock_cache_next];
+    sd_clock_cache_next = (sd_clock_cache_next + 1) % SD_CLOCK_CACHE_SIZE;
+    memcpy(entry->cid, pSD->cid, sizeof entry->cid);
+    entry->high_speed = pSD->high_speed;
+    entry->baud_rate = baud_rate;
+}
+#endif
+
 static int sd_init(sd_card_t *pSD) {
     TRACE_PRINTF("> %s\r\n", __FUNCTION__);
 
@@ -1199,6 +2046,9 @@ static int sd_init(sd_card_t *pSD) {
     }
     // Initialize the member variables
     pSD->card_type = SDCARD_NONE;
+    pSD->write_session_open = false;
+    pSD->pre_erase_count = 0;
+    pSD->high_speed = false;
 
     sd_spi_acquire(pSD);
 
@@ -1224,12 +2074,21 @@ static int sd_init(sd_card_t *pSD) {
         sd_unlock(pSD);
         return pSD->m_Status;
     }
+#if SD_HIGH_SPEED
+    sd_switch_high_speed(pSD);
+#endif
     // Set SCK for data transfer
     sd_spi_go_high_frequency(pSD);
 
+    sd_read_sd_status(pSD);
+
     // The card is now initialized
     pSD->m_Status &= ~STA_NOINIT;
 
+#if SD_CLOCK_AUTOTUNE
+    sd_clock_select(pSD);
+#endif
+
     sd_spi_release(pSD);
     sd_unlock(pSD);
 
@@ -1247,6 +2106,7 @@ static bool sd_test_com(sd_card_t *pSD) {
 
     if (!(pSD->m_Status & STA_NOINIT)) {
         // SD card is currently initialized
+        in_sd_write_session_close(pSD);
 
         // Timeout of 0 means only check once
         if (sd_wait_ready(pSD, 0)) {
@@ -25,16 +25,56 @@ specific language governing permissions and limitations under the License.
 #include "ff.h"
 //
 #include "spi.h"
+#include "sd_latency.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef struct sd_card_t sd_card_t;
+typedef struct sd_raid_t sd_raid_t;
+
+// Completion callback of sd_write_blocks_async(); status is an
+// SD_BLOCK_DEVICE_ERROR_* code.
+typedef void (*sd_write_callback_t)(sd_card_t *sd_card_p, int status, void *user_data);
+
+// State of an asynchronous write, see sd_write_blocks_async()
+typedef struct {
+    volatile int state;
+    uint core;  // Core that started it and must poll it
+    const uint8_t *buffer;
+    uint32_t blocks;  // Size of the write
+    uint32_t remaining;
+    sd_write_callback_t callback;
+    void *user_data;
+    absolute_time_t timeout;
+    uint64_t sector;           // First sector of the write
+    uint64_t start_us;         // When the write started, for its latency
+    uint64_t busy_start_us;    // When the card started programming the block
+    uint32_t busy_poll_us;     // Current busy check interval
+    uint32_t busy_usual_us;    // 90th percentile of the card's busy times
+    bool busy_alarm;           // Busy checks run from a timer alarm
+    volatile int status;  // Result of the last completed write, until it is polled
+} sd_async_write_t;
+
+// Histogram of the card's busy time after each data block, to characterise
+// card models. Row r counts blocks of writes of 2^r to 2^(r+1)-1 blocks
+// (the last row: 2^r and more); column c counts busy times below
+// 2^(c+5) us (the last column: longer). Asynchronous writes only see the
+// end of the busy time at their next check, see SD_BUSY_POLL_US.
+#define SD_BUSY_SIZE_CLASSES 6
+#define SD_BUSY_TIME_BUCKETS 15
+typedef struct {
+    uint32_t count[SD_BUSY_SIZE_CLASSES][SD_BUSY_TIME_BUCKETS];
+    uint64_t total_us[SD_BUSY_SIZE_CLASSES];
+    uint32_t max_us[SD_BUSY_SIZE_CLASSES];
+} sd_busy_histogram_t;
 
 // "Class" representing SD Cards
 struct sd_card_t {
     const char *pcName;
+    // Virtual device over several cards, see sd_raid.h; NULL for a card
+    sd_raid_t *raid;
     spi_t *spi;
     // Slave select is here instead of in spi_t because multiple SDs can share an SPI.
     uint ss_gpio;                   // Slave select for this SD card
@@ -54,6 +94,31 @@ struct sd_card_t {
     mutex_t mutex;
     FATFS fatfs;
     bool mounted;
+    uint8_t cid[16];  // Card identification register, read at init
+    // SPI clock for data transfer, chosen at init (see SD_CLOCK_AUTOTUNE);
+    // 0 means spi->baud_rate
+    uint baud_rate;
+    bool high_speed;  // Switched to High Speed mode (CMD6) at init
+    // From the SD Status (ACMD13) at init: allocation unit in sectors (0 if
+    // unknown), and the erase timing fields
+    uint32_t au_sectors;
+    uint16_t erase_size;    // AUs erased in erase_timeout seconds; 0: unknown
+    uint8_t erase_timeout;
+    uint8_t erase_offset;   // Seconds
+    // Pre-erase hint, see sd_set_pre_erase()
+    uint64_t pre_erase_sector;
+    uint64_t pre_erase_count;
+
+    // Open multiple block write, see sd_write_session_open():
+    bool write_session_open;
+    uint64_t write_session_sector;  // Next sector the open session writes
+    // Write statistics: write_sectors / write_commands is the average number
+    // of sectors per CMD24/CMD25. Reset them freely.
+    uint32_t write_commands;
+    uint32_t write_sectors;
+    sd_async_write_t async;
+    sd_busy_histogram_t busy_histogram;  // Reset it freely
+    sd_latency_t latency;                // Reset it with sd_latency_reset()
 
     int (*init)(sd_card_t *sd_card_p);
     int (*write_blocks)(sd_card_t *sd_card_p, const uint8_t *buffer,
@@ -93,6 +158,56 @@ uint64_t sd_sectors(sd_card_t *pSD);
 bool sd_init_driver();
 bool sd_card_detect(sd_card_t *sd_card_p);
 
+// Streaming writes: open one CMD25 at a sector, push any number of blocks to
+// it over as many calls as needed, then close it. Any read of the card also
+// closes the session. Each returns an SD_BLOCK_DEVICE_ERROR_* code.
+int sd_write_session_open(sd_card_t *sd_card_p, uint64_t ulSectorNumber);
+int sd_write_session_push(sd_card_t *sd_card_p, const uint8_t *buffer, uint32_t blockCnt);
+int sd_write_session_close(sd_card_t *sd_card_p);
+
+// Erases sectors first to last, inclusive (CMD32/CMD33/CMD38), waiting as
+// long as the card's erase timing allows. Returns an SD_BLOCK_DEVICE_ERROR_*
+// code.
+int sd_erase(sd_card_t *sd_card_p, uint64_t first, uint64_t last);
+
+// Announces that count sectors from sector on are about to be written in
+// sequence. Every multiple block write starting inside that span is then
+// preceded by ACMD23, asking the card to pre-erase the rest of the span
+// (up to SD_PRE_ERASE_MAX_SECTORS at a time). The data in the span is
+// undefined until written. A count of 0 clears the hint.
+void sd_set_pre_erase(sd_card_t *sd_card_p, uint64_t sector, uint64_t count);
+
+// Upper bound of the busy time below which percent percent of the blocks
+// in the histogram fall, to a power of 2; the maximum for 100 or the last
+// bucket, and 0 if the histogram is empty
+uint32_t sd_busy_percentile_us(const sd_busy_histogram_t *histogram, unsigned percent);
+
+// Asynchronous write: starts writing blockCnt blocks (as part of a write
+// session) and returns at once. The buffer must stay untouched until the
+// write completes. The transfer then runs from interrupts: every block is
+// sent by DMA, and the card's busy time is checked from a timer alarm.
+// When the last block is done (or on an error) the core that started it
+// gets an event (see __wfe) and the callback, if any, is called from the
+// next sd_write_async_poll() on that core.
+// The card stays locked meanwhile. Any other call on the card from the
+// starting core first finishes the write.
+// Returns an error if the write could not be started.
+// On an sd_raid.h device the next write can start before this one is done:
+// the buffers of all of them stay in use until sd_write_async_wait(), or
+// until sd_write_async_wait_earlier() after a later one.
+int sd_write_blocks_async(sd_card_t *sd_card_p, const uint8_t *buffer, uint64_t ulSectorNumber,
+                          uint32_t blockCnt, sd_write_callback_t callback, void *user_data);
+// SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK while the write is in progress.
+// Afterwards, the result of the last asynchronous write, returned once.
+int sd_write_async_poll(sd_card_t *sd_card_p);
+// Polls until the write is complete and returns its result
+int sd_write_async_wait(sd_card_t *sd_card_p);
+// Polls until the asynchronous writes started before the latest one are
+// complete. A card only has one in flight, so this returns at once.
+int sd_write_async_wait_earlier(sd_card_t *sd_card_p);
+// True while an asynchronous write is in progress
+bool sd_write_async_busy(sd_card_t *sd_card_p);
+
 #ifdef __cplusplus
 }
 #endif
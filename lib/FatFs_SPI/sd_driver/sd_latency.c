@@ -0,0 +1,83 @@
+/* sd_latency.c
+Licensed under the Apache License, Version 2.0 (the License); you may not use 
+this file except in compliance with the License. You may obtain a copy of the 
+License at
+
+   http://www.apache.org/licenses/LICENSE-2.0 
+Unless required by applicable law or agreed to in writing, software distributed 
+under the License is distributed on an AS IS BASIS, WITHOUT WARRANTIES OR 
+CONDITIONS OF ANY KIND, either express or implied. See the License for the 
+specific language governing permissions and limitations under the License.
+*/
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sd_latency.h"
+
+static const char *const op_names[SD_OP_COUNT] = {"read", "write", "write_async", "close",
+                                                  "erase"};
+
+void sd_latency_record(sd_latency_t *latency, sd_op_t op, uint64_t sector, uint32_t blocks,
+                       uint32_t latency_us, uint64_t end_us) {
+    unsigned row = blocks ? 31 - __builtin_clz(blocks) : 0;
+    if (row >= SD_LATENCY_SIZE_CLASSES) row = SD_LATENCY_SIZE_CLASSES - 1;
+    unsigned column = latency_us < 16 ? 0 : 32 - __builtin_clz(latency_us) - 4;
+    if (column >= SD_LATENCY_BUCKETS) column = SD_LATENCY_BUCKETS - 1;
+    latency->count[op][row][column]++;
+    latency->total_us[op][row] += latency_us;
+    if (latency_us > latency->max_us[op][row]) latency->max_us[op][row] = latency_us;
+
+    if (latency_us < SD_STALL_THRESHOLD_US && latency_us <= latency->worst.latency_us) return;
+    sd_stall_t stall = {
+        .time_us = end_us, .sector = sector, .blocks = blocks, .latency_us = latency_us, .op = op};
+    if (latency_us > latency->worst.latency_us) latency->worst = stall;
+    if (latency_us >= SD_STALL_THRESHOLD_US)
+        latency->stalls[latency->stall_count++ % SD_STALL_TRACE] = stall;
+}
+
+void sd_latency_reset(sd_latency_t *latency) {
+    memset(latency, 0, sizeof *latency);
+}
+
+static void print_stall(const sd_stall_t *stall) {
+    printf("%s of %" PRIu32 " blocks at sector %" PRIu64 ": %" PRIu32 " us, ended at %.3f s\n",
+           op_names[stall->op], stall->blocks, stall->sector, stall->latency_us,
+           stall->time_us / 1e6);
+}
+
+void sd_latency_print(const sd_latency_t *latency, const char *name) {
+    printf("SD %s latency (operations by block count, buckets by upper bound):\n", name);
+    for (int op = 0; op < SD_OP_COUNT; op++) {
+        for (int row = 0; row < SD_LATENCY_SIZE_CLASSES; row++) {
+            uint32_t ops = 0;
+            for (int column = 0; column < SD_LATENCY_BUCKETS; column++)
+                ops += latency->count[op][row][column];
+            if (!ops) continue;
+            printf("  %-11s %2d%s blocks: %" PRIu32 " ops, avg %" PRIu32 " us, max %" PRIu32
+                   " us |",
+                   op_names[op], 1 << row, row == SD_LATENCY_SIZE_CLASSES - 1 ? "+" : " ", ops,
+                   (uint32_t)(latency->total_us[op][row] / ops), latency->max_us[op][row]);
+            for (int column = 0; column < SD_LATENCY_BUCKETS; column++) {
+                uint32_t n = latency->count[op][row][column];
+                if (!n) continue;
+                if (column == SD_LATENCY_BUCKETS - 1)
+                    printf(" >=%luus:%" PRIu32, 1UL << (column + 3), n);
+                else
+                    printf(" <%luus:%" PRIu32, 1UL << (column + 4), n);
+            }
+            printf("\n");
+        }
+    }
+    if (latency->worst.latency_us) {
+        printf("  Worst: ");
+        print_stall(&latency->worst);
+    }
+    printf("  Stalls over %d us: %" PRIu32 "\n", SD_STALL_THRESHOLD_US, latency->stall_count);
+    uint32_t traced = latency->stall_count < SD_STALL_TRACE ? latency->stall_count : SD_STALL_TRACE;
+    for (uint32_t i = 1; i <= traced; i++) {  // Latest first
+        printf("    ");
+        print_stall(&latency->stalls[(latency->stall_count - i) % SD_STALL_TRACE]);
+    }
+}
+/* [] END OF FILE */
@@ -0,0 +1,76 @@
+/* sd_latency.h
+Licensed under the Apache License, Version 2.0 (the License); you may not use 
+this file except in compliance with the License. You may obtain a copy of the 
+License at
+
+   http://www.apache.org/licenses/LICENSE-2.0 
+Unless required by applicable law or agreed to in writing, software distributed 
+under the License is distributed on an AS IS BASIS, WITHOUT WARRANTIES OR 
+CONDITIONS OF ANY KIND, either express or implied. See the License for the 
+specific language governing permissions and limitations under the License.
+*/
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Always-on latency statistics of the SD driver, kept per card. Every
+// operation's time, from when it holds the card until it returns (or, for
+// an asynchronous write, until its last block is programmed), is counted
+// in a histogram by operation, block count and log2 duration. The longest
+// operation is kept with its sector, and operations over
+// SD_STALL_THRESHOLD_US are traced in a small ring, to find the card
+// stalls behind gaps in a recording.
+
+typedef enum {
+    SD_OP_READ,         // sd_read_blocks
+    SD_OP_WRITE,        // sd_write_blocks, sd_write_session_push
+    SD_OP_WRITE_ASYNC,  // sd_write_blocks_async, start to completion
+    SD_OP_CLOSE,        // sd_write_session_close: Stop Tran and CMD13
+    SD_OP_ERASE,        // sd_erase
+    SD_OP_COUNT
+} sd_op_t;
+
+// Row r counts operations on 2^r to 2^(r+1)-1 blocks (the last row: 2^r
+// and more); column c counts latencies below 2^(c+4) us (the last column:
+// longer, i.e. 2^21 us, about 2 s, and more).
+#define SD_LATENCY_SIZE_CLASSES 6
+#define SD_LATENCY_BUCKETS 19
+
+#ifndef SD_STALL_THRESHOLD_US
+#define SD_STALL_THRESHOLD_US 50000
+#endif
+#define SD_STALL_TRACE 8
+
+typedef struct {
+    uint64_t time_us;  // When the operation ended, since boot
+    uint64_t sector;
+    uint32_t blocks;
+    uint32_t latency_us;
+    sd_op_t op;
+} sd_stall_t;
+
+typedef struct {
+    uint32_t count[SD_OP_COUNT][SD_LATENCY_SIZE_CLASSES][SD_LATENCY_BUCKETS];
+    uint64_t total_us[SD_OP_COUNT][SD_LATENCY_SIZE_CLASSES];
+    uint32_t max_us[SD_OP_COUNT][SD_LATENCY_SIZE_CLASSES];
+    sd_stall_t worst;                   // Longest operation; latency_us 0 if none
+    sd_stall_t stalls[SD_STALL_TRACE];  // Latest stalls, a ring
+    uint32_t stall_count;               // All stalls since the reset
+} sd_latency_t;
+
+// Counts an operation that ended at end_us. Cheap enough for IRQ handlers.
+void sd_latency_record(sd_latency_t *latency, sd_op_t op, uint64_t sector, uint32_t blocks,
+                       uint32_t latency_us, uint64_t end_us);
+void sd_latency_reset(sd_latency_t *latency);
+// Prints the non-empty histogram rows, the worst operation and the stall
+// trace with printf, e.g. to USB stdio.
+void sd_latency_print(const sd_latency_t *latency, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+/* [] END OF FILE */
@@ -0,0 +1,464 @@
+/* sd_raid.c
+Licensed under the Apache License, Version 2.0 (the License); you may not use
+this file except in compliance with the License. You may obtain a copy of the
+License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software distributed
+under the License is distributed on an AS IS BASIS, WITHOUT WARRANTIES OR
+CONDITIONS OF ANY KIND, either express or implied. See the License for the
+specific language governing permissions and limitations under the License.
+*/
+#include <inttypes.h>
+#include <string.h>
+
+#include "pico/mutex.h"
+
+#include "my_debug.h"
+#include "sd_raid.h"
+//
+#include "ff.h" /* Obtains integer types */
+//
+#include "diskio.h" /* Declarations of disk functions */  // Needed for STA_NOINIT, ...
+
+static const uint32_t _block_size = 512;
+
+static uint32_t stripe_sectors(const sd_raid_t *raid) {
+    return raid->stripe_sectors ? raid->stripe_sectors : SD_RAID_STRIPE_SECTORS;
+}
+
+static bool member_usable(const sd_raid_t *raid, size_t num) {
+    return !(raid->failed & (1u << num));
+}
+
+static size_t usable_members(const sd_raid_t *raid) {
+    size_t n = 0;
+    for (size_t i = 0; i < raid->member_count; ++i)
+        if (member_usable(raid, i)) ++n;
+    return n;
+}
+
+static void member_failed(sd_raid_t *raid, size_t num, int status) {
+    if (!member_usable(raid, num)) return;
+    raid->failed |= 1u << num;
+    raid->last_failed = num;
+    DBG_PRINTF("RAID member %s failed (%d)\r\n", raid->members[num]->pcName, status);
+}
+
+// First sector of member num that holds a device sector at or after sector.
+// The device sectors from a to b are then, on member num, the sectors from
+// member_sector_from(a) up to member_sector_from(b + 1), exclusive.
+static uint64_t member_sector_from(const sd_raid_t *raid, size_t num, uint64_t sector) {
+    uint32_t stripe = stripe_sectors(raid);
+    uint64_t unit = sector / stripe;
+    uint64_t row = unit / raid->member_count;
+    size_t column = unit % raid->member_count;
+    if (column == num) return row * stripe + sector % stripe;
+    return (column < num ? row : row + 1) * stripe;
+}
+
+size_t sd_raid_member_count(sd_card_t *pSD) {
+    return pSD->raid ? pSD->raid->member_count : 1;
+}
+
+sd_card_t *sd_raid_member(sd_card_t *pSD, size_t num) {
+    if (!pSD->raid) return num ? NULL : pSD;
+    return num < pSD->raid->member_count ? pSD->raid->members[num] : NULL;
+}
+
+static int sd_raid_init(sd_card_t *pSD) {
+    sd_raid_t *raid = pSD->raid;
+    mutex_enter_blocking(&pSD->mutex);
+    if (!(pSD->m_Status & STA_NOINIT)) {
+        mutex_exit(&pSD->mutex);
+        return pSD->m_Status;
+    }
+    // A stripe set is all or nothing, but a mirror member that failed holds
+    // stale data: it stays out until sd_raid_resync(). If they all failed,
+    // the last one has the latest data.
+    if (SD_RAID_STRIPE == raid->level)
+        raid->failed = 0;
+    else if (!usable_members(raid))
+        raid->failed &= ~(1u << raid->last_failed);
+    pSD->write_session_open = false;
+    uint64_t sectors = UINT64_MAX;
+    uint32_t au_sectors = 0;
+    for (size_t i = 0; i < raid->member_count; ++i) {
+        sd_card_t *member = raid->members[i];
+        if (!member_usable(raid, i)) continue;
+        if (member->init(member) & (STA_NOINIT | STA_NODISK)) {
+            member_failed(raid, i, SD_BLOCK_DEVICE_ERROR_NO_INIT);
+            continue;
+        }
+        if (member->sectors < sectors) sectors = member->sectors;
+        if (member->au_sectors > au_sectors) au_sectors = member->au_sectors;
+    }
+    if (SD_RAID_STRIPE == raid->level) {
+        if (raid->failed) {
+            mutex_exit(&pSD->mutex);
+            return pSD->m_Status;
+        }
+        uint32_t stripe = stripe_sectors(raid);
+        pSD->sectors = sectors / stripe * stripe * raid->member_count;
+        // Whole AUs of the device are whole AUs on every member only if the
+        // stripe divides the AU
+        pSD->au_sectors = au_sectors % stripe ? 0 : au_sectors * raid->member_count;
+    } else {
+        // A mirror works as long as one member does
+        if (!usable_members(raid)) {
+            mutex_exit(&pSD->mutex);
+            return pSD->m_Status;
+        }
+        pSD->sectors = sectors;
+        pSD->au_sectors = au_sectors;
+    }
+    pSD->m_Status &= ~(STA_NOINIT | STA_NODISK);
+    DBG_PRINTF("RAID %s: %" PRIu64 " sectors on %zu of %zu cards\r\n", pSD->pcName,
+               pSD->sectors, usable_members(raid), raid->member_count);
+    mutex_exit(&pSD->mutex);
+    return pSD->m_Status;
+}
+
+static int stripe_read(sd_raid_t *raid, uint8_t *buffer, uint64_t sector, uint32_t count) {
+    uint32_t stripe = stripe_sectors(raid);
+    int status = SD_BLOCK_DEVICE_ERROR_NONE;
+    while (count && SD_BLOCK_DEVICE_ERROR_NONE == status) {
+        size_t num = sector / stripe % raid->member_count;
+        uint32_t n = stripe - sector % stripe;
+        if (n > count) n = count;
+        sd_card_t *member = raid->members[num];
+        status = member->read_blocks(member, buffer, member_sector_from(raid, num, sector), n);
+        buffer += (size_t)n * _block_size;
+        sector += n;
+        count -= n;
+    }
+    return status;
+}
+
+static int mirror_read(sd_raid_t *raid, uint8_t *buffer, uint64_t sector, uint32_t count) {
+    int status = SD_BLOCK_DEVICE_ERROR_NO_DEVICE;
+    for (size_t i = 0; i < raid->member_count; ++i) {
+        if (!member_usable(raid, i)) continue;
+        sd_card_t *member = raid->members[i];
+        status = member->read_blocks(member, buffer, sector, count);
+        if (SD_BLOCK_DEVICE_ERROR_NONE == status) break;
+        member_failed(raid, i, status);
+    }
+    return status;
+}
+
+static int sd_raid_read_blocks(sd_card_t *pSD, uint8_t *buffer, uint64_t ulSectorNumber,
+                               uint32_t ulSectorCount) {
+    if (pSD->m_Status & STA_NOINIT)
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    if (ulSectorNumber + ulSectorCount > pSD->sectors)
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    mutex_enter_blocking(&pSD->mutex);
+    int status = SD_RAID_STRIPE == pSD->raid->level
+                     ? stripe_read(pSD->raid, buffer, ulSectorNumber, ulSectorCount)
+                     : mirror_read(pSD->raid, buffer, ulSectorNumber, ulSectorCount);
+    mutex_exit(&pSD->mutex);
+    return status;
+}
+
+// Writes are started on the members as asynchronous writes and left in
+// flight: the next write on a member first waits for its previous one, and
+// only write_join() waits for the others. So the members program in
+// parallel, also across calls. An error of a member's earlier write is
+// returned by the start of its next one, or by write_join(). raid->latest
+// tells the members the last write started on.
+
+// Each stripe goes to its member
+static int stripe_write_start(sd_raid_t *raid, const uint8_t *buffer, uint64_t sector,
+                              uint32_t count) {
+    uint32_t stripe = stripe_sectors(raid);
+    int status = SD_BLOCK_DEVICE_ERROR_NONE;
+    while (count && SD_BLOCK_DEVICE_ERROR_NONE == status) {
+        size_t num = sector / stripe % raid->member_count;
+        uint32_t n = stripe - sector % stripe;
+        if (n > count) n = count;
+        sd_card_t *member = raid->members[num];
+        status = sd_write_async_wait(member);
+        if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+            status = sd_write_blocks_async(member, buffer, member_sector_from(raid, num, sector),
+                                           n, NULL, NULL);
+        raid->latest |= 1u << num;
+        buffer += (size_t)n * _block_size;
+        sector += n;
+        count -= n;
+    }
+    return status;
+}
+
+// Every sector goes to all members; a member that fails is dropped
+static int mirror_write_start(sd_raid_t *raid, const uint8_t *buffer, uint64_t sector,
+                              uint32_t count) {
+    for (size_t i = 0; i < raid->member_count; ++i) {
+        if (!member_usable(raid, i)) continue;
+        sd_card_t *member = raid->members[i];
+        int status = sd_write_async_wait(member);
+        if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+            status = sd_write_blocks_async(member, buffer, sector, count, NULL, NULL);
+        if (SD_BLOCK_DEVICE_ERROR_NONE != status) member_failed(raid, i, status);
+        raid->latest |= 1u << i;
+    }
+    return usable_members(raid) ? SD_BLOCK_DEVICE_ERROR_NONE : SD_BLOCK_DEVICE_ERROR_WRITE;
+}
+
+static int write_start(sd_card_t *pSD, const uint8_t *buffer, uint64_t ulSectorNumber,
+                       uint32_t blockCnt) {
+    if (pSD->m_Status & STA_NOINIT)
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    if (ulSectorNumber + blockCnt > pSD->sectors)
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    mutex_enter_blocking(&pSD->mutex);
+    pSD->raid->latest = 0;
+    int status = SD_RAID_STRIPE == pSD->raid->level
+                     ? stripe_write_start(pSD->raid, buffer, ulSectorNumber, blockCnt)
+                     : mirror_write_start(pSD->raid, buffer, ulSectorNumber, blockCnt);
+    mutex_exit(&pSD->mutex);
+    return status;
+}
+
+// Waits for the writes in flight on the members (bit i for members[i])
+static int write_join(sd_card_t *pSD, uint32_t members) {
+    sd_raid_t *raid = pSD->raid;
+    mutex_enter_blocking(&pSD->mutex);
+    int status = SD_BLOCK_DEVICE_ERROR_NONE;
+    for (size_t i = 0; i < raid->member_count; ++i) {
+        if (!member_usable(raid, i) || !(members & (1u << i))) continue;
+        int member_status = sd_write_async_wait(raid->members[i]);
+        if (SD_BLOCK_DEVICE_ERROR_NONE == member_status) continue;
+        if (SD_RAID_MIRROR == raid->level)
+            member_failed(raid, i, member_status);
+        else if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+            status = member_status;
+    }
+    if (SD_RAID_MIRROR == raid->level && !usable_members(raid))
+        status = SD_BLOCK_DEVICE_ERROR_WRITE;
+    mutex_exit(&pSD->mutex);
+    return status;
+}
+
+// Ends the asynchronous writes of the device, see sd_raid_write_async()
+static int write_async_complete(sd_card_t *pSD) {
+    sd_async_write_t *async = &pSD->async;
+    int status = write_join(pSD, ~0u);
+    pSD->raid->writing = false;
+    async->status = status;
+    if (async->callback) {
+        sd_write_callback_t callback = async->callback;
+        async->callback = NULL;
+        callback(pSD, status, async->user_data);
+    }
+    return status;
+}
+
+// The caller's buffer is free when this returns, as for a card
+static int sd_raid_write_blocks(sd_card_t *pSD, const uint8_t *buffer, uint64_t ulSectorNumber,
+                                uint32_t blockCnt) {
+    int status = write_start(pSD, buffer, ulSectorNumber, blockCnt);
+    int join_status;
+    if (pSD->raid->writing) {
+        join_status = write_async_complete(pSD);
+        pSD->async.status = SD_BLOCK_DEVICE_ERROR_NONE;  // Reported here
+    } else {
+        join_status = write_join(pSD, ~0u);
+    }
+    return SD_BLOCK_DEVICE_ERROR_NONE == status ? join_status : status;
+}
+
+int sd_raid_write_async(sd_card_t *pSD, const uint8_t *buffer, uint64_t ulSectorNumber,
+                        uint32_t blockCnt, sd_write_callback_t callback, void *user_data) {
+    sd_raid_t *raid = pSD->raid;
+    // A callback reports on its own write: end the one in flight first
+    if (raid->writing && (pSD->async.callback || callback))
+        write_async_complete(pSD);
+    int status = write_start(pSD, buffer, ulSectorNumber, blockCnt);
+    if (SD_BLOCK_DEVICE_ERROR_NONE != status) {
+        if (raid->writing)
+            write_async_complete(pSD);
+        else
+            write_join(pSD, ~0u);
+        return status;
+    }
+    if (!raid->writing) {
+        pSD->async.callback = callback;
+        pSD->async.user_data = user_data;
+        raid->writing = true;
+    }
+    return SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+int sd_raid_write_async_poll(sd_card_t *pSD) {
+    sd_raid_t *raid = pSD->raid;
+    if (!raid->writing) {
+        int status = pSD->async.status;
+        pSD->async.status = SD_BLOCK_DEVICE_ERROR_NONE;
+        return status;
+    }
+    for (size_t i = 0; i < raid->member_count; ++i) {
+        sd_card_t *member = raid->members[i];
+        if (member_usable(raid, i) && sd_write_async_busy(member) &&
+            SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK == sd_write_async_poll(member))
+            return SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK;
+    }
+    return write_async_complete(pSD);
+}
+
+int sd_raid_write_async_wait(sd_card_t *pSD) {
+    return pSD->raid->writing ? write_async_complete(pSD) : sd_raid_write_async_poll(pSD);
+}
+
+// The members the latest write was not started on hold only earlier
+// writes; those on the others were waited for before it started
+int sd_raid_write_async_wait_earlier(sd_card_t *pSD) {
+    return pSD->raid->writing ? write_join(pSD, ~pSD->raid->latest) : SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+bool sd_raid_write_async_busy(sd_card_t *pSD) {
+    return pSD->raid->writing;
+}
+
+// The members keep their own write sessions open across calls, so a session
+// on the device only tracks where the next push goes
+int sd_raid_write_session_open(sd_card_t *pSD, uint64_t ulSectorNumber) {
+    if (ulSectorNumber >= pSD->sectors)
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    pSD->write_session_open = true;
+    pSD->write_session_sector = ulSectorNumber;
+    return SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+int sd_raid_write_session_push(sd_card_t *pSD, const uint8_t *buffer, uint32_t blockCnt) {
+    if (!pSD->write_session_open)
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    int status = sd_raid_write_blocks(pSD, buffer, pSD->write_session_sector, blockCnt);
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+        pSD->write_session_sector += blockCnt;
+    return status;
+}
+
+// Ends the members' sessions too, whether or not the device had one open
+int sd_raid_write_session_close(sd_card_t *pSD) {
+    sd_raid_t *raid = pSD->raid;
+    pSD->write_session_open = false;
+    int status = SD_BLOCK_DEVICE_ERROR_NONE;
+    for (size_t i = 0; i < raid->member_count; ++i) {
+        if (!member_usable(raid, i)) continue;
+        int member_status = sd_write_session_close(raid->members[i]);
+        if (SD_BLOCK_DEVICE_ERROR_NONE == member_status) continue;
+        if (SD_RAID_MIRROR == raid->level)
+            member_failed(raid, i, member_status);
+        else if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+            status = member_status;
+    }
+    if (SD_RAID_MIRROR == raid->level && !usable_members(raid))
+        status = SD_BLOCK_DEVICE_ERROR_WRITE;
+    return status;
+}
+
+int sd_raid_resync(sd_card_t *pSD, size_t num) {
+    static uint8_t buffer[SD_RAID_RESYNC_SECTORS * 512];
+    sd_raid_t *raid = pSD->raid;
+    if (SD_RAID_MIRROR != raid->level || num >= raid->member_count || member_usable(raid, num))
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    if (pSD->m_Status & STA_NOINIT)
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    sd_card_t *member = raid->members[num];
+    if (member->init(member) & (STA_NOINIT | STA_NODISK))
+        return SD_BLOCK_DEVICE_ERROR_NO_INIT;
+    if (member->sectors < pSD->sectors)
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+    // Writes in flight must be on the copy
+    if (raid->writing) write_async_complete(pSD);
+    mutex_enter_blocking(&pSD->mutex);
+    int status = SD_BLOCK_DEVICE_ERROR_NONE;
+    for (uint64_t sector = 0; sector < pSD->sectors && SD_BLOCK_DEVICE_ERROR_NONE == status;
+         sector += SD_RAID_RESYNC_SECTORS) {
+        uint32_t n = SD_RAID_RESYNC_SECTORS;
+        if (pSD->sectors - sector < n) n = pSD->sectors - sector;
+        status = mirror_read(raid, buffer, sector, n);
+        if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+            status = member->write_blocks(member, buffer, sector, n);
+    }
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status)
+        status = sd_write_session_close(member);
+    if (SD_BLOCK_DEVICE_ERROR_NONE == status) {
+        raid->failed &= ~(1u << num);
+        DBG_PRINTF("RAID member %s resynced\r\n", member->pcName);
+    }
+    mutex_exit(&pSD->mutex);
+    return status;
+}
+
+int sd_raid_erase(sd_card_t *pSD, uint64_t first, uint64_t last) {
+    sd_raid_t *raid = pSD->raid;
+    mutex_enter_blocking(&pSD->mutex);
+    int status = SD_BLOCK_DEVICE_ERROR_NONE;
+    for (size_t i = 0; i < raid->member_count; ++i) {
+        if (!member_usable(raid, i)) continue;
+        uint64_t from = first, to = last + 1;
+        if (SD_RAID_STRIPE == raid->level) {
+            from = member_sector_from(raid, i, first);
+            to = member_sector_from(raid, i, last + 1);
+        }
+        if (from >= to) continue;
+        int member_status = sd_erase(raid->members[i], from, to - 1);
+        if (SD_BLOCK_DEVICE_ERROR_NONE == status) status = member_status;
+    }
+    mutex_exit(&pSD->mutex);
+    return status;
+}
+
+void sd_raid_set_pre_erase(sd_card_t *pSD, uint64_t sector, uint64_t count) {
+    sd_raid_t *raid = pSD->raid;
+    for (size_t i = 0; i < raid->member_count; ++i) {
+        uint64_t from = sector, to = sector + count;
+        if (SD_RAID_STRIPE == raid->level && count) {
+            from = member_sector_from(raid, i, sector);
+            to = member_sector_from(raid, i, sector + count);
+        }
+        sd_set_pre_erase(raid->members[i], from, to - from);
+    }
+}
+
+bool sd_raid_card_detect(sd_card_t *pSD) {
+    sd_raid_t *raid = pSD->raid;
+    for (size_t i = 0; i < raid->member_count; ++i)
+        if (member_usable(raid, i) && !sd_card_detect(raid->members[i]))
+            member_failed(raid, i, SD_BLOCK_DEVICE_ERROR_NO_DEVICE);
+    size_t present = usable_members(raid);
+    if (SD_RAID_STRIPE == raid->level ? present == raid->member_count : present > 0) {
+        pSD->m_Status &= ~STA_NODISK;
+        return true;
+    }
+    pSD->m_Status |= (STA_NODISK | STA_NOINIT);
+    return false;
+}
+
+static bool sd_raid_test_com(sd_card_t *pSD) {
+    sd_raid_t *raid = pSD->raid;
+    for (size_t i = 0; i < raid->member_count; ++i) {
+        sd_card_t *member = raid->members[i];
+        if (member_usable(raid, i) && !member->sd_test_com(member))
+            member_failed(raid, i, SD_BLOCK_DEVICE_ERROR_NO_RESPONSE);
+    }
+    size_t working = usable_members(raid);
+    if (SD_RAID_STRIPE == raid->level ? working == raid->member_count : working > 0)
+        return true;
+    pSD->m_Status |= STA_NOINIT;
+    return false;
+}
+
+void sd_raid_ctor(sd_card_t *pSD) {
+    myASSERT(pSD->raid->member_count <= SD_RAID_MAX_MEMBERS);
+    if (!mutex_is_initialized(&pSD->mutex)) mutex_init(&pSD->mutex);
+    // State variables:
+    pSD->m_Status = STA_NOINIT;
+    pSD->init = sd_raid_init;
+    pSD->write_blocks = sd_raid_write_blocks;
+    pSD->read_blocks = sd_raid_read_blocks;
+    pSD->sd_test_com = sd_raid_test_com;
+}
+/* [] END OF FILE */
@@ -0,0 +1,102 @@
+/* sd_raid.h
+Licensed under the Apache License, Version 2.0 (the License); you may not use 
+this file except in compliance with the License. You may obtain a copy of the 
+License at
+
+   http://www.apache.org/licenses/LICENSE-2.0 
+Unless required by applicable law or agreed to in writing, software distributed 
+under the License is distributed on an AS IS BASIS, WITHOUT WARRANTIES OR 
+CONDITIONS OF ANY KIND, either express or implied. See the License for the 
+specific language governing permissions and limitations under the License.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sd_card.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Several cards, ideally on separate SPI buses, as one block device. An
+// sd_card_t whose raid field is set is such a virtual device: it is listed
+// in hw_config.c like a card, with only pcName and raid, and the public
+// sd_card.h calls on it act on its members, which are not listed
+// themselves.
+//
+// SD_RAID_STRIPE (RAID-0) spreads the sectors over the members in stripes
+// of stripe_sectors, and writes the members in parallel, each with
+// asynchronous writes, for up to member_count times the bandwidth of one
+// card. sd_write_blocks_async() on the device returns with its stripes in
+// flight, and further writes queue behind them on their own members, so
+// even writes of a single stripe overlap; sd_write_async_poll() and
+// sd_write_async_wait() cover all of them, sd_write_async_wait_earlier()
+// all but the latest one's. The device is as large as member_count times
+// its smallest member.
+// SD_RAID_MIRROR (RAID-1) writes every sector to all members, in parallel,
+// and reads from the first one that works. A member that fails stops being
+// used, and the device keeps working while one is left. Its data is stale
+// from then on, so a new init does not take it back (unless all failed,
+// then the last one): sd_raid_resync() does, after copying the device
+// onto it. The failures are only kept in
+// RAM; after a reset, all members are used again.
+#define SD_RAID_NONE 0
+#define SD_RAID_STRIPE 1
+#define SD_RAID_MIRROR 2
+
+#define SD_RAID_MAX_MEMBERS 4
+
+// Default stripe: 4 KiB, the logger's staging buffer (LOG_STAGING_SECTORS),
+// so that consecutive buffers go to different members. It divides every AU
+// size.
+#ifndef SD_RAID_STRIPE_SECTORS
+#define SD_RAID_STRIPE_SECTORS 8
+#endif
+
+// Sectors copied at a time by sd_raid_resync(), from a static buffer
+#ifndef SD_RAID_RESYNC_SECTORS
+#define SD_RAID_RESYNC_SECTORS 8
+#endif
+
+struct sd_raid_t {
+    int level;  // SD_RAID_STRIPE or SD_RAID_MIRROR
+    size_t member_count;
+    sd_card_t *members[SD_RAID_MAX_MEMBERS];
+    uint32_t stripe_sectors;  // 0: SD_RAID_STRIPE_SECTORS
+    // Members that failed (bit i for members[i]), assigned dynamically
+    uint32_t failed;
+    size_t last_failed;  // Its data is the latest if all of them failed
+    bool writing;  // Asynchronous writes in flight on the members
+    uint32_t latest;  // Members the latest write was started on
+};
+
+// Physical cards behind a drive: its members, or the card itself
+size_t sd_raid_member_count(sd_card_t *sd_card_p);
+sd_card_t *sd_raid_member(sd_card_t *sd_card_p, size_t num);
+
+// Copies a mirror device onto its member num, which failed, from the
+// members in use, and then uses it again. Writes to the device wait
+// meanwhile; a whole card takes about as long as writing it.
+int sd_raid_resync(sd_card_t *sd_card_p, size_t num);
+
+// For sd_card.c: the virtual device's side of the sd_card.h calls
+void sd_raid_ctor(sd_card_t *sd_card_p);
+bool sd_raid_card_detect(sd_card_t *sd_card_p);
+int sd_raid_write_session_open(sd_card_t *sd_card_p, uint64_t ulSectorNumber);
+int sd_raid_write_session_push(sd_card_t *sd_card_p, const uint8_t *buffer, uint32_t blockCnt);
+int sd_raid_write_session_close(sd_card_t *sd_card_p);
+int sd_raid_erase(sd_card_t *sd_card_p, uint64_t first, uint64_t last);
+void sd_raid_set_pre_erase(sd_card_t *sd_card_p, uint64_t sector, uint64_t count);
+int sd_raid_write_async(sd_card_t *sd_card_p, const uint8_t *buffer, uint64_t ulSectorNumber,
+                        uint32_t blockCnt, sd_write_callback_t callback, void *user_data);
+int sd_raid_write_async_poll(sd_card_t *sd_card_p);
+int sd_raid_write_async_wait(sd_card_t *sd_card_p);
+int sd_raid_write_async_wait_earlier(sd_card_t *sd_card_p);
+bool sd_raid_write_async_busy(sd_card_t *sd_card_p);
+
+#ifdef __cplusplus
+}
+#endif
+/* [] END OF FILE */
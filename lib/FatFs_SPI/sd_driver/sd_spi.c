@@ -31,7 +31,8 @@ specific language governing permissions and limitations under the License.
 #pragma GCC diagnostic ignored "-Wunused-variable"
 
 void sd_spi_go_high_frequency(sd_card_t *pSD) {
-    uint actual = spi_set_baudrate(pSD->spi->hw_inst, pSD->spi->baud_rate);
+    uint baud_rate = pSD->baud_rate ? pSD->baud_rate : pSD->spi->baud_rate;
+    uint actual = spi_set_baudrate(pSD->spi->hw_inst, baud_rate);
     TRACE_PRINTF("%s: Actual frequency: %lu\n", __FUNCTION__, (long)actual);
 }
 void sd_spi_go_low_frequency(sd_card_t *pSD) {
@@ -91,6 +92,25 @@ bool sd_spi_transfer(sd_card_t *pSD, const uint8_t *tx, uint8_t *rx,
     return spi_transfer(pSD->spi, tx, rx, length);
 }
 
+bool sd_spi_transfer_crc(sd_card_t *pSD, const uint8_t *tx, uint8_t *rx,
+                         size_t length, uint16_t *crc) {
+    return spi_transfer_crc(pSD->spi, tx, rx, length, crc);
+}
+
+void sd_spi_transfer_start(sd_card_t *pSD, const uint8_t *tx, uint8_t *rx,
+                           size_t length, bool crc,
+                           void (*callback)(void *context), void *context) {
+    spi_transfer_start_notify(pSD->spi, tx, rx, length, crc, callback, context);
+}
+
+void sd_spi_transfer_finish(sd_card_t *pSD, uint16_t *crc) {
+    spi_transfer_finish(pSD->spi, crc);
+}
+
+void sd_spi_transfer_abort(sd_card_t *pSD) {
+    spi_transfer_abort(pSD->spi);
+}
+
 uint8_t sd_spi_write(sd_card_t *pSD, const uint8_t value) {
     // TRACE_PRINTF("%s\n", __FUNCTION__);
     uint8_t received = SPI_FILL_CHAR;
@@ -21,6 +21,13 @@ specific language governing permissions and limitations under the License.
 /* Transfer tx to SPI while receiving SPI to rx. 
 tx or rx can be NULL if not important. */
 bool sd_spi_transfer(sd_card_t *pSD, const uint8_t *tx, uint8_t *rx, size_t length);
+/* sd_spi_transfer, also computing the CRC16 of the data block (see spi_transfer_crc) */
+bool sd_spi_transfer_crc(sd_card_t *pSD, const uint8_t *tx, uint8_t *rx, size_t length, uint16_t *crc);
+/* Non-blocking halves of sd_spi_transfer_crc (see spi_transfer_start_notify) */
+void sd_spi_transfer_start(sd_card_t *pSD, const uint8_t *tx, uint8_t *rx, size_t length, bool crc,
+                           void (*callback)(void *context), void *context);
+void sd_spi_transfer_finish(sd_card_t *pSD, uint16_t *crc);
+void sd_spi_transfer_abort(sd_card_t *pSD);
 uint8_t sd_spi_write(sd_card_t *pSD, const uint8_t value);
 void sd_spi_deselect_pulse(sd_card_t *pSD);
 void sd_spi_acquire(sd_card_t *pSD);
@@ -18,12 +18,16 @@ specific language governing permissions and limitations under the License.
 #include "pico/stdlib.h"
 #include "pico/mutex.h"
 #include "pico/sem.h"
+#include "hardware/claim.h"
 //
 #include "my_debug.h"
 #include "hw_config.h"
 //
+#include "crc.h"
 #include "spi.h"
 
+#define SD_DMA_CRC_TEST_BLOCKS 8
+
 static bool irqChannel1 = false;
 static bool irqShared = true;
 
@@ -36,8 +40,14 @@ static void in_spi_irq_handler(const uint DMA_IRQ_num, io_rw_32 *dma_hw_ints_p)
                 *dma_hw_ints_p = 1 << spi_p->rx_dma;  // Clear it.
                 assert(!dma_channel_is_busy(spi_p->rx_dma));
                 assert(!sem_available(&spi_p->sem));
-                bool ok = sem_release(&spi_p->sem);
-                assert(ok);
+                if (spi_p->xfer_callback) {
+                    void (*callback)(void *) = spi_p->xfer_callback;
+                    spi_p->xfer_callback = NULL;
+                    callback(spi_p->xfer_context);
+                } else {
+                    bool ok = sem_release(&spi_p->sem);
+                    assert(ok);
+                }
             }
         }
     }
@@ -54,15 +64,85 @@ void set_spi_dma_irq_channel(bool useChannel1, bool shared) {
     irqShared = shared;
 }
 
+#if SD_DMA_CRC
+// The sniffer has a single accumulator for all channels, so only one
+// transfer at a time may use it: the one that claimed it, until it is
+// finished or aborted. Transfers started on other SPIs meanwhile compute
+// their CRC in software.
+static spi_t *sniffer_owner;
+
+static bool sniffer_claim(spi_t *spi_p) {
+    uint32_t save = hw_claim_lock();
+    bool claimed = !sniffer_owner;
+    if (claimed) sniffer_owner = spi_p;
+    hw_claim_unlock(save);
+    return claimed;
+}
+
+static void sniffer_release(spi_t *spi_p) {
+    uint32_t save = hw_claim_lock();
+    if (sniffer_owner == spi_p) sniffer_owner = NULL;
+    hw_claim_unlock(save);
+}
+
+// Copies random blocks through the sniffer on the (still idle) TX channel
+// and compares the CRC16 it accumulates with the software table.
+static bool spi_dma_crc_self_test(spi_t *spi_p) {
+    uint8_t block[512];
+    uint8_t sink;
+    uint32_t seed = 0x2545F491;
+    // Another SPI may be transferring a block with it
+    while (!sniffer_claim(spi_p))
+        tight_loop_contents();
+    for (int n = 0; n < SD_DMA_CRC_TEST_BLOCKS; n++) {
+        for (size_t i = 0; i < sizeof(block); i++) {
+            seed = seed * 1664525 + 1013904223;
+            block[i] = seed >> 24;
+        }
+        dma_channel_config cfg = dma_channel_get_default_config(spi_p->tx_dma);
+        channel_config_set_transfer_data_size(&cfg, DMA_SIZE_8);
+        channel_config_set_read_increment(&cfg, true);
+        channel_config_set_write_increment(&cfg, false);
+        channel_config_set_sniff_enable(&cfg, true);
+        dma_sniffer_enable(spi_p->tx_dma, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, false);
+        dma_sniffer_set_data_accumulator(0);
+        dma_channel_configure(spi_p->tx_dma, &cfg, &sink, block, sizeof(block), true);
+        dma_channel_wait_for_finish_blocking(spi_p->tx_dma);
+        uint16_t hw_crc = dma_sniffer_get_data_accumulator();
+        dma_sniffer_disable();
+        uint16_t sw_crc = crc16((const char *)block, sizeof(block));
+        if (hw_crc != sw_crc) {
+            DBG_PRINTF("DMA sniffer CRC16 0x%04x != 0x%04x, using software CRC\n", hw_crc, sw_crc);
+            sniffer_release(spi_p);
+            return false;
+        }
+    }
+    sniffer_release(spi_p);
+    return true;
+}
+#endif
+
 // SPI Transfer: Read & Write (simultaneously) on SPI bus
 //   If the data that will be received is not important, pass NULL as rx.
 //   If the data that will be transmitted is not important,
 //     pass NULL as tx and then the SPI_FILL_CHAR is sent out as each data
 //     element.
-bool spi_transfer(spi_t *spi_p, const uint8_t *tx, uint8_t *rx, size_t length) {
+//   If crc is true the CRC16 of the block (tx, or rx when tx is NULL) is
+//     computed and returned by spi_transfer_poll()/spi_transfer_wait().
+// The DMA IRQ handler releases spi_p->sem when the transfer is complete,
+// or, if callback is not NULL, calls it instead.
+void spi_transfer_start_notify(spi_t *spi_p, const uint8_t *tx, uint8_t *rx, size_t length,
+                               bool crc, void (*callback)(void *context), void *context) {
     // assert(512 == length || 1 == length);
     assert(tx || rx);
     // assert(!(tx && rx));
+    spi_p->xfer_data = tx ? tx : rx;
+    spi_p->xfer_length = length;
+    spi_p->xfer_crc = crc;
+    spi_p->xfer_start_time = get_absolute_time();
+    spi_p->xfer_callback = callback;
+    spi_p->xfer_context = context;
+    bool crc_on_tx = tx != NULL;
 
     // tx write increment is already false
     if (tx) {
@@ -95,6 +175,18 @@ bool spi_transfer(spi_t *spi_p, const uint8_t *tx, uint8_t *rx, size_t length) {
                                    // size transfer_data_size)
                           false);  // start
 
+#if SD_DMA_CRC
+    // The sniffer watches whichever channel carries the block data.
+    // dma_channel_configure() above rewrote both CTRL registers, including
+    // their SNIFF_EN bits, so set those explicitly every time.
+    spi_p->xfer_sniff = crc && spi_p->dma_crc_ok && sniffer_claim(spi_p);
+    if (spi_p->xfer_sniff) {
+        uint channel = crc_on_tx ? spi_p->tx_dma : spi_p->rx_dma;
+        dma_sniffer_enable(channel, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, true);
+        dma_sniffer_set_data_accumulator(0);
+    }
+#endif
+
     switch (spi_p->DMA_IRQ_num) {
         case DMA_IRQ_0:
             assert(!dma_channel_get_irq0_status(spi_p->rx_dma));
@@ -110,16 +202,15 @@ bool spi_transfer(spi_t *spi_p, const uint8_t *tx, uint8_t *rx, size_t length) {
     // start them exactly simultaneously to avoid races (in extreme cases
     // the FIFO could overflow)
     dma_start_channel_mask((1u << spi_p->tx_dma) | (1u << spi_p->rx_dma));
+}
 
-    /* Wait until master completes transfer or time out has occured. */
-    uint32_t timeOut = 1000; /* Timeout 1 sec */
-    bool rc = sem_acquire_timeout_ms(
-        &spi_p->sem, timeOut);  // Wait for notification from ISR
-    if (!rc) {
-        // If the timeout is reached the function will return false
-        DBG_PRINTF("Notification wait timed out in %s\n", __FUNCTION__);
-        return false;
-    }
+void spi_transfer_start(spi_t *spi_p, const uint8_t *tx, uint8_t *rx, size_t length,
+                        bool crc) {
+    spi_transfer_start_notify(spi_p, tx, rx, length, crc, NULL, NULL);
+}
+
+// Called once the IRQ handler has signalled completion.
+void spi_transfer_finish(spi_t *spi_p, uint16_t *crc_p) {
     // Shouldn't be necessary:
     dma_channel_wait_for_finish_blocking(spi_p->tx_dma);
     dma_channel_wait_for_finish_blocking(spi_p->rx_dma);
@@ -128,9 +219,114 @@ bool spi_transfer(spi_t *spi_p, const uint8_t *tx, uint8_t *rx, size_t length) {
     assert(!dma_channel_is_busy(spi_p->tx_dma));
     assert(!dma_channel_is_busy(spi_p->rx_dma));
 
+    if (!spi_p->xfer_crc) return;
+#if SD_DMA_CRC
+    if (spi_p->xfer_sniff) {
+        uint16_t crc = dma_sniffer_get_data_accumulator();
+        dma_sniffer_disable();
+        spi_p->xfer_sniff = false;
+        sniffer_release(spi_p);
+        if (crc_p) *crc_p = crc;
+        return;
+    }
+#endif
+    if (crc_p) *crc_p = crc16((const char *)spi_p->xfer_data, spi_p->xfer_length);
+}
+
+// Stops a transfer that did not complete. The channel's IRQ is masked while
+// it is aborted, since an abort can still raise it (RP2040-E13), and any
+// pending completion is cleared, so that neither the callback nor a
+// sem_release() can arrive during a later transfer.
+void spi_transfer_abort(spi_t *spi_p) {
+    spi_p->xfer_callback = NULL;
+    switch (spi_p->DMA_IRQ_num) {
+        case DMA_IRQ_0:
+            dma_channel_set_irq0_enabled(spi_p->rx_dma, false);
+            break;
+        case DMA_IRQ_1:
+            dma_channel_set_irq1_enabled(spi_p->rx_dma, false);
+            break;
+        default:
+            assert(false);
+    }
+    dma_channel_abort(spi_p->tx_dma);
+    dma_channel_abort(spi_p->rx_dma);
+    switch (spi_p->DMA_IRQ_num) {
+        case DMA_IRQ_0:
+            dma_channel_acknowledge_irq0(spi_p->rx_dma);
+            dma_channel_set_irq0_enabled(spi_p->rx_dma, true);
+            break;
+        case DMA_IRQ_1:
+            dma_channel_acknowledge_irq1(spi_p->rx_dma);
+            dma_channel_set_irq1_enabled(spi_p->rx_dma, true);
+            break;
+    }
+#if SD_DMA_CRC
+    if (spi_p->xfer_sniff) {
+        dma_sniffer_disable();
+        spi_p->xfer_sniff = false;
+        sniffer_release(spi_p);
+    }
+#endif
+    // Let the bytes already in the TX FIFO go out and drop what came back
+    while (spi_is_busy(spi_p->hw_inst))
+        tight_loop_contents();
+    while (spi_is_readable(spi_p->hw_inst))
+        (void)spi_get_hw(spi_p->hw_inst)->dr;
+    sem_reset(&spi_p->sem, 0);
+}
+
+int spi_transfer_poll(spi_t *spi_p, uint16_t *crc_p) {
+    if (!sem_try_acquire(&spi_p->sem)) {
+        if (absolute_time_diff_us(spi_p->xfer_start_time, get_absolute_time()) >
+            SPI_TRANSFER_TIMEOUT_MS * 1000) {
+            DBG_PRINTF("Transfer timed out in %s\n", __FUNCTION__);
+            spi_transfer_abort(spi_p);
+            return -1;
+        }
+        return 0;
+    }
+    spi_transfer_finish(spi_p, crc_p);
+    return 1;
+}
+
+bool spi_transfer_wait(spi_t *spi_p, uint16_t *crc_p) {
+    /* Wait until master completes transfer or time out has occured. */
+    bool rc = sem_acquire_timeout_ms(
+        &spi_p->sem, SPI_TRANSFER_TIMEOUT_MS);  // Wait for notification from ISR
+    if (!rc) {
+        // If the timeout is reached the function will return false
+        DBG_PRINTF("Notification wait timed out in %s\n", __FUNCTION__);
+        spi_transfer_abort(spi_p);
+        return false;
+    }
+    spi_transfer_finish(spi_p, crc_p);
     return true;
 }
 
+bool spi_transfer(spi_t *spi_p, const uint8_t *tx, uint8_t *rx, size_t length) {
+    // An interrupt handler (the asynchronous writes of sd_card.c) cannot
+    // wait for the DMA IRQ, which does not preempt it: clock the bytes by
+    // hand instead
+    if (__get_current_exception()) {
+        if (tx && rx)
+            spi_write_read_blocking(spi_p->hw_inst, tx, rx, length);
+        else if (tx)
+            spi_write_blocking(spi_p->hw_inst, tx, length);
+        else
+            spi_read_blocking(spi_p->hw_inst, SPI_FILL_CHAR, rx, length);
+        return true;
+    }
+    spi_transfer_start(spi_p, tx, rx, length, false);
+    return spi_transfer_wait(spi_p, NULL);
+}
+
+bool spi_transfer_crc(spi_t *spi_p, const uint8_t *tx, uint8_t *rx, size_t length,
+                      uint16_t *crc) {
+    spi_transfer_start(spi_p, tx, rx, length, true);
+    return spi_transfer_wait(spi_p, crc);
+}
+
 void spi_lock(spi_t *spi_p) {
     assert(mutex_is_initialized(&spi_p->mutex));
     mutex_enter_blocking(&spi_p->mutex);
@@ -210,6 +406,10 @@ bool my_spi_init(spi_t *spi_p) {
                                                        : DREQ_SPI0_RX);
         channel_config_set_read_increment(&spi_p->rx_dma_cfg, false);
 
+#if SD_DMA_CRC
+        spi_p->dma_crc_ok = spi_dma_crc_self_test(spi_p);
+#endif
+
         /* Theory: we only need an interrupt on rx complete,
         since if rx is complete, tx must also be complete. */
 
@@ -26,6 +26,17 @@ specific language governing permissions and limitations under the License.
 #include "pico/types.h"
 
 #define SPI_FILL_CHAR (0xFF)
+#define SPI_TRANSFER_TIMEOUT_MS 1000
+
+// Compute the CRC16 of SD data blocks with the DMA sniffer while they are
+// transferred, instead of a second pass over the block in software. The
+// sniffer is checked against the software CRC at init and is only used if
+// it agrees. It is a single resource shared by all DMA channels: a block
+// transfer claims it, and blocks transferred on other SPIs at the same time
+// (e.g. the members of an sd_raid.h device) get their CRC in software.
+#ifndef SD_DMA_CRC
+#define SD_DMA_CRC 1
+#endif
 
 // "Class" representing SPIs
 typedef struct {
@@ -51,6 +62,15 @@ typedef struct {
     dma_channel_config rx_dma_cfg;
     irq_handler_t dma_isr; // Ignored: no longer used
     bool initialized;  
+    bool dma_crc_ok;  // DMA sniffer CRC16 passed its self-test
+    // Transfer in flight:
+    const uint8_t *xfer_data;  // Block whose CRC is computed
+    size_t xfer_length;
+    bool xfer_crc;
+    bool xfer_sniff;  // Holds the DMA sniffer for its CRC
+    absolute_time_t xfer_start_time;
+    void (*xfer_callback)(void *context);  // See spi_transfer_start_notify()
+    void *xfer_context;
     semaphore_t sem;
     mutex_t mutex;    
 } spi_t;
@@ -59,7 +79,27 @@ typedef struct {
 extern "C" {
 #endif
   
+// From an interrupt handler the transfer polls the SPI instead of using DMA.
 bool __not_in_flash_func(spi_transfer)(spi_t *pSPI, const uint8_t *tx, uint8_t *rx, size_t length);  
+// As spi_transfer, also returning the CRC16 (SD data block CRC) of the data
+// sent (tx) or, when tx is NULL, of the data received.
+bool __not_in_flash_func(spi_transfer_crc)(spi_t *pSPI, const uint8_t *tx, uint8_t *rx, size_t length,
+                                           uint16_t *crc);
+// Split transfer: start the DMA, then either wait for it or poll until
+// spi_transfer_poll() returns 1 (done) or -1 (timed out); 0 means still
+// running. The CRC16 is returned on completion when crc was requested.
+void spi_transfer_start(spi_t *pSPI, const uint8_t *tx, uint8_t *rx, size_t length, bool crc);
+int spi_transfer_poll(spi_t *pSPI, uint16_t *crc);
+bool spi_transfer_wait(spi_t *pSPI, uint16_t *crc);
+// As spi_transfer_start, but instead of being polled or waited for, the
+// transfer calls callback(context) from the DMA IRQ handler when it is
+// complete. The callback must call spi_transfer_finish().
+void spi_transfer_start_notify(spi_t *pSPI, const uint8_t *tx, uint8_t *rx, size_t length,
+                               bool crc, void (*callback)(void *context), void *context);
+void spi_transfer_finish(spi_t *pSPI, uint16_t *crc);
+// Stops a started transfer that will not be finished, e.g. after a timeout.
+// Its callback is not called and the semaphore is left taken.
+void spi_transfer_abort(spi_t *pSPI);
 void spi_lock(spi_t *pSPI);
 void spi_unlock(spi_t *pSPI);
 bool my_spi_init(spi_t *pSPI);
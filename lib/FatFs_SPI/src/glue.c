@@ -20,11 +20,15 @@ specific language governing permissions and limitations under the License.
 /* storage control modules to the FatFs module with a defined API.       */
 /*-----------------------------------------------------------------------*/
 #include <stdio.h>
+#include <string.h>
 //
 #include "ff.h" /* Obtains integer types */
 //
 #include "diskio.h" /* Declarations of disk functions */
 //
+#include "disk_async.h"
+#include "disk_hint.h"
+#include "disk_stats.h"
 #include "hw_config.h"
 #include "my_debug.h"
 #include "sd_card.h"
@@ -32,6 +36,254 @@ specific language governing permissions and limitations under the License.
 #define TRACE_PRINTF(fmt, args...)
 //#define TRACE_PRINTF printf  // task_printf
 
+disk_stats_t disk_stats;
+
+void disk_stats_reset(void) {
+    disk_stats = (disk_stats_t){0};
+}
+
+#ifndef SD_ASYNC_DISK_WRITE
+#define SD_ASYNC_DISK_WRITE 1
+#endif
+
+static struct {
+    const BYTE *buffer;
+    size_t size;
+} async_regions[FF_VOLUMES];
+
+void disk_async_register(BYTE pdrv, const void *buffer, size_t size) {
+    if (pdrv >= FF_VOLUMES) return;
+    async_regions[pdrv].buffer = buffer;
+    async_regions[pdrv].size = size;
+}
+
+void disk_async_unregister(BYTE pdrv) {
+    disk_async_register(pdrv, NULL, 0);
+}
+
+void disk_async_poll(BYTE pdrv) {
+    sd_card_t *p_sd = sd_get_by_num(pdrv);
+    // Errors are kept for the next disk operation to report
+    if (p_sd && sd_write_async_busy(p_sd)) sd_write_async_poll(p_sd);
+}
+
+void disk_pre_erase(BYTE pdrv, LBA_t sector, LBA_t count) {
+    sd_card_t *p_sd = sd_get_by_num(pdrv);
+    if (p_sd) sd_set_pre_erase(p_sd, sector, count);
+}
+
+static bool in_async_region(BYTE pdrv, const BYTE *buff, UINT count) {
+    if (!SD_ASYNC_DISK_WRITE || pdrv >= FF_VOLUMES || !async_regions[pdrv].buffer) return false;
+    const BYTE *start = async_regions[pdrv].buffer;
+    return buff >= start &&
+           buff + (size_t)count * FF_MAX_SS <= start + async_regions[pdrv].size;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Sector write-back cache                                               */
+/*-----------------------------------------------------------------------*/
+/* Writes of fewer than DISK_CACHE_SECTORS sectors (FAT, directory and    */
+/* partial data sectors) are kept here instead of going to the card one  */
+/* CMD24 at a time. When the cache is full, and on CTRL_SYNC, the dirty   */
+/* sectors are written back in LBA order, each run of consecutive        */
+/* sectors as one multiple block write. Cached sectors also serve reads. */
+/* Larger writes go straight to the card, replacing any cached copy.     */
+/* DISK_CACHE_SECTORS 0 disables the cache.                              */
+/*-----------------------------------------------------------------------*/
+
+#ifndef DISK_CACHE_SECTORS
+#define DISK_CACHE_SECTORS 8
+#endif
+
+#if DISK_CACHE_SECTORS
+
+static struct {
+    BYTE pdrv;
+    bool valid;
+    bool dirty;
+    LBA_t sector;
+    uint32_t used;  // Stamp of the last access, for LRU replacement
+} cache_slots[DISK_CACHE_SECTORS];
+static BYTE cache_data[DISK_CACHE_SECTORS][FF_MAX_SS];
+static uint32_t cache_clock;
+
+static int cache_find(BYTE pdrv, LBA_t sector) {
+    for (int i = 0; i < DISK_CACHE_SECTORS; i++)
+        if (cache_slots[i].valid && cache_slots[i].pdrv == pdrv &&
+            cache_slots[i].sector == sector)
+            return i;
+    return -1;
+}
+
+// Drops cached copies of the sectors, which are about to be overwritten
+static void cache_discard(BYTE pdrv, LBA_t sector, LBA_t count) {
+    for (int i = 0; i < DISK_CACHE_SECTORS; i++)
+        if (cache_slots[i].valid && cache_slots[i].pdrv == pdrv &&
+            cache_slots[i].sector >= sector && cache_slots[i].sector - sector < count)
+            cache_slots[i].valid = false;
+}
+
+// Writes back the dirty sectors of the drive, in runs of consecutive sectors
+static int cache_flush(BYTE pdrv) {
+    sd_card_t *p_sd = sd_get_by_num(pdrv);
+    int order[DISK_CACHE_SECTORS];
+    int n = 0;
+    for (int i = 0; i < DISK_CACHE_SECTORS; i++) {
+        if (!cache_slots[i].valid || !cache_slots[i].dirty || cache_slots[i].pdrv != pdrv)
+            continue;
+        // Insertion sort by sector
+        int j = n++;
+        while (j > 0 && cache_slots[order[j - 1]].sector > cache_slots[i].sector) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+    if (!n) return SD_BLOCK_DEVICE_ERROR_NONE;
+    int rc = sd_write_async_wait(p_sd);  // Background write, if any
+    for (int k = 0; !rc && k < n; k++) {
+        int i = order[k];
+        if (!k || cache_slots[order[k - 1]].sector + 1 != cache_slots[i].sector) {
+            rc = sd_write_session_open(p_sd, cache_slots[i].sector);
+            if (rc) break;
+            disk_stats.cache_flush_runs++;
+        }
+        rc = sd_write_session_push(p_sd, cache_data[i], 1);
+        if (rc) break;
+        cache_slots[i].dirty = false;
+        disk_stats.cache_flush_sectors++;
+    }
+    int close_rc = sd_write_session_close(p_sd);
+    return rc ? rc : close_rc;
+}
+
+// Returns a slot for a new sector: a free one, else the least recently used
+// clean one, writing back the dirty sectors first if there is none
+static int cache_allocate(BYTE pdrv, int *rc) {
+    int victim = -1;
+    for (int pass = 0; pass < 2 && victim < 0; pass++) {
+        for (int i = 0; i < DISK_CACHE_SECTORS; i++) {
+            if (!cache_slots[i].valid) return i;
+            if (cache_slots[i].dirty) continue;
+            if (victim < 0 || cache_slots[i].used < cache_slots[victim].used) victim = i;
+        }
+        if (victim < 0) {
+            *rc = cache_flush(pdrv);
+            if (*rc) return -1;
+            // Only other drives' dirty sectors left: write those back too
+            for (BYTE other = 0; other < FF_VOLUMES; other++) {
+                if (other == pdrv) continue;
+                *rc = cache_flush(other);
+                if (*rc) return -1;
+            }
+        }
+    }
+    return victim;
+}
+
+static void cache_invalidate(BYTE pdrv) {
+    for (int i = 0; i < DISK_CACHE_SECTORS; i++)
+        if (cache_slots[i].pdrv == pdrv) cache_slots[i].valid = false;
+}
+
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* Read-ahead                                                            */
+/*-----------------------------------------------------------------------*/
+/* A read of fewer than DISK_READ_AHEAD_SECTORS sectors that continues    */
+/* the previous read, or the read-ahead window, fetches the next         */
+/* DISK_READ_AHEAD_SECTORS sectors with one CMD18, and the following     */
+/* reads are served from that window. Sequential reads of a file in      */
+/* small chunks then cost one card command per window instead of one     */
+/* per call, even with FAT lookups in between. Dirty sectors of the      */
+/* write-back cache are copied into the window when it is filled, and    */
+/* any later write to the window drops it.                               */
+/* DISK_READ_AHEAD_SECTORS 0 disables the read-ahead.                    */
+/*-----------------------------------------------------------------------*/
+
+#ifndef DISK_READ_AHEAD_SECTORS
+#define DISK_READ_AHEAD_SECTORS 8
+#endif
+
+#if DISK_READ_AHEAD_SECTORS
+
+static struct {
+    BYTE pdrv;
+    bool valid;
+    LBA_t sector;
+    UINT count;
+} readahead;
+static BYTE readahead_data[DISK_READ_AHEAD_SECTORS][FF_MAX_SS];
+static LBA_t read_next[FF_VOLUMES];  // Sector after the last read
+
+static bool readahead_holds(BYTE pdrv, LBA_t sector, UINT count) {
+    return readahead.valid && readahead.pdrv == pdrv && sector >= readahead.sector &&
+           sector + count <= readahead.sector + readahead.count;
+}
+
+static void readahead_discard(BYTE pdrv, LBA_t sector, LBA_t count) {
+    if (readahead.valid && readahead.pdrv == pdrv && sector < readahead.sector + readahead.count &&
+        readahead.sector < sector + count)
+        readahead.valid = false;
+}
+
+// Serves the read from the window, refilling it first if the read
+// continues a sequential run. Returns false to have the read go to the card.
+static bool readahead_read(BYTE pdrv, sd_card_t *p_sd, BYTE *buff, LBA_t sector, UINT count,
+                           int *rc) {
+    if (count >= DISK_READ_AHEAD_SECTORS || pdrv >= FF_VOLUMES) return false;
+    if (readahead_holds(pdrv, sector, count)) {
+        disk_stats.readahead_hits += count;
+    } else {
+        bool sequential = sector == read_next[pdrv] ||
+                          (readahead.valid && readahead.pdrv == pdrv &&
+                           sector == readahead.sector + readahead.count);
+        if (!sequential || sector >= p_sd->sectors) return false;
+        UINT n = DISK_READ_AHEAD_SECTORS;
+        if (p_sd->sectors - sector < n) n = p_sd->sectors - sector;
+        if (n < count) return false;
+        readahead.valid = false;
+        *rc = sd_write_async_wait(p_sd);  // Background write, if any
+        if (*rc) return true;
+        disk_stats.read_commands++;
+        *rc = p_sd->read_blocks(p_sd, readahead_data[0], sector, n);
+        if (*rc) return true;
+#if DISK_CACHE_SECTORS
+        // The card's copy of a dirty sector is stale, and would still be
+        // served from here once the cache has written it back and reused
+        // the slot
+        for (UINT k = 0; k < n; k++) {
+            int i = cache_find(pdrv, sector + k);
+            if (i >= 0 && cache_slots[i].dirty) memcpy(readahead_data[k], cache_data[i], FF_MAX_SS);
+        }
+#endif
+        readahead.pdrv = pdrv;
+        readahead.sector = sector;
+        readahead.count = n;
+        readahead.valid = true;
+    }
+    memcpy(buff, readahead_data[sector - readahead.sector], (size_t)count * FF_MAX_SS);
+    *rc = SD_BLOCK_DEVICE_ERROR_NONE;
+    return true;
+}
+
+#endif
+
+// Reads from the card, or the read-ahead window
+static int read_sectors(BYTE pdrv, sd_card_t *p_sd, BYTE *buff, LBA_t sector, UINT count) {
+    int rc;
+#if DISK_READ_AHEAD_SECTORS
+    bool served = readahead_read(pdrv, p_sd, buff, sector, count, &rc);
+    if (pdrv < FF_VOLUMES) read_next[pdrv] = sector + count;
+    if (served) return rc;
+#endif
+    rc = sd_write_async_wait(p_sd);  // Background write, if any
+    if (rc) return rc;
+    disk_stats.read_commands++;
+    return p_sd->read_blocks(p_sd, buff, sector, count);
+}
+
 /*-----------------------------------------------------------------------*/
 /* Get Drive Status                                                      */
 /*-----------------------------------------------------------------------*/
@@ -59,6 +311,13 @@ DSTATUS disk_initialize(
 
     sd_card_t *p_sd = sd_get_by_num(pdrv);
     if (!p_sd) return RES_PARERR;
+#if DISK_CACHE_SECTORS
+    // Whatever was cached may belong to a card that has been swapped
+    if (p_sd->m_Status & STA_NOINIT) cache_invalidate(pdrv);
+#endif
+#if DISK_READ_AHEAD_SECTORS
+    if ((p_sd->m_Status & STA_NOINIT) && readahead.pdrv == pdrv) readahead.valid = false;
+#endif
     // See http://elm-chan.org/fsw/ff/doc/dstat.html
     return p_sd->init(p_sd);  
 }
@@ -98,8 +357,30 @@ DRESULT disk_read(BYTE pdrv,  /* Physical drive nmuber to identify the drive */
     TRACE_PRINTF(">>> %s\n", __FUNCTION__);
     sd_card_t *p_sd = sd_get_by_num(pdrv);
     if (!p_sd) return RES_PARERR;
-    int rc = p_sd->read_blocks(p_sd, buff, sector, count);
-    return sdrc2dresult(rc);
+    disk_stats.read_calls++;
+    disk_stats.read_sectors += count;
+    int rc;
+#if DISK_CACHE_SECTORS
+    UINT cached = 0;
+    for (UINT k = 0; k < count; k++)
+        if (cache_find(pdrv, sector + k) >= 0) cached++;
+    if (cached < count) {
+#endif
+        rc = read_sectors(pdrv, p_sd, buff, sector, count);
+        if (rc) return sdrc2dresult(rc);
+#if DISK_CACHE_SECTORS
+    }
+    // Cached sectors may be newer than the card's
+    for (UINT k = 0; cached && k < count; k++) {
+        int i = cache_find(pdrv, sector + k);
+        if (i < 0) continue;
+        memcpy(buff + (size_t)k * FF_MAX_SS, cache_data[i], FF_MAX_SS);
+        cache_slots[i].used = ++cache_clock;
+        disk_stats.cache_read_hits++;
+        cached--;
+    }
+#endif
+    return RES_OK;
 }
 
 /*-----------------------------------------------------------------------*/
@@ -116,7 +397,46 @@ DRESULT disk_write(BYTE pdrv, /* Physical drive nmuber to identify the drive */
     TRACE_PRINTF(">>> %s\n", __FUNCTION__);
     sd_card_t *p_sd = sd_get_by_num(pdrv);
     if (!p_sd) return RES_PARERR;
-    int rc = p_sd->write_blocks(p_sd, buff, sector, count);
+    disk_stats.write_calls++;
+    disk_stats.write_sectors += count;
+    int rc;
+#if DISK_READ_AHEAD_SECTORS
+    readahead_discard(pdrv, sector, count);
+#endif
+#if DISK_CACHE_SECTORS
+    if (count < DISK_CACHE_SECTORS && !in_async_region(pdrv, buff, count)) {
+        for (UINT k = 0; k < count; k++) {
+            int i = cache_find(pdrv, sector + k);
+            if (i >= 0 && cache_slots[i].dirty) {
+                disk_stats.cache_write_hits++;
+            } else if (i < 0) {
+                rc = SD_BLOCK_DEVICE_ERROR_NONE;
+                i = cache_allocate(pdrv, &rc);
+                if (i < 0) return sdrc2dresult(rc);
+                cache_slots[i].pdrv = pdrv;
+                cache_slots[i].sector = sector + k;
+                cache_slots[i].valid = true;
+            }
+            memcpy(cache_data[i], buff + (size_t)k * FF_MAX_SS, FF_MAX_SS);
+            cache_slots[i].dirty = true;
+            cache_slots[i].used = ++cache_clock;
+        }
+        return RES_OK;
+    }
+    cache_discard(pdrv, sector, count);
+#endif
+    if (in_async_region(pdrv, buff, count)) {
+        // The application reuses the previous buffer once this returns. A
+        // card completes that write first; a RAID device starts this one on
+        // its members first, so that they program in parallel.
+        rc = p_sd->raid ? SD_BLOCK_DEVICE_ERROR_NONE : sd_write_async_wait(p_sd);
+        if (!rc) rc = sd_write_blocks_async(p_sd, buff, sector, count, NULL, NULL);
+        if (!rc) rc = sd_write_async_wait_earlier(p_sd);
+        return sdrc2dresult(rc);
+    }
+    rc = sd_write_async_wait(p_sd);  // Background write, if any
+    if (rc) return sdrc2dresult(rc);
+    rc = p_sd->write_blocks(p_sd, buff, sector, count);
     return sdrc2dresult(rc);
 }
 
@@ -156,12 +476,46 @@ DRESULT disk_ioctl(BYTE pdrv, /* Physical drive nmuber (0..) */
                                 // f_mkfs function and it attempts to align data
                                 // area on the erase block boundary. It is
                                 // required when FF_USE_MKFS == 1.
-            static DWORD bs = 1;
+            // The card's allocation unit, or the largest power of 2 that
+            // divides it (12 and 24 MiB AUs)
+            DWORD bs = p_sd->au_sectors & -p_sd->au_sectors;
+            if (!bs) bs = 1;
+            if (bs > 32768) bs = 32768;
             *(DWORD *)buff = bs;
             return RES_OK;
         }
-        case CTRL_SYNC:
-            return RES_OK;
+        case CTRL_TRIM: {  // Erases the sectors buff[0] to buff[1], which are
+                           // no longer in use (FF_USE_TRIM == 1)
+            LBA_t first = ((LBA_t *)buff)[0], last = ((LBA_t *)buff)[1];
+            if (last < first) return RES_PARERR;
+#if DISK_CACHE_SECTORS
+            cache_discard(pdrv, first, last - first + 1);
+#endif
+#if DISK_READ_AHEAD_SECTORS
+            readahead_discard(pdrv, first, last - first + 1);
+#endif
+            // Erasing part of an AU makes the card move the rest of it, so
+            // only whole AUs inside the range are erased
+            LBA_t au = p_sd->au_sectors;
+            if (au) {
+                first = (first + au - 1) / au * au;
+                last = (last + 1) / au * au;
+                if (last <= first) return RES_OK;
+                last--;
+            }
+            int rc = sd_write_async_wait(p_sd);  // Background write, if any
+            if (!rc) rc = sd_erase(p_sd, first, last);
+            return sdrc2dresult(rc);
+        }
+        case CTRL_SYNC: {  // Complete any cached, background or streaming write
+            int rc = SD_BLOCK_DEVICE_ERROR_NONE;
+#if DISK_CACHE_SECTORS
+            rc = cache_flush(pdrv);
+#endif
+            if (!rc) rc = sd_write_async_wait(p_sd);
+            if (!rc) rc = sd_write_session_close(p_sd);
+            return sdrc2dresult(rc);
+        }
         default:
             return RES_PARERR;
     }
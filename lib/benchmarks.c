@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/timer.h"
+
+#include "benchmarks.h"
+#include "crc.h"
+#include "record_format.h"
+
+#define BENCHMARK_RECORDS 1000
+#define BENCHMARK_CRC_BLOCKS 256
+#define BENCHMARK_CRC_BLOCK_SIZE 512
+
+static volatile size_t benchmark_sink;
+
+static void fill_benchmark_sample(sensor_sample_t *sample, uint32_t index) {
+    sample->sequence = index;
+    sample->time_us = (uint64_t)index * 10000;
+    for (int i = 0; i < 3; i++) {
+        sample->motion[i] = (int16_t)(index * 7919 + i * 1237);
+        sample->rotation[i] = (int16_t)(index * 104729 - i * 4099);
+    }
+    sample->heat = 0;
+}
+
+static uint32_t cycles_per_record(uint64_t elapsed_us) {
+    return (uint32_t)(elapsed_us * (clock_get_hz(clk_sys) / 1000000) / BENCHMARK_RECORDS);
+}
+
+static void benchmark_record_format() {
+    char data_buffer[RECORD_CSV_MAX_LENGTH];
+    sensor_sample_t sample;
+
+    uint64_t start_time = time_us_64();
+    for (uint32_t index = 0; index < BENCHMARK_RECORDS; index++) {
+        fill_benchmark_sample(&sample, index);
+        sprintf(data_buffer, "%d,%.1f,%d,%d,%d,%d,%d,%d\n", (int)sample.sequence, sample.time_us / 1000000.0f,
+            sample.motion[0], sample.motion[1], sample.motion[2], sample.rotation[0], sample.rotation[1], sample.rotation[2]);
+        benchmark_sink = strlen(data_buffer);
+    }
+    uint64_t sprintf_us = time_us_64() - start_time;
+
+    start_time = time_us_64();
+    for (uint32_t index = 0; index < BENCHMARK_RECORDS; index++) {
+        fill_benchmark_sample(&sample, index);
+        benchmark_sink = record_format_csv(data_buffer, &sample);
+    }
+    uint64_t formatter_us = time_us_64() - start_time;
+
+    printf("CSV record: sprintf %lu cycles/record, record_format_csv %lu cycles/record\n",
+        (unsigned long)cycles_per_record(sprintf_us), (unsigned long)cycles_per_record(formatter_us));
+}
+
+static void benchmark_crc16() {
+    static char block[BENCHMARK_CRC_BLOCK_SIZE];
+    for (int i = 0; i < BENCHMARK_CRC_BLOCK_SIZE; i++) {
+        block[i] = i * 131 + 7;
+    }
+    crc16(block, 1);  // Build the slicing tables outside the timed loop
+
+    uint64_t start_time = time_us_64();
+    for (int n = 0; n < BENCHMARK_CRC_BLOCKS; n++) {
+        block[0] = n;
+        benchmark_sink = crc16(block, BENCHMARK_CRC_BLOCK_SIZE);
+    }
+    uint64_t elapsed_us = time_us_64() - start_time;
+
+    printf("crc16: %.2f MB/s on %d-byte blocks\n",
+        (float)BENCHMARK_CRC_BLOCKS * BENCHMARK_CRC_BLOCK_SIZE / elapsed_us, BENCHMARK_CRC_BLOCK_SIZE);
+}
+
+void run_benchmarks(void) {
+    printf("\nBenchmarks (%lu MHz)\n", (unsigned long)(clock_get_hz(clk_sys) / 1000000));
+    benchmark_record_format();
+    benchmark_crc16();
+    printf("\n");
+}
@@ -0,0 +1,8 @@
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+// On-target microbenchmarks, printed over stdio at boot when the firmware is
+// built with add_compile_definitions(LOGGER_BENCHMARKS=1).
+void run_benchmarks(void);
+
+#endif
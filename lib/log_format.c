@@ -0,0 +1,139 @@
+#include <string.h>
+
+#include "log_format.h"
+
+#define LOG_CHANNELS_OFFSET 40
+#define LOG_CHANNEL_SIZE 12
+
+static const log_channel_t default_channels[LOG_CHANNEL_COUNT] = {
+    {"motion_x", LOG_UNIT_ACCEL},
+    {"motion_y", LOG_UNIT_ACCEL},
+    {"motion_z", LOG_UNIT_ACCEL},
+    {"heat", LOG_UNIT_TEMP},
+    {"rotation_x", LOG_UNIT_GYRO},
+    {"rotation_y", LOG_UNIT_GYRO},
+    {"rotation_z", LOG_UNIT_GYRO},
+};
+
+static void put_u16(uint8_t *out, uint16_t value) {
+    out[0] = value;
+    out[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *out, uint32_t value) {
+    put_u16(out, value);
+    put_u16(out + 2, value >> 16);
+}
+
+static void put_u64(uint8_t *out, uint64_t value) {
+    put_u32(out, value);
+    put_u32(out + 4, value >> 32);
+}
+
+static void put_float(uint8_t *out, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    put_u32(out, bits);
+}
+
+static uint16_t get_u16(const uint8_t *in) {
+    return in[0] | (in[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+    return get_u16(in) | ((uint32_t)get_u16(in + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+    return get_u32(in) | ((uint64_t)get_u32(in + 4) << 32);
+}
+
+static float get_float(const uint8_t *in) {
+    uint32_t bits = get_u32(in);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+void log_header_init(log_header_t *header) {
+    memset(header, 0, sizeof(*header));
+    header->version = LOG_VERSION;
+    header->header_size = LOG_HEADER_SIZE;
+    header->record_size = LOG_RECORD_SIZE;
+    header->channel_count = LOG_CHANNEL_COUNT;
+    memcpy(header->channels, default_channels, sizeof(default_channels));
+}
+
+void log_header_encode(uint8_t *out, const log_header_t *header) {
+    memset(out, 0, LOG_HEADER_SIZE);
+    memcpy(out, LOG_MAGIC, 8);
+    put_u16(out + 8, header->version);
+    put_u16(out + 10, header->header_size);
+    put_u16(out + 12, header->record_size);
+    put_u16(out + 14, header->channel_count);
+    put_float(out + 16, header->sample_rate_hz);
+    put_float(out + 20, header->accel_lsb_per_g);
+    put_float(out + 24, header->gyro_lsb_per_dps);
+    out[28] = header->dlpf;
+    out[29] = header->accel_range_g;
+    put_u16(out + 30, header->gyro_range_dps);
+    put_u64(out + 32, header->start_time_us);
+    for (int i = 0; i < LOG_CHANNEL_COUNT; i++) {
+        uint8_t *channel = out + LOG_CHANNELS_OFFSET + i * LOG_CHANNEL_SIZE;
+        strncpy((char *)channel, header->channels[i].name, LOG_CHANNEL_NAME_LENGTH);
+        channel[LOG_CHANNEL_SIZE - 1] = header->channels[i].unit;
+    }
+}
+
+bool log_header_decode(log_header_t *header, const uint8_t *in) {
+    if (memcmp(in, LOG_MAGIC, 8) != 0) {
+        return false;
+    }
+    memset(header, 0, sizeof(*header));
+    header->version = get_u16(in + 8);
+    header->header_size = get_u16(in + 10);
+    header->record_size = get_u16(in + 12);
+    header->channel_count = get_u16(in + 14);
+    if (header->version != LOG_VERSION || header->header_size != LOG_HEADER_SIZE ||
+        header->record_size != LOG_RECORD_SIZE || header->channel_count != LOG_CHANNEL_COUNT) {
+        return false;
+    }
+    header->sample_rate_hz = get_float(in + 16);
+    header->accel_lsb_per_g = get_float(in + 20);
+    header->gyro_lsb_per_dps = get_float(in + 24);
+    header->dlpf = in[28];
+    header->accel_range_g = in[29];
+    header->gyro_range_dps = get_u16(in + 30);
+    header->start_time_us = get_u64(in + 32);
+    for (int i = 0; i < LOG_CHANNEL_COUNT; i++) {
+        const uint8_t *channel = in + LOG_CHANNELS_OFFSET + i * LOG_CHANNEL_SIZE;
+        memcpy(header->channels[i].name, channel, LOG_CHANNEL_NAME_LENGTH);
+        header->channels[i].unit = channel[LOG_CHANNEL_SIZE - 1];
+    }
+    return true;
+}
+
+void log_record_encode(uint8_t *out, const sensor_sample_t *sample) {
+    put_u32(out, sample->sequence);
+    put_u32(out + 4, (uint32_t)sample->time_us);
+    for (int i = 0; i < 3; i++) {
+        put_u16(out + 8 + i * 2, sample->motion[i]);
+        put_u16(out + 16 + i * 2, sample->rotation[i]);
+    }
+    put_u16(out + 14, sample->heat);
+    put_u16(out + 22, 0);
+}
+
+void log_record_decode(sensor_sample_t *sample, const uint8_t *in, uint64_t previous_time_us) {
+    sample->sequence = get_u32(in);
+    uint32_t time_us = get_u32(in + 4);
+    sample->time_us = (previous_time_us & ~(uint64_t)UINT32_MAX) | time_us;
+    if (sample->time_us < previous_time_us) {
+        sample->time_us += (uint64_t)UINT32_MAX + 1;
+    }
+    for (int i = 0; i < 3; i++) {
+        sample->motion[i] = (int16_t)get_u16(in + 8 + i * 2);
+        sample->rotation[i] = (int16_t)get_u16(in + 16 + i * 2);
+    }
+    sample->heat = (int16_t)get_u16(in + 14);
+}
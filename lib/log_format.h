@@ -0,0 +1,67 @@
+#ifndef LOG_FORMAT_H
+#define LOG_FORMAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sample_ring.h"
+
+// Binary recording layout. Everything is little-endian and written byte by
+// byte, so the same code decodes the files on the host (see tools/log2csv.c).
+//
+// A file is one LOG_HEADER_SIZE byte header followed by LOG_RECORD_SIZE byte
+// records, one per sample:
+//   0  uint32 sample number
+//   4  uint32 time since the start of the recording in us (wraps every ~71 min)
+//   8  int16  x LOG_CHANNEL_COUNT raw channels, in the order of the header
+//   22 uint16 reserved, zero
+#define LOG_MAGIC "MPULOG\r\n"
+#define LOG_VERSION 1
+#define LOG_HEADER_SIZE 128
+#define LOG_RECORD_SIZE 24
+#define LOG_CHANNEL_COUNT 7
+#define LOG_CHANNEL_NAME_LENGTH 10
+
+typedef enum {
+    LOG_UNIT_RAW = 0,
+    LOG_UNIT_ACCEL = 1,  // Divide by accel_lsb_per_g for g
+    LOG_UNIT_GYRO = 2,   // Divide by gyro_lsb_per_dps for degrees/s
+    LOG_UNIT_TEMP = 3    // Raw / 340 + 36.53 for degrees C
+} log_unit_t;
+
+typedef struct {
+    char name[LOG_CHANNEL_NAME_LENGTH + 1];
+    uint8_t unit;
+} log_channel_t;
+
+typedef struct {
+    uint16_t version;
+    uint16_t header_size;
+    uint16_t record_size;
+    uint16_t channel_count;
+    float sample_rate_hz;
+    float accel_lsb_per_g;
+    float gyro_lsb_per_dps;
+    uint8_t dlpf;
+    uint8_t accel_range_g;
+    uint16_t gyro_range_dps;
+    uint64_t start_time_us;  // time_us_64() when the recording started
+    log_channel_t channels[LOG_CHANNEL_COUNT];
+} log_header_t;
+
+// Fills the version, sizes and channel layout; the caller sets the rest.
+void log_header_init(log_header_t *header);
+
+// Encode into / decode from LOG_HEADER_SIZE bytes. Decoding returns false if
+// the magic or version do not match or the sizes are not supported.
+void log_header_encode(uint8_t *out, const log_header_t *header);
+bool log_header_decode(log_header_t *header, const uint8_t *in);
+
+void log_record_encode(uint8_t *out, const sensor_sample_t *sample);
+
+// previous_time_us is the time of the previous record (0 for the first one)
+// and is used to undo the wrap of the 32-bit time field.
+void log_record_decode(sensor_sample_t *sample, const uint8_t *in, uint64_t previous_time_us);
+
+#endif
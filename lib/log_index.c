@@ -0,0 +1,75 @@
+#include <string.h>
+
+#include "log_index.h"
+
+// Parses "sensor_log<N>.<ext>", returning 0 for anything else.
+static uint32_t parse_log_number(const char *name) {
+    size_t prefix_length = strlen(LOG_INDEX_PREFIX);
+    if (strncmp(name, LOG_INDEX_PREFIX, prefix_length) != 0) {
+        return 0;
+    }
+    const char *digit = name + prefix_length;
+    uint32_t number = 0;
+    while (*digit >= '0' && *digit <= '9') {
+        if (number > (UINT32_MAX - 9) / 10) {
+            return 0;
+        }
+        number = number * 10 + (*digit - '0');
+        digit++;
+    }
+    if (*digit != '.') {
+        return 0;
+    }
+    return number;
+}
+
+void log_index_reset(log_index_t *index) {
+    memset(index, 0, sizeof(*index));
+}
+
+void log_index_add(log_index_t *index, uint32_t number, FSIZE_t size) {
+    index->log_count++;
+    index->total_size += size;
+    if (number > index->highest_number) {
+        index->highest_number = number;
+    }
+
+    log_index_entry_t *slot;
+    if (index->entry_count < LOG_INDEX_CAPACITY) {
+        slot = &index->entries[index->entry_count++];
+    } else {
+        // Full: replace the lowest numbered entry if this one is newer.
+        slot = &index->entries[0];
+        for (uint32_t i = 1; i < LOG_INDEX_CAPACITY; i++) {
+            if (index->entries[i].number < slot->number) {
+                slot = &index->entries[i];
+            }
+        }
+        if (slot->number > number) {
+            return;
+        }
+    }
+    slot->number = number;
+    slot->size = size;
+}
+
+FRESULT log_index_scan(log_index_t *index) {
+    log_index_reset(index);
+
+    DIR directory;
+    FILINFO info;
+    FRESULT result = f_findfirst(&directory, &info, "", LOG_INDEX_PREFIX "*");
+    for (uint32_t scanned = 0; result == FR_OK && info.fname[0]; scanned++) {
+        if (scanned == LOG_INDEX_SCAN_LIMIT) {
+            index->truncated = true;
+            break;
+        }
+        uint32_t number = parse_log_number(info.fname);
+        if (number && !(info.fattrib & AM_DIR)) {
+            log_index_add(index, number, info.fsize);
+        }
+        result = f_findnext(&directory, &info);
+    }
+    f_closedir(&directory);
+    return result;
+}
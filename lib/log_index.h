@@ -0,0 +1,50 @@
+#ifndef LOG_INDEX_H
+#define LOG_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ff.h"
+
+#define LOG_INDEX_PREFIX "sensor_log"
+
+// Number of logs whose size is kept in RAM: the highest numbered ones.
+#ifndef LOG_INDEX_CAPACITY
+#define LOG_INDEX_CAPACITY 32
+#endif
+
+// Directory entries examined by one scan. Past this the scan stops and the
+// next number is taken from what was seen; opening with FA_CREATE_NEW still
+// keeps an existing file from being overwritten.
+#ifndef LOG_INDEX_SCAN_LIMIT
+#define LOG_INDEX_SCAN_LIMIT 4096
+#endif
+
+typedef struct {
+    uint32_t number;
+    FSIZE_t size;
+} log_index_entry_t;
+
+typedef struct {
+    log_index_entry_t entries[LOG_INDEX_CAPACITY];
+    uint32_t entry_count;
+    uint32_t log_count;       // Logs found on the card, indexed or not
+    uint64_t total_size;      // Bytes in all of them
+    uint32_t highest_number;  // 0 when the card has no logs
+    bool truncated;           // The scan hit LOG_INDEX_SCAN_LIMIT
+} log_index_t;
+
+void log_index_reset(log_index_t *index);
+
+// Rebuilds the index from the sensor_log<N>.* files in the current directory
+// of the mounted volume. Returns the first f_findfirst/f_findnext error.
+FRESULT log_index_scan(log_index_t *index);
+
+// Records a log written since the scan, so the card is not walked again.
+void log_index_add(log_index_t *index, uint32_t number, FSIZE_t size);
+
+static inline uint32_t log_index_next_number(const log_index_t *index) {
+    return index->highest_number + 1;
+}
+
+#endif
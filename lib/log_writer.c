@@ -0,0 +1,171 @@
+#include <string.h>
+
+#include "hardware/timer.h"
+
+#include "disk_async.h"
+#include "disk_hint.h"
+#include "log_writer.h"
+
+static FRESULT write_all(log_writer_t *writer, const void *data, size_t length) {
+    UINT bytes_written;
+    FRESULT result = f_write(writer->file, data, length, &bytes_written);
+    if (result == FR_OK && bytes_written != length) {
+        return FR_DENIED;  // Volume full
+    }
+    writer->unsynced = true;
+    return result;
+}
+
+void log_writer_init(log_writer_t *writer, FIL *file) {
+    writer->file = file;
+    writer->used = 0;
+    writer->preallocated = false;
+    writer->pre_erase_sectors = 0;
+    writer->unsynced = false;
+    writer->records_since_sync = 0;
+    writer->bytes_since_sync = 0;
+    writer->last_sync_time_us = time_us_64();
+    writer->syncs = 0;
+    writer->sync_time_total_us = 0;
+    writer->sync_time_max_us = 0;
+#if LOG_STAGING_SECTORS > 0
+    writer->buffer = writer->buffers[0];
+    disk_async_register(file->obj.fs->pdrv, writer->buffers, sizeof(writer->buffers));
+#endif
+}
+
+void log_writer_poll(log_writer_t *writer) {
+#if LOG_STAGING_SECTORS > 0
+    disk_async_poll(writer->file->obj.fs->pdrv);
+#endif
+}
+
+FRESULT log_writer_preallocate(log_writer_t *writer, FSIZE_t size) {
+    FRESULT result;
+    while ((result = f_expand(writer->file, size, 1)) == FR_DENIED && size / 2 >= 1024 * 1024) {
+        size /= 2;
+    }
+    writer->preallocated = (result == FR_OK);
+#if LOG_PRE_ERASE
+    if (writer->preallocated) {
+        // f_expand allocated one contiguous run from the file's first cluster
+        FATFS *fs = writer->file->obj.fs;
+        LBA_t sector = fs->database + (LBA_t)fs->csize * (writer->file->obj.sclust - 2);
+        writer->pre_erase_sectors = (size + FF_MAX_SS - 1) / FF_MAX_SS;
+        disk_pre_erase(fs->pdrv, sector, writer->pre_erase_sectors);
+    }
+#endif
+    return result;
+}
+
+FRESULT log_writer_append(log_writer_t *writer, const void *data, size_t length) {
+    writer->records_since_sync++;
+    writer->bytes_since_sync += length;
+#if LOG_STAGING_SECTORS > 0
+    const uint8_t *bytes = data;
+    while (length > 0) {
+        size_t chunk = LOG_STAGING_SIZE - writer->used;
+        if (chunk > length) {
+            chunk = length;
+        }
+        memcpy(writer->buffer + writer->used, bytes, chunk);
+        writer->used += chunk;
+        bytes += chunk;
+        length -= chunk;
+        if (writer->used == LOG_STAGING_SIZE) {
+            // The write of the other buffer completes before this one is handed over
+            uint8_t *full = writer->buffer;
+            writer->buffer = (full == writer->buffers[0]) ? writer->buffers[1] : writer->buffers[0];
+            writer->used = 0;
+            FRESULT result = write_all(writer, full, LOG_STAGING_SIZE);
+            if (result != FR_OK) {
+                return result;
+            }
+        }
+    }
+    return FR_OK;
+#else
+    return write_all(writer, data, length);
+#endif
+}
+
+FRESULT log_writer_flush(log_writer_t *writer) {
+#if LOG_STAGING_SECTORS > 0
+    if (writer->used > 0) {
+        size_t used = writer->used;
+        writer->used = 0;
+        return write_all(writer, writer->buffer, used);
+    }
+#endif
+    return FR_OK;
+}
+
+static bool checkpoint_due(const log_writer_t *writer) {
+    return (LOG_SYNC_RECORDS > 0 && writer->records_since_sync >= LOG_SYNC_RECORDS) ||
+        (LOG_SYNC_BYTES > 0 && writer->bytes_since_sync >= LOG_SYNC_BYTES) ||
+        (LOG_SYNC_INTERVAL_MS > 0 && time_us_64() - writer->last_sync_time_us >= LOG_SYNC_INTERVAL_MS * 1000ull);
+}
+
+FRESULT log_writer_checkpoint(log_writer_t *writer) {
+    // Nothing new reached the file since the last sync: wait for the next
+    // staging buffer instead of flushing a partial one.
+    if (!writer->unsynced || !checkpoint_due(writer)) {
+        return FR_OK;
+    }
+    uint64_t start_time = time_us_64();
+    // f_expand set the size to the whole reserved region. Commit the bytes
+    // written so far instead, so that a file recovered after a power cut ends
+    // at this checkpoint rather than running on into unwritten sectors; the
+    // clusters past it stay in the file's chain.
+    FIL *file = writer->file;
+    FSIZE_t size = file->obj.objsize;
+    if (writer->preallocated && f_tell(file) < size) {
+        file->obj.objsize = f_tell(file);
+    }
+    FRESULT result = f_sync(file);
+    file->obj.objsize = size;
+    uint64_t now = time_us_64();
+    uint32_t sync_time_us = now - start_time;
+    writer->syncs++;
+    writer->sync_time_total_us += sync_time_us;
+    if (sync_time_us > writer->sync_time_max_us) {
+        writer->sync_time_max_us = sync_time_us;
+    }
+    writer->unsynced = false;
+    writer->records_since_sync = 0;
+    writer->bytes_since_sync = 0;
+    writer->last_sync_time_us = now;
+    return result;
+}
+
+static void clear_pre_erase(log_writer_t *writer) {
+#if LOG_PRE_ERASE
+    if (writer->pre_erase_sectors) {
+        disk_pre_erase(writer->file->obj.fs->pdrv, 0, 0);
+        writer->pre_erase_sectors = 0;
+    }
+#endif
+}
+
+FRESULT log_writer_finish(log_writer_t *writer) {
+    FRESULT result = log_writer_flush(writer);
+    clear_pre_erase(writer);
+    if (result == FR_OK && writer->preallocated) {
+        result = f_truncate(writer->file);
+    }
+    if (result == FR_OK) {
+        result = f_sync(writer->file);  // Also completes the background write
+    }
+#if LOG_STAGING_SECTORS > 0
+    disk_async_unregister(writer->file->obj.fs->pdrv);
+#endif
+    return result;
+}
+
+void log_writer_abort(log_writer_t *writer) {
+    clear_pre_erase(writer);
+#if LOG_STAGING_SECTORS > 0
+    writer->used = 0;
+    disk_async_unregister(writer->file->obj.fs->pdrv);
+#endif
+}
@@ -0,0 +1,107 @@
+#ifndef LOG_WRITER_H
+#define LOG_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ff.h"
+
+// Records are packed into a staging buffer and handed to f_write only as
+// whole buffers, so every write starts on a sector boundary and covers
+// LOG_STAGING_SECTORS full sectors. FatFs then sends them straight to the
+// card as one multi-sector disk_write instead of a read-modify-write of its
+// sector window per record. Matching the cluster size of the card (8 sectors
+// on most FAT32 cards up to 32 GB) makes every write a whole cluster.
+// LOG_STAGING_SECTORS=0 writes every record straight through, for comparison.
+// There are two staging buffers: while a full one is written to the card in
+// the background (disk_async.h), records go into the other.
+#ifndef LOG_STAGING_SECTORS
+#define LOG_STAGING_SECTORS 8
+#endif
+
+#define LOG_STAGING_SIZE (LOG_STAGING_SECTORS * FF_MAX_SS)
+
+// Size of the contiguous region reserved with f_expand when a recording
+// starts. Appends inside it only follow the already written cluster chain,
+// so the FAT is not touched until the file is truncated and closed on stop;
+// a longer recording simply keeps growing past it. 0 disables preallocation.
+#ifndef LOG_PREALLOCATE_MB
+#define LOG_PREALLOCATE_MB 32
+#endif
+
+// Hint the card to pre-erase the preallocated region (disk_hint.h), so that
+// it does not erase block by block while the recording streams in.
+// LOG_PRE_ERASE=0 leaves the card to itself, for comparison.
+#ifndef LOG_PRE_ERASE
+#define LOG_PRE_ERASE 1
+#endif
+
+// Checkpoint policy: log_writer_checkpoint() calls f_sync, committing the
+// data and directory entry written so far, once any enabled threshold is
+// reached (0 disables a threshold). Only whole staging buffers are ever
+// synced, and a preallocated file is synced with its size set to the bytes
+// written rather than the reserved region, so the data lost on a power cut
+// is bounded by the checkpoint interval plus LOG_STAGING_SIZE and readers
+// stop at the last checkpoint. Shorter intervals cost extra FAT and
+// directory sector writes; the time spent in f_sync is reported per recording.
+#ifndef LOG_SYNC_RECORDS
+#define LOG_SYNC_RECORDS 0
+#endif
+#ifndef LOG_SYNC_BYTES
+#define LOG_SYNC_BYTES 0
+#endif
+#ifndef LOG_SYNC_INTERVAL_MS
+#define LOG_SYNC_INTERVAL_MS 1000
+#endif
+
+typedef struct {
+    FIL *file;
+    size_t used;
+    bool preallocated;
+    uint32_t pre_erase_sectors;  // Size of the pre-erase hint, 0 if none
+    bool unsynced;  // Data reached the file since the last f_sync
+    uint32_t records_since_sync;
+    uint32_t bytes_since_sync;
+    uint64_t last_sync_time_us;
+    uint32_t syncs;
+    uint64_t sync_time_total_us;
+    uint32_t sync_time_max_us;
+#if LOG_STAGING_SECTORS > 0
+    uint8_t *buffer;  // The staging buffer being filled
+    uint8_t buffers[2][LOG_STAGING_SIZE];
+#endif
+} log_writer_t;
+
+// file must already be open.
+void log_writer_init(log_writer_t *writer, FIL *file);
+
+// Reserves a contiguous region of up to size bytes for the still empty file,
+// halving the request down to 1 MB if the card has no free run that long,
+// and hints the card to pre-erase it (LOG_PRE_ERASE).
+FRESULT log_writer_preallocate(log_writer_t *writer, FSIZE_t size);
+
+// Appends length bytes, writing out the staging buffer each time it fills.
+FRESULT log_writer_append(log_writer_t *writer, const void *data, size_t length);
+
+// Moves a background write of the previous staging buffer along. Call it
+// often, e.g. after every record.
+void log_writer_poll(log_writer_t *writer);
+
+// Syncs the file if the checkpoint policy says so. Call it between batches
+// of records, not for every record.
+FRESULT log_writer_checkpoint(log_writer_t *writer);
+
+// Writes the partially filled tail of the staging buffer.
+FRESULT log_writer_flush(log_writer_t *writer);
+
+// Flushes and trims a preallocated file to the bytes actually written, and
+// clears the pre-erase hint. The caller still closes the file.
+FRESULT log_writer_finish(log_writer_t *writer);
+
+// Gives up on a recording after an error: clears the pre-erase hint and
+// unregisters the staging buffers from the drive, dropping any staged
+// records. The caller still closes the file.
+void log_writer_abort(log_writer_t *writer);
+
+#endif
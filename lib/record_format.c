@@ -0,0 +1,50 @@
+#include "record_format.h"
+
+static char *format_uint(char *out, uint32_t value) {
+    char digits[10];
+    int count = 0;
+    do {
+        digits[count++] = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+    while (count) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+static char *format_int(char *out, int32_t value) {
+    if (value < 0) {
+        *out++ = '-';
+        return format_uint(out, -(uint32_t)value);
+    }
+    return format_uint(out, value);
+}
+
+size_t record_format_csv(char *out, const sensor_sample_t *sample) {
+    char *position = out;
+
+    position = format_uint(position, sample->sequence);
+    *position++ = ',';
+
+    // Fixed-point seconds with millisecond resolution
+    uint64_t time_ms = sample->time_us / 1000;
+    uint32_t milliseconds = time_ms % 1000;
+    position = format_uint(position, (uint32_t)(time_ms / 1000));
+    *position++ = '.';
+    *position++ = '0' + (milliseconds / 100);
+    *position++ = '0' + ((milliseconds / 10) % 10);
+    *position++ = '0' + (milliseconds % 10);
+
+    for (int i = 0; i < 3; i++) {
+        *position++ = ',';
+        position = format_int(position, sample->motion[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        *position++ = ',';
+        position = format_int(position, sample->rotation[i]);
+    }
+    *position++ = '\n';
+
+    return position - out;
+}
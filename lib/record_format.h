@@ -0,0 +1,19 @@
+#ifndef RECORD_FORMAT_H
+#define RECORD_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sample_ring.h"
+
+// Longest line record_format_csv() can produce, including the newline:
+// 10 digits of sample number, time in seconds with 3 decimals and six
+// signed 16-bit channels, plus separators.
+#define RECORD_CSV_MAX_LENGTH 80
+
+// Renders one "sample_number,time_s,motion_x,...,rotation_z\n" line into out
+// using integer arithmetic only (no printf, no float) and returns its length.
+// out must hold at least RECORD_CSV_MAX_LENGTH bytes; no terminator is written.
+size_t record_format_csv(char *out, const sensor_sample_t *sample);
+
+#endif
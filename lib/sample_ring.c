@@ -0,0 +1,40 @@
+#include "sample_ring.h"
+#include "hardware/sync.h"
+
+void sample_ring_reset(sample_ring_t *ring) {
+    ring->head = 0;
+    ring->tail = 0;
+    ring->high_water = 0;
+    ring->overruns = 0;
+    __dmb();
+}
+
+// Producer side only.
+bool sample_ring_push(sample_ring_t *ring, const sensor_sample_t *sample) {
+    uint32_t head = ring->head;
+    uint32_t used = head - ring->tail;
+    if (used >= SAMPLE_RING_SIZE) {
+        ring->overruns += 1;
+        return false;
+    }
+    ring->samples[head & (SAMPLE_RING_SIZE - 1)] = *sample;
+    // Publish the sample before the new head becomes visible to the consumer
+    __dmb();
+    ring->head = head + 1;
+    if (used + 1 > ring->high_water)
+        ring->high_water = used + 1;
+    return true;
+}
+
+// Consumer side only.
+bool sample_ring_pop(sample_ring_t *ring, sensor_sample_t *sample) {
+    uint32_t tail = ring->tail;
+    if (tail == ring->head)
+        return false;
+    __dmb();
+    *sample = ring->samples[tail & (SAMPLE_RING_SIZE - 1)];
+    // Finish reading the slot before handing it back to the producer
+    __dmb();
+    ring->tail = tail + 1;
+    return true;
+}
@@ -0,0 +1,36 @@
+#ifndef SAMPLE_RING_H
+#define SAMPLE_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Must be a power of two. A sample takes 32 bytes once padded for its
+// 64-bit timestamp, so the default uses 32 KiB of RAM and holds about 1 s
+// of data at 1 kHz, enough to ride out a slow SD card write.
+#ifndef SAMPLE_RING_SIZE
+#define SAMPLE_RING_SIZE 1024
+#endif
+
+typedef struct {
+    uint64_t time_us;   // Time since the start of the recording
+    uint32_t sequence;  // Sample number since the start of the recording
+    int16_t motion[3];
+    int16_t heat;
+    int16_t rotation[3];
+} sensor_sample_t;
+
+// Lock-free single-producer/single-consumer ring: the acquisition core only
+// advances head and the storage core only advances tail.
+typedef struct {
+    sensor_sample_t samples[SAMPLE_RING_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t high_water;  // Most samples ever waiting in the ring
+    volatile uint32_t overruns;    // Samples dropped because the ring was full
+} sample_ring_t;
+
+void sample_ring_reset(sample_ring_t *ring);
+bool sample_ring_push(sample_ring_t *ring, const sensor_sample_t *sample);
+bool sample_ring_pop(sample_ring_t *ring, sensor_sample_t *sample);
+
+#endif
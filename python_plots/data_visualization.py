@@ -6,10 +6,15 @@ x_axis_choice = 0
 
 file_path = rf'{data_file}'
 
+header_rows = 1
 with open(file_path, 'r') as input_file:
-    column_names = input_file.readline().strip().split(',')
+    header_line = input_file.readline()
+    while header_line.startswith('#'):
+        header_line = input_file.readline()
+        header_rows += 1
+    column_names = header_line.strip().split(',')
 
-raw_data = np.loadtxt(file_path, delimiter=',', skiprows=1)
+raw_data = np.loadtxt(file_path, delimiter=',', skiprows=header_rows)
 x_values = raw_data[:, x_axis_choice]
 
 plot_colors = ['b', 'g', 'r', 'c', 'm', 'y']
@@ -0,0 +1,92 @@
+// Checks the SD driver's CRC7/CRC16 (lib/FatFs_SPI/sd_driver/crc.c) against
+// bit-at-a-time reference implementations and measures CRC16 throughput on
+// 512-byte blocks. Build once per table configuration to compare them:
+//   cc -O2 -DCRC16_SLICES=8 -Ilib/FatFs_SPI/sd_driver -o crc_bench tools/crc_bench.c lib/FatFs_SPI/sd_driver/crc.c
+//   ./crc_bench
+// The same measurement runs on the target with LOGGER_BENCHMARKS=1.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc.h"
+
+#define BLOCK_SIZE 512
+#define CHECK_ROUNDS 100000
+#define BENCH_BLOCKS 200000
+
+#ifndef CRC16_SLICES
+#define CRC16_SLICES 4
+#endif
+#ifndef CRC7_SLICES
+#define CRC7_SLICES 4
+#endif
+
+// CRC-16/XMODEM: polynomial 0x1021, initial value 0, as used for SD data
+static unsigned short reference_crc16(unsigned short crc, const unsigned char *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// CRC7: polynomial 0x09, initial value 0, as used for SD commands
+static unsigned char reference_crc7(const unsigned char *data, size_t length) {
+    unsigned char crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            unsigned char in = ((data[i] >> bit) & 1) ^ (crc >> 6);
+            crc = ((crc << 1) & 0x7F) ^ (in ? 0x09 : 0);
+        }
+    }
+    return crc;
+}
+
+static double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(void) {
+    static unsigned char block[BLOCK_SIZE + 64];
+    unsigned long mismatches = 0;
+    srand(1);
+
+    for (int round = 0; round < CHECK_ROUNDS; round++) {
+        size_t length = rand() % (sizeof(block) + 1);
+        for (size_t i = 0; i < length; i++) {
+            block[i] = rand();
+        }
+        if (crc16((const char *)block, length) != reference_crc16(0, block, length)) {
+            mismatches++;
+        }
+        unsigned short seed = rand();
+        unsigned short crc = seed;
+        update_crc16(&crc, (const char *)block, length);
+        if (crc != reference_crc16(seed, block, length)) {
+            mismatches++;
+        }
+        size_t command_length = length % 48;
+        if ((unsigned char)crc7((const char *)block, command_length) != reference_crc7(block, command_length)) {
+            mismatches++;
+        }
+    }
+    printf("CRC16_SLICES=%d CRC7_SLICES=%d: %d random buffers, %lu mismatches\n",
+        CRC16_SLICES, CRC7_SLICES, CHECK_ROUNDS, mismatches);
+
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        block[i] = rand();
+    }
+    volatile unsigned short sink = 0;
+    double start = seconds_now();
+    for (int n = 0; n < BENCH_BLOCKS; n++) {
+        block[0] = n;
+        sink ^= crc16((const char *)block, BLOCK_SIZE);
+    }
+    double elapsed = seconds_now() - start;
+    printf("crc16: %.1f MB/s on %d-byte blocks\n", BENCH_BLOCKS * (double)BLOCK_SIZE / elapsed / 1e6, BLOCK_SIZE);
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,75 @@
+// Converts binary recordings (sensor_logN.bin) into the CSV layout written by
+// the CSV recording mode, so python_plots/data_visualization.py reads both.
+//
+// Build on the host from the repository root:
+//   cc -O2 -Ilib -o log2csv tools/log2csv.c lib/log_format.c lib/record_format.c
+// Usage:
+//   ./log2csv sensor_log1.bin [sensor_log1.csv]
+#include <stdio.h>
+
+#include "log_format.h"
+#include "record_format.h"
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s input.bin [output.csv]\n", argv[0]);
+        return 2;
+    }
+    FILE *input = fopen(argv[1], "rb");
+    if (!input) {
+        perror(argv[1]);
+        return 1;
+    }
+    FILE *output = stdout;
+    if (argc == 3) {
+        output = fopen(argv[2], "w");
+        if (!output) {
+            perror(argv[2]);
+            fclose(input);
+            return 1;
+        }
+    }
+
+    uint8_t header_data[LOG_HEADER_SIZE];
+    log_header_t header;
+    if (fread(header_data, 1, sizeof(header_data), input) != sizeof(header_data) ||
+        !log_header_decode(&header, header_data)) {
+        fprintf(stderr, "%s: not a version %d sensor log\n", argv[1], LOG_VERSION);
+        fclose(input);
+        return 1;
+    }
+
+    fprintf(output, "# sample_rate_hz=%.2f,dlpf_cfg=%d,accel_range_g=%d,gyro_range_dps=%d,accel_lsb_per_g=%.1f,gyro_lsb_per_dps=%.3f\n",
+        header.sample_rate_hz, header.dlpf, header.accel_range_g, header.gyro_range_dps,
+        header.accel_lsb_per_g, header.gyro_lsb_per_dps);
+    fprintf(output, "sample_number,time_s");
+    for (int i = 0; i < LOG_CHANNEL_COUNT; i++) {
+        if (header.channels[i].unit != LOG_UNIT_TEMP) {
+            fprintf(output, ",%s", header.channels[i].name);
+        }
+    }
+    fprintf(output, "\n");
+
+    uint8_t record[LOG_RECORD_SIZE];
+    char line[RECORD_CSV_MAX_LENGTH];
+    sensor_sample_t sample;
+    uint64_t previous_time_us = 0;
+    unsigned long records = 0;
+    size_t length;
+    while ((length = fread(record, 1, sizeof(record), input)) == sizeof(record)) {
+        log_record_decode(&sample, record, previous_time_us);
+        previous_time_us = sample.time_us;
+        fwrite(line, 1, record_format_csv(line, &sample), output);
+        records++;
+    }
+    if (length != 0) {
+        fprintf(stderr, "%s: ignoring %zu trailing bytes of a partial record\n", argv[1], length);
+    }
+
+    fclose(input);
+    if (output != stdout) {
+        fclose(output);
+    }
+    fprintf(stderr, "%lu records\n", records);
+    return 0;
+}
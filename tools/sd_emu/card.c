@@ -0,0 +1,515 @@
+// SDHC card in SPI mode, one byte at a time: commands CMD0/6/8/9/10/12/13/
+// 16/17/18/24/25/32/33/38/55/58/59 and ACMD13/23/41, with CRC7 and CRC16
+// checked (bit by bit, independently of the driver's tables) once CMD59
+// turns them on, and busy times drawn from the configured distribution.
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sd_emu.h"
+
+#define R1_IDLE_STATE 0x01
+#define R1_ILLEGAL_COMMAND 0x04
+#define R1_COM_CRC_ERROR 0x08
+#define R1_ERASE_SEQUENCE_ERROR 0x10
+#define R1_PARAMETER_ERROR 0x40
+
+#define TOKEN_START_BLOCK 0xFE
+#define TOKEN_START_MULTI 0xFC
+#define TOKEN_STOP_TRAN 0xFD
+#define DATA_ACCEPTED 0xE5
+#define DATA_CRC_ERROR 0xEB
+#define DATA_WRITE_ERROR 0xED
+#define DATA_ERROR_OUT_OF_RANGE 0x08
+
+#define OCR_VOLTAGE_WINDOW 0x00FF8000  // 2.7 to 3.6 V
+#define OCR_CCS (1u << 30)
+#define OCR_POWER_UP (1u << 31)
+
+#define CAPACITY_UNIT_SECTORS 1024    // C_SIZE counts 512 KiB
+#define AU_SECTORS (4 * 1024 * 2)     // 4 MiB, AU_SIZE code 9
+#define DEFAULT_SPEED_MAX_HZ 25000000u
+#define HIGH_SPEED_MAX_HZ 50000000u
+#define IDENTIFICATION_MAX_HZ 400000u
+#define GARBLE_ONE_IN 64
+
+enum {
+    STATE_COMMAND,      // Waiting for commands
+    STATE_READ,         // CMD17/CMD18: the next block is due at ready_ns
+    STATE_WRITE_TOKEN,  // CMD24/CMD25: waiting for a start block token
+    STATE_WRITE_DATA,   // Receiving a data block and its CRC16
+};
+
+static uint8_t crc7(const uint8_t *data, size_t length) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            uint8_t in = ((data[i] >> bit) ^ (crc >> 6)) & 1;
+            crc = (crc << 1) & 0x7F;
+            if (in) crc ^= 0x09;
+        }
+    }
+    return crc;
+}
+
+static uint16_t crc16(const uint8_t *data, size_t length) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// xorshift64*, uniform in [0, 1)
+static double random_unit(sd_emu_card_t *card) {
+    card->rng ^= card->rng >> 12;
+    card->rng ^= card->rng << 25;
+    card->rng ^= card->rng >> 27;
+    return ((card->rng * 0x2545F4914F6CDD1Dull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+bool sd_emu_card_open(sd_emu_card_t *card, const char *path, uint64_t create_bytes,
+                      uint32_t serial) {
+    card->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (card->fd < 0) {
+        perror(path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(card->fd, &st) != 0) {
+        perror(path);
+        return false;
+    }
+    uint64_t size = st.st_size;
+    if (!size) {
+        size = create_bytes;
+        if (ftruncate(card->fd, size) != 0) {
+            perror(path);
+            return false;
+        }
+    }
+    card->sectors = size / SD_EMU_BLOCK_SIZE / CAPACITY_UNIT_SECTORS * CAPACITY_UNIT_SECTORS;
+    if (!card->sectors) {
+        fprintf(stderr, "%s: smaller than 512 KiB\n", path);
+        return false;
+    }
+    card->serial = serial;
+    card->rng = 0x9E3779B97F4A7C15ull ^ serial;
+    card->state = STATE_COMMAND;
+    return true;
+}
+
+void sd_emu_card_close(sd_emu_card_t *card) {
+    close(card->fd);
+}
+
+static void queue(sd_emu_card_t *card, const uint8_t *bytes, size_t length) {
+    if (!card->out_length) card->out_head = 0;
+    if (card->out_head + card->out_length + length > sizeof card->out) return;
+    memcpy(card->out + card->out_head + card->out_length, bytes, length);
+    card->out_length += length;
+}
+
+static void queue_byte(sd_emu_card_t *card, uint8_t byte) {
+    queue(card, &byte, 1);
+}
+
+// R1 after one byte of command response time (NCR)
+static void respond(sd_emu_card_t *card, uint8_t r1) {
+    const uint8_t response[] = {0xFF, r1};
+    queue(card, response, sizeof response);
+}
+
+// A data block (register contents) sent right after the response
+static void queue_block(sd_emu_card_t *card, const uint8_t *data, size_t length) {
+    uint16_t crc = crc16(data, length);
+    queue_byte(card, 0xFF);
+    queue_byte(card, TOKEN_START_BLOCK);
+    queue(card, data, length);
+    queue_byte(card, crc >> 8);
+    queue_byte(card, crc);
+}
+
+static void read_sector(sd_emu_card_t *card, uint64_t sector, uint8_t *data) {
+    if (pread(card->fd, data, SD_EMU_BLOCK_SIZE, sector * SD_EMU_BLOCK_SIZE) != SD_EMU_BLOCK_SIZE)
+        memset(data, 0, SD_EMU_BLOCK_SIZE);
+}
+
+static bool write_sector(sd_emu_card_t *card, uint64_t sector, const uint8_t *data) {
+    return pwrite(card->fd, data, SD_EMU_BLOCK_SIZE, sector * SD_EMU_BLOCK_SIZE) ==
+           SD_EMU_BLOCK_SIZE;
+}
+
+// Sets bits msb to lsb of a 128-bit register, numbered as in the spec
+static void set_bits(uint8_t reg[16], int msb, int lsb, uint32_t value) {
+    for (int bit = lsb; bit <= msb; bit++, value >>= 1) {
+        uint8_t mask = 1 << (bit & 7);
+        if (value & 1)
+            reg[15 - bit / 8] |= mask;
+        else
+            reg[15 - bit / 8] &= ~mask;
+    }
+}
+
+static void send_csd(sd_emu_card_t *card) {
+    // CSD version 2.0, as an SDHC card: 512-byte blocks, classes 0, 2, 4,
+    // 5, 7, 8 and 10
+    uint8_t csd[16] = {0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, 0x00,
+                       0x00, 0x00, 0x7F, 0x80, 0x0A, 0x40, 0x00, 0x00};
+    if (card->high_speed) csd[3] = 0x5A;  // TRAN_SPEED 50 Mbit/s
+    set_bits(csd, 69, 48, card->sectors / CAPACITY_UNIT_SECTORS - 1);  // C_SIZE
+    csd[15] = crc7(csd, 15) << 1 | 1;
+    queue_block(card, csd, sizeof csd);
+}
+
+static void send_cid(sd_emu_card_t *card) {
+    uint8_t cid[16] = {0x00, 'E', 'M', 'S', 'D', 'E', 'M', 'U', 0x10};
+    cid[9] = card->serial >> 24;  // PSN
+    cid[10] = card->serial >> 16;
+    cid[11] = card->serial >> 8;
+    cid[12] = card->serial;
+    cid[13] = 0x01;  // MDT: 2026-10
+    cid[14] = 0xAA;
+    cid[15] = crc7(cid, 15) << 1 | 1;
+    queue_block(card, cid, sizeof cid);
+}
+
+// CMD6: group 1 (access mode) is the only group with a choice, function 1
+// being High Speed
+static void switch_function(sd_emu_card_t *card, uint32_t arg) {
+    uint8_t status[64] = {0x00, 0x64};  // Maximum current 100 mA
+    status[12] = 0x80;                  // Group 1 support: function 15 (no change)
+    status[13] = card->config.high_speed ? 0x03 : 0x01;
+    uint8_t function = arg & 0xF;
+    uint8_t selected;
+    if (0xF == function)
+        selected = card->high_speed ? 1 : 0;
+    else if (function <= 1 && (status[13] & (1 << function)))
+        selected = function;
+    else
+        selected = 0xF;  // Not supported: nothing is switched
+    status[16] = selected;
+    status[17] = 0x01;  // Data structure version
+    if ((arg & 0x80000000) && 0xF != selected) card->high_speed = 1 == selected;
+    queue_block(card, status, sizeof status);
+}
+
+// ACMD13 SD Status: speed class 10, 4 MiB AU, one AU erased per second
+static void send_sd_status(sd_emu_card_t *card) {
+    uint8_t status[64] = {0};
+    status[8] = 0x04;       // SPEED_CLASS 10
+    status[10] = 9 << 4;    // AU_SIZE: 4 MiB
+    status[12] = 1;         // ERASE_SIZE: 1 AU
+    status[13] = 1 << 2 | 1;  // ERASE_TIMEOUT 1 s, ERASE_OFFSET 1 s
+    queue_block(card, status, sizeof status);
+}
+
+static void erase(sd_emu_card_t *card, uint64_t t_ns) {
+    static const uint8_t zeros[SD_EMU_BLOCK_SIZE];
+    for (uint64_t sector = card->erase_first; sector <= card->erase_last; sector++)
+        write_sector(card, sector, zeros);
+    uint64_t aus = (card->erase_last - card->erase_first + AU_SECTORS) / AU_SECTORS;
+    card->busy_until_ns = t_ns + aus * card->config.erase_au_us * 1000ull;
+}
+
+// Programming time of one block, in microseconds
+static uint32_t busy_time_us(sd_emu_card_t *card) {
+    const sd_emu_config_t *config = &card->config;
+    double us = config->busy_min_us;
+    if (config->busy_mean_us > config->busy_min_us)
+        us -= log(1.0 - random_unit(card)) * (config->busy_mean_us - config->busy_min_us);
+    if (card->pre_erased) {
+        card->pre_erased--;
+    } else if (random_unit(card) * 1e6 < config->stall_ppm) {
+        us += config->stall_us;
+        card->stats.stalls++;
+    }
+    return (uint32_t)us;
+}
+
+static void execute(sd_emu_card_t *card, uint64_t t_ns) {
+    const uint8_t *cmd = card->cmd;
+    const uint8_t index = cmd[0] & 0x3F;
+    const uint32_t arg = (uint32_t)cmd[1] << 24 | cmd[2] << 16 | cmd[3] << 8 | cmd[4];
+    const bool app = card->app;
+    card->app = false;
+
+    // Only CMD0 moves the card from SD mode into SPI mode
+    if (!card->spi_mode && index != 0) return;
+    // CMD0 and CMD8 always carry a valid CRC7, the rest once CMD59 says so
+    if ((index == 0 || index == 8 || card->crc_on) && cmd[5] != (crc7(cmd, 5) << 1 | 1)) {
+        card->stats.crc_errors++;
+        if (card->spi_mode) respond(card, (card->ready ? 0 : R1_IDLE_STATE) | R1_COM_CRC_ERROR);
+        return;
+    }
+    if (app)
+        card->stats.app_commands[index]++;
+    else
+        card->stats.commands[index]++;
+    if (t_ns < card->busy_until_ns && index != 0 && index != 12) card->stats.protocol_errors++;
+    // A write must get its data block (and a multiple block write its Stop
+    // Tran) and a read only ends with CMD12
+    if (STATE_WRITE_TOKEN == card->state || (STATE_READ == card->state && index != 12)) {
+        card->stats.protocol_errors++;
+        card->state = STATE_COMMAND;
+        card->out_length = 0;
+    }
+
+    uint8_t r1 = card->ready ? 0 : R1_IDLE_STATE;
+    // In the idle state, only the initialization commands are accepted
+    if (!card->ready && !(index == 0 || index == 8 || index == 55 || index == 58 ||
+                          index == 59 || (app && index == 41))) {
+        respond(card, r1 | R1_ILLEGAL_COMMAND);
+        return;
+    }
+    switch (app ? 0x40 | index : index) {
+        case 0:  // GO_IDLE_STATE
+            card->spi_mode = true;
+            card->ready = false;
+            card->init_started = false;
+            card->crc_on = false;
+            card->high_speed = false;
+            card->state = STATE_COMMAND;
+            card->out_length = 0;
+            card->busy_until_ns = 0;
+            card->pre_erased = 0;
+            card->erase_set = 0;
+            respond(card, R1_IDLE_STATE);
+            break;
+        case 6:  // SWITCH_FUNC
+            respond(card, r1);
+            switch_function(card, arg);
+            break;
+        case 8: {  // SEND_IF_COND, R7
+            respond(card, r1);
+            const uint8_t r7[] = {0x00, 0x00, (arg >> 8) & 0xF, arg & 0xFF};
+            queue(card, r7, sizeof r7);
+            break;
+        }
+        case 9:  // SEND_CSD
+            respond(card, r1);
+            send_csd(card);
+            break;
+        case 10:  // SEND_CID
+            respond(card, r1);
+            send_cid(card);
+            break;
+        case 12:  // STOP_TRANSMISSION
+            if (STATE_READ == card->state) {
+                card->out_length = 0;
+                card->state = STATE_COMMAND;
+            }
+            respond(card, r1);
+            break;
+        case 13: {  // SEND_STATUS, R2
+            respond(card, r1);
+            queue_byte(card, card->r2);
+            card->r2 = 0;
+            break;
+        }
+        case 16:  // SET_BLOCKLEN: fixed on SDHC
+            respond(card, arg == SD_EMU_BLOCK_SIZE ? r1 : r1 | R1_PARAMETER_ERROR);
+            break;
+        case 17:  // READ_SINGLE_BLOCK
+        case 18:  // READ_MULTIPLE_BLOCK
+            if (arg >= card->sectors) {
+                respond(card, r1 | R1_PARAMETER_ERROR);
+                break;
+            }
+            respond(card, r1);
+            card->state = STATE_READ;
+            card->multi = 18 == index;
+            card->address = arg;
+            card->ready_ns = t_ns + card->config.read_us * 1000ull;
+            break;
+        case 24:  // WRITE_BLOCK
+        case 25:  // WRITE_MULTIPLE_BLOCK
+            if (arg >= card->sectors) {
+                respond(card, r1 | R1_PARAMETER_ERROR);
+                break;
+            }
+            respond(card, r1);
+            card->state = STATE_WRITE_TOKEN;
+            card->multi = 25 == index;
+            card->address = arg;
+            // The ACMD23 count only applies to the next multiple block write
+            if (!card->multi) card->pre_erased = 0;
+            break;
+        case 32:  // ERASE_WR_BLK_START_ADDR
+        case 33:  // ERASE_WR_BLK_END_ADDR
+            if (arg >= card->sectors) {
+                respond(card, r1 | R1_PARAMETER_ERROR);
+                break;
+            }
+            if (32 == index) {
+                card->erase_first = arg;
+                card->erase_set = 1;
+            } else {
+                card->erase_last = arg;
+                card->erase_set |= 2;
+            }
+            respond(card, r1);
+            break;
+        case 38:  // ERASE, R1b
+            if (card->erase_set != 3 || card->erase_last < card->erase_first) {
+                respond(card, r1 | R1_ERASE_SEQUENCE_ERROR);
+                break;
+            }
+            card->erase_set = 0;
+            respond(card, r1);
+            erase(card, t_ns);
+            break;
+        case 55:  // APP_CMD
+            card->app = true;
+            respond(card, r1);
+            break;
+        case 58: {  // READ_OCR, R3
+            respond(card, r1);
+            uint32_t ocr = OCR_VOLTAGE_WINDOW | (card->ready ? OCR_POWER_UP | OCR_CCS : 0);
+            const uint8_t r3[] = {ocr >> 24, ocr >> 16, ocr >> 8, ocr};
+            queue(card, r3, sizeof r3);
+            break;
+        }
+        case 59:  // CRC_ON_OFF
+            card->crc_on = arg & 1;
+            respond(card, r1);
+            break;
+        case 0x40 | 13:  // SD_STATUS: R2, then a data block
+            respond(card, r1);
+            queue_byte(card, 0x00);
+            send_sd_status(card);
+            break;
+        case 0x40 | 23:  // SET_WR_BLK_ERASE_COUNT
+            card->pre_erased = arg & 0x7FFFFF;
+            respond(card, r1);
+            break;
+        case 0x40 | 41:  // SD_SEND_OP_COND
+            if (!card->init_started) {
+                card->init_started = true;
+                card->init_start_ns = t_ns;
+            }
+            // An SDHC card stays idle for a host without HCS
+            if ((arg & OCR_CCS) && t_ns - card->init_start_ns >= card->config.init_us * 1000ull)
+                card->ready = true;
+            respond(card, card->ready ? 0 : R1_IDLE_STATE);
+            break;
+        default:
+            respond(card, r1 | R1_ILLEGAL_COMMAND);
+            break;
+    }
+}
+
+static void receive_block(sd_emu_card_t *card, uint64_t t_ns) {
+    card->stats.data_bytes += SD_EMU_BLOCK_SIZE;
+    card->state = card->multi ? STATE_WRITE_TOKEN : STATE_COMMAND;
+    uint16_t crc = card->block[SD_EMU_BLOCK_SIZE] << 8 | card->block[SD_EMU_BLOCK_SIZE + 1];
+    if (card->crc_on && crc != crc16(card->block, SD_EMU_BLOCK_SIZE)) {
+        card->stats.crc_errors++;
+        queue_byte(card, DATA_CRC_ERROR);
+        return;
+    }
+    if (card->address >= card->sectors || !write_sector(card, card->address, card->block)) {
+        card->r2 |= 0x80;  // Out of range
+        queue_byte(card, DATA_WRITE_ERROR);
+        return;
+    }
+    card->address++;
+    card->stats.blocks_written++;
+    uint64_t busy_us = busy_time_us(card);
+    if (!card->multi) busy_us += card->config.close_us;
+    card->stats.busy_us += busy_us;
+    card->busy_until_ns = t_ns + busy_us * 1000;
+    queue_byte(card, DATA_ACCEPTED);
+}
+
+// The byte on DO while in comes in on DI
+static uint8_t output(sd_emu_card_t *card, uint64_t t_ns) {
+    if (!card->out_length && STATE_READ == card->state) {
+        if (!card->ready_ns) card->ready_ns = t_ns + card->config.read_next_us * 1000ull;
+        if (t_ns >= card->ready_ns) {
+            if (card->address >= card->sectors) {
+                queue_byte(card, DATA_ERROR_OUT_OF_RANGE);
+                card->state = STATE_COMMAND;
+            } else {
+                uint8_t data[SD_EMU_BLOCK_SIZE];
+                read_sector(card, card->address++, data);
+                queue_block(card, data, sizeof data);
+                card->out_head++;  // No leading byte: the access time is over
+                card->out_length--;
+                card->stats.data_bytes += SD_EMU_BLOCK_SIZE;
+                card->stats.blocks_read++;
+                // The next block's access time starts when this one is sent
+                card->ready_ns = 0;
+                if (!card->multi) card->state = STATE_COMMAND;
+            }
+        }
+    }
+    if (card->out_length) {
+        card->out_length--;
+        return card->out[card->out_head++];
+    }
+    if (t_ns < card->busy_until_ns) {
+        card->stats.busy_bytes++;
+        return 0x00;
+    }
+    return 0xFF;
+}
+
+static void input(sd_emu_card_t *card, uint8_t in, uint64_t t_ns) {
+    if (STATE_WRITE_DATA == card->state) {
+        card->block[card->block_length++] = in;
+        if (card->block_length == sizeof card->block) receive_block(card, t_ns);
+        return;
+    }
+    if (STATE_WRITE_TOKEN == card->state && !card->cmd_length) {
+        bool busy = t_ns < card->busy_until_ns;
+        if (in == (card->multi ? TOKEN_START_MULTI : TOKEN_START_BLOCK)) {
+            if (busy) card->stats.protocol_errors++;
+            card->state = STATE_WRITE_DATA;
+            card->block_length = 0;
+            return;
+        }
+        if (in == TOKEN_STOP_TRAN && card->multi) {
+            if (busy) card->stats.protocol_errors++;
+            // One byte, then busy while the last blocks are committed
+            card->state = STATE_COMMAND;
+            card->pre_erased = 0;
+            queue_byte(card, 0xFF);
+            uint64_t from_ns = busy ? card->busy_until_ns : t_ns;
+            card->busy_until_ns = from_ns + card->config.close_us * 1000ull;
+            card->stats.busy_us += card->config.close_us;
+            return;
+        }
+    }
+    if (!card->cmd_length && (in & 0xC0) != 0x40) return;
+    card->cmd[card->cmd_length++] = in;
+    if (card->cmd_length == sizeof card->cmd) {
+        card->cmd_length = 0;
+        execute(card, t_ns);
+    }
+}
+
+void sd_emu_card_select(sd_emu_card_t *card, bool selected, uint64_t t_ns) {
+    (void)t_ns;
+    // A command cut short by the chip select is lost
+    if (!selected) card->cmd_length = 0;
+}
+
+uint8_t sd_emu_card_exchange(sd_emu_card_t *card, uint8_t in, uint64_t t_ns, uint baud_rate) {
+    card->stats.bus_bytes++;
+    uint8_t out = output(card, t_ns);
+    input(card, in, t_ns);
+    uint32_t max_hz = !card->ready         ? IDENTIFICATION_MAX_HZ
+                      : card->high_speed ? HIGH_SPEED_MAX_HZ
+                                         : DEFAULT_SPEED_MAX_HZ;
+    if (card->config.max_hz && card->config.max_hz < max_hz) max_hz = card->config.max_hz;
+    if (baud_rate > max_hz && random_unit(card) * GARBLE_ONE_IN < 1) {
+        card->stats.garbled_bytes++;
+        out ^= 0x10;
+    }
+    return out;
+}
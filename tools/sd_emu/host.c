@@ -0,0 +1,682 @@
+// Host side of the emulator: the Pico SDK calls the SD driver and spi.c
+// make, on a virtual clock. An SPI DMA transfer hands its bytes to the card
+// when it is started, timed as they would cross the bus, and raises its
+// channel's interrupt when the clock reaches its end; timer alarms fire the
+// same way. Handlers run whenever the clock moves forward outside a handler
+// and with interrupts enabled, as on a single core. The single DMA sniffer
+// accumulates a byte when the byte goes by, so a transfer that reprograms it
+// while another one is using it corrupts that one's CRC, as on the chip.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hardware/claim.h"
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/spi.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "pico/mutex.h"
+#include "pico/sem.h"
+#include "pico/time.h"
+
+#include "sd_emu.h"
+
+#define CLK_PERI_HZ 125000000u
+#define NUM_GPIOS 30
+#define NUM_DMA_CHANNELS 12
+#define MAX_EVENTS 16
+#define MAX_CARDS 4
+#define MAX_IRQ_HANDLERS 4
+#define TIGHT_LOOP_NS 100
+#define TIMER_EXCEPTION (16 + 3)  // TIMER_IRQ_3, the default alarm pool's
+#define NOT_WRITTEN (1u << 31)    // No channel: shows a handler wrote INTSn
+
+spi_inst_t emu_spi_inst[2];
+dma_hw_t emu_dma_hw;
+uint32_t emu_transfer_overhead_ns;
+
+static uint64_t now_ns;
+static bool interrupts_disabled;
+static uint exception;   // Of the running handler, 0 for none
+static bool event_flag;  // Set by __sev and by every interrupt
+static bool gpio_level[NUM_GPIOS];
+static sd_emu_card_t *cards[MAX_CARDS];
+static size_t card_count;
+
+// A timer alarm
+typedef struct {
+    bool used;
+    uint64_t when_ns;
+    alarm_id_t id;
+    alarm_callback_t callback;
+    void *user_data;
+} event_t;
+static event_t events[MAX_EVENTS];
+static alarm_id_t next_alarm_id = 1;
+
+// A DMA channel and the transfer it was last started with. Byte i of it
+// goes by at start_ns + (i + 1) * byte_ns.
+typedef struct {
+    uint32_t ctrl;
+    volatile uint8_t *write_addr;
+    const volatile uint8_t *read_addr;
+    uint32_t count;
+    bool busy;
+    const volatile uint8_t *data;  // The bytes it moves, and their stride
+    size_t data_stride;
+    uint64_t start_ns;
+    uint64_t byte_ns;  // 0 for a memory copy, done when started
+    uint64_t done_ns;
+    uint32_t seen;  // Bytes gone by, which the sniffer took or missed
+} dma_channel_t;
+static dma_channel_t dma_channels[NUM_DMA_CHANNELS];
+static uint32_t dma_claimed;
+static uint32_t dma_intr;     // Raw interrupt flags
+static uint32_t dma_inte[2];  // Enables of DMA_IRQ_0 and DMA_IRQ_1
+
+static struct {
+    bool enabled;
+    uint channel;
+    uint32_t accumulator;
+} sniffer;
+
+typedef struct {
+    bool enabled;
+    irq_handler_t handlers[MAX_IRQ_HANDLERS];
+    size_t handler_count;
+} irq_t;
+static irq_t dma_irqs[2];
+
+static void fatal(const char *message) {
+    fprintf(stderr, "sd_emu: %s at %.6f s\n", message, now_ns / 1e9);
+    exit(2);
+}
+
+uint64_t emu_now_ns(void) {
+    return now_ns;
+}
+
+static event_t *add_event(uint64_t when_ns) {
+    for (size_t i = 0; i < MAX_EVENTS; i++) {
+        if (!events[i].used) {
+            events[i] = (event_t){.used = true, .when_ns = when_ns};
+            return &events[i];
+        }
+    }
+    return NULL;
+}
+
+static event_t *next_event(void) {
+    event_t *next = NULL;
+    for (size_t i = 0; i < MAX_EVENTS; i++)
+        if (events[i].used && (!next || events[i].when_ns < next->when_ns)) next = &events[i];
+    return next;
+}
+
+static void dispatch(void);
+
+// Lets time pass; handlers run at once unless one is running already
+static void advance(uint64_t ns) {
+    now_ns += ns;
+    dispatch();
+}
+
+/* DMA */
+
+static uint32_t dma_bytes_done(const dma_channel_t *ch) {
+    if (!ch->byte_ns) return ch->count;
+    if (now_ns <= ch->start_ns) return 0;
+    uint64_t done = (now_ns - ch->start_ns) / ch->byte_ns;
+    return done < ch->count ? (uint32_t)done : ch->count;
+}
+
+// CRC-16-CCITT, MSB first, on the accumulator
+static void sniff(uint8_t byte) {
+    uint32_t crc = sniffer.accumulator ^ (uint32_t)byte << 8;
+    for (int i = 0; i < 8; i++) crc = crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1;
+    sniffer.accumulator = crc & 0xFFFF;
+}
+
+// Brings the channels up to the clock: the sniffer takes the bytes that
+// went by since, if it watches their channel, and finished channels raise
+// their interrupt. Called before anything reads or changes DMA state.
+static void dma_update(void) {
+    for (uint i = 0; i < NUM_DMA_CHANNELS; i++) {
+        dma_channel_t *ch = &dma_channels[i];
+        if (!ch->busy) continue;
+        bool watched = sniffer.enabled && sniffer.channel == i &&
+                       (ch->ctrl & DMA_CH0_CTRL_TRIG_SNIFF_EN_BITS);
+        for (uint32_t done = dma_bytes_done(ch); ch->seen < done; ch->seen++)
+            if (watched) sniff(ch->data[ch->seen * ch->data_stride]);
+        if (ch->seen == ch->count) {
+            ch->busy = false;
+            dma_intr |= 1u << i;
+        }
+    }
+}
+
+static uint treq(const dma_channel_t *ch) {
+    return (ch->ctrl & DMA_CH0_CTRL_TRIG_TREQ_SEL_BITS) >> DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB;
+}
+
+static size_t read_stride(const dma_channel_t *ch) {
+    return ch->ctrl & DMA_CH0_CTRL_TRIG_INCR_READ_BITS ? 1 : 0;
+}
+
+static size_t write_stride(const dma_channel_t *ch) {
+    return ch->ctrl & DMA_CH0_CTRL_TRIG_INCR_WRITE_BITS ? 1 : 0;
+}
+
+static uint64_t bus_transfer(spi_inst_t *spi, const volatile uint8_t *tx, size_t tx_stride,
+                             volatile uint8_t *rx, size_t rx_stride, size_t length,
+                             uint64_t t_ns);
+
+// A channel paced by an SPI's TX DREQ must start with the one paced by its
+// RX DREQ, as spi.c does; the pair clocks the bytes over the bus.
+static void dma_start(uint32_t mask) {
+    dma_update();
+    for (uint i = 0; i < NUM_DMA_CHANNELS; i++) {
+        dma_channel_t *ch = &dma_channels[i];
+        if (mask & 1u << i && ch->busy) fatal("DMA channel started while busy");
+    }
+    for (uint i = 0; i < NUM_DMA_CHANNELS; i++) {
+        dma_channel_t *tx = &dma_channels[i];
+        if (!(mask & 1u << i)) continue;
+        if ((tx->ctrl & DMA_CH0_CTRL_TRIG_DATA_SIZE_BITS) >> DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB != DMA_SIZE_8)
+            fatal("DMA transfers are only modelled in bytes");
+        if (treq(tx) == DREQ_FORCE) {
+            for (uint32_t n = 0; n < tx->count; n++)
+                tx->write_addr[n * write_stride(tx)] = tx->read_addr[n * read_stride(tx)];
+            tx->data = tx->read_addr;
+            tx->data_stride = read_stride(tx);
+            tx->byte_ns = 0;
+        } else if (treq(tx) == DREQ_SPI0_TX || treq(tx) == DREQ_SPI1_TX) {
+            dma_channel_t *rx = NULL;
+            for (uint j = 0; j < NUM_DMA_CHANNELS; j++)
+                if (mask & 1u << j && treq(&dma_channels[j]) == treq(tx) + 1)
+                    rx = &dma_channels[j];
+            if (!rx || rx->count != tx->count) fatal("SPI DMA started without its RX channel");
+            spi_inst_t *spi = &emu_spi_inst[treq(tx) == DREQ_SPI1_TX];
+            rx->start_ns = tx->start_ns = now_ns + emu_transfer_overhead_ns;
+            rx->done_ns = tx->done_ns = bus_transfer(spi, tx->read_addr, read_stride(tx),
+                                                     rx->write_addr, write_stride(rx),
+                                                     tx->count, tx->start_ns);
+            rx->byte_ns = tx->byte_ns = 8000000000ull / spi->baud_rate;
+            tx->data = tx->read_addr;
+            tx->data_stride = read_stride(tx);
+            rx->data = rx->write_addr;
+            rx->data_stride = write_stride(rx);
+            tx->busy = rx->busy = true;
+            tx->seen = rx->seen = 0;
+            continue;
+        } else if (treq(tx) == DREQ_SPI0_RX || treq(tx) == DREQ_SPI1_RX) {
+            continue;  // With its TX channel
+        } else {
+            fatal("DMA channel paced by an unmodelled DREQ");
+        }
+        tx->busy = true;
+        tx->seen = 0;
+    }
+    dma_update();
+}
+
+int dma_claim_unused_channel(bool required) {
+    for (int i = 0; i < NUM_DMA_CHANNELS; i++) {
+        if (!(dma_claimed & 1u << i)) {
+            dma_claimed |= 1u << i;
+            return i;
+        }
+    }
+    if (required) fatal("no free DMA channel");
+    return -1;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config,
+                           volatile void *write_addr, const volatile void *read_addr,
+                           uint transfer_count, bool trigger) {
+    dma_update();
+    dma_channel_t *ch = &dma_channels[channel];
+    if (ch->busy) fatal("DMA channel configured while busy");
+    ch->ctrl = config->ctrl;
+    ch->write_addr = write_addr;
+    ch->read_addr = read_addr;
+    ch->count = transfer_count;
+    if (trigger) dma_start(1u << channel);
+}
+
+void dma_start_channel_mask(uint32_t chan_mask) {
+    dma_start(chan_mask);
+}
+
+bool dma_channel_is_busy(uint channel) {
+    dma_update();
+    return dma_channels[channel].busy;
+}
+
+// The channel does not need an interrupt to finish: time passes even in a
+// handler
+void dma_channel_wait_for_finish_blocking(uint channel) {
+    dma_update();
+    const dma_channel_t *ch = &dma_channels[channel];
+    if (ch->busy) advance(ch->done_ns - now_ns);
+}
+
+// Aborting can raise the channel's interrupt (RP2040-E13)
+void dma_channel_abort(uint channel) {
+    dma_update();
+    dma_channel_t *ch = &dma_channels[channel];
+    if (ch->busy) {
+        ch->busy = false;
+        dma_intr |= 1u << channel;
+    }
+}
+
+void dma_channel_set_irq0_enabled(uint channel, bool enabled) {
+    dma_inte[0] = enabled ? dma_inte[0] | 1u << channel : dma_inte[0] & ~(1u << channel);
+}
+
+void dma_channel_set_irq1_enabled(uint channel, bool enabled) {
+    dma_inte[1] = enabled ? dma_inte[1] | 1u << channel : dma_inte[1] & ~(1u << channel);
+}
+
+bool dma_channel_get_irq0_status(uint channel) {
+    dma_update();
+    return dma_intr & dma_inte[0] & 1u << channel;
+}
+
+bool dma_channel_get_irq1_status(uint channel) {
+    dma_update();
+    return dma_intr & dma_inte[1] & 1u << channel;
+}
+
+void dma_channel_acknowledge_irq0(uint channel) {
+    dma_update();
+    dma_intr &= ~(1u << channel);
+}
+
+void dma_channel_acknowledge_irq1(uint channel) {
+    dma_update();
+    dma_intr &= ~(1u << channel);
+}
+
+void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable) {
+    dma_update();
+    if (mode != DMA_SNIFF_CTRL_CALC_VALUE_CRC16) fatal("unmodelled DMA sniffer mode");
+    sniffer.enabled = true;
+    sniffer.channel = channel;
+    if (force_channel_enable) dma_channels[channel].ctrl |= DMA_CH0_CTRL_TRIG_SNIFF_EN_BITS;
+}
+
+void dma_sniffer_disable(void) {
+    dma_update();
+    sniffer.enabled = false;
+}
+
+void dma_sniffer_set_data_accumulator(uint32_t seed_value) {
+    dma_update();
+    sniffer.accumulator = seed_value;
+}
+
+uint32_t dma_sniffer_get_data_accumulator(void) {
+    dma_update();
+    return sniffer.accumulator;
+}
+
+/* Interrupts */
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler) {
+    if (num != DMA_IRQ_0 && num != DMA_IRQ_1) fatal("unmodelled IRQ");
+    irq_t *irq = &dma_irqs[num - DMA_IRQ_0];
+    if (irq->handler_count && (irq->handler_count > 1 || irq->handlers[0] != handler))
+        fatal("exclusive IRQ handler replaces another");
+    irq->handlers[0] = handler;
+    irq->handler_count = 1;
+}
+
+void irq_add_shared_handler(uint num, irq_handler_t handler, uint8_t order_priority) {
+    (void)order_priority;
+    if (num != DMA_IRQ_0 && num != DMA_IRQ_1) fatal("unmodelled IRQ");
+    irq_t *irq = &dma_irqs[num - DMA_IRQ_0];
+    if (irq->handler_count == MAX_IRQ_HANDLERS) fatal("too many shared IRQ handlers");
+    irq->handlers[irq->handler_count++] = handler;
+}
+
+void irq_set_enabled(uint num, bool enabled) {
+    if (num != DMA_IRQ_0 && num != DMA_IRQ_1) fatal("unmodelled IRQ");
+    dma_irqs[num - DMA_IRQ_0].enabled = enabled;
+}
+
+// Runs the handlers of one pending DMA interrupt, showing them its channel
+// in INTSn, which they must clear. Returns false if none is pending.
+static bool dma_irq(void) {
+    for (uint line = 0; line < 2; line++) {
+        uint32_t pending = dma_intr & dma_inte[line];
+        if (!dma_irqs[line].enabled || !pending) continue;
+        uint32_t bit = pending & -pending;
+        io_rw_32 *ints = line ? &emu_dma_hw.ints1 : &emu_dma_hw.ints0;
+        exception = 16 + DMA_IRQ_0 + line;
+        for (size_t i = 0; i < dma_irqs[line].handler_count && dma_intr & bit; i++) {
+            *ints = bit | NOT_WRITTEN;
+            dma_irqs[line].handlers[i]();
+            if (!(*ints & NOT_WRITTEN)) dma_intr &= ~*ints;  // Write 1 to clear
+        }
+        exception = 0;
+        if (dma_intr & bit) fatal("DMA interrupt left pending by its handlers");
+        return true;
+    }
+    return false;
+}
+
+// Runs the handlers of the interrupts that are due
+static void dispatch(void) {
+    if (interrupts_disabled || exception) return;
+    for (;;) {
+        dma_update();
+        if (dma_irq()) {
+            event_flag = true;
+            continue;
+        }
+        event_t *next = next_event();
+        if (!next || next->when_ns > now_ns) break;
+        event_t event = *next;
+        next->used = false;
+        exception = TIMER_EXCEPTION;
+        int64_t delay_us = event.callback(event.id, event.user_data);
+        if (delay_us) {
+            // As the SDK: positive from when it was due, negative from now
+            uint64_t when_ns = delay_us > 0 ? event.when_ns + delay_us * 1000
+                                             : now_ns - delay_us * 1000;
+            event_t *again = add_event(when_ns < now_ns ? now_ns : when_ns);
+            if (!again) fatal("no event slot to reschedule an alarm");
+            again->id = event.id;
+            again->callback = event.callback;
+            again->user_data = event.user_data;
+        }
+        exception = 0;
+        event_flag = true;
+    }
+}
+
+// Sleeps until the next interrupt, or until limit_ns
+static void wait_for_interrupt_until(uint64_t limit_ns) {
+    if (exception || interrupts_disabled) fatal("waiting with interrupts masked");
+    dma_update();
+    uint64_t next_ns = UINT64_MAX;
+    event_t *next = next_event();
+    if (next) next_ns = next->when_ns;
+    for (uint i = 0; i < NUM_DMA_CHANNELS; i++)
+        if (dma_channels[i].busy && dma_channels[i].done_ns < next_ns)
+            next_ns = dma_channels[i].done_ns;
+    if (next_ns == UINT64_MAX && limit_ns == UINT64_MAX)
+        now_ns += 1000;  // Nothing pending: let timeouts expire
+    else if (next_ns > now_ns)
+        now_ns = next_ns < limit_ns ? next_ns : limit_ns;
+    dispatch();
+}
+
+static void wait_for_interrupt(void) {
+    wait_for_interrupt_until(UINT64_MAX);
+}
+
+/* Time and alarms */
+
+uint64_t time_us_64(void) {
+    return now_ns / 1000;
+}
+
+absolute_time_t get_absolute_time(void) {
+    return now_ns / 1000;
+}
+
+absolute_time_t make_timeout_time_ms(uint32_t ms) {
+    return now_ns / 1000 + (uint64_t)ms * 1000;
+}
+
+int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) {
+    return (int64_t)(to - from);
+}
+
+void busy_wait_us(uint64_t delay_us) {
+    advance(delay_us * 1000);
+}
+
+alarm_id_t add_alarm_in_us(uint64_t us, alarm_callback_t callback, void *user_data,
+                           bool fire_if_past) {
+    (void)fire_if_past;
+    event_t *event = add_event(now_ns + us * 1000);
+    if (!event) return -1;
+    event->id = next_alarm_id++;
+    event->callback = callback;
+    event->user_data = user_data;
+    return event->id;
+}
+
+bool cancel_alarm(alarm_id_t alarm_id) {
+    for (size_t i = 0; i < MAX_EVENTS; i++) {
+        if (events[i].used && events[i].id == alarm_id) {
+            events[i].used = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Cores, interrupts and locks */
+
+uint get_core_num(void) {
+    return 0;
+}
+
+uint __get_current_exception(void) {
+    return exception;
+}
+
+void tight_loop_contents(void) {
+    advance(TIGHT_LOOP_NS);
+}
+
+void __sev(void) {
+    event_flag = true;
+}
+
+void __wfe(void) {
+    if (!event_flag) wait_for_interrupt();
+    event_flag = false;
+}
+
+uint32_t save_and_disable_interrupts(void) {
+    uint32_t status = interrupts_disabled;
+    interrupts_disabled = true;
+    return status;
+}
+
+void restore_interrupts(uint32_t status) {
+    interrupts_disabled = status;
+    dispatch();
+}
+
+uint32_t hw_claim_lock(void) {
+    return save_and_disable_interrupts();
+}
+
+void hw_claim_unlock(uint32_t token) {
+    restore_interrupts(token);
+}
+
+void mutex_init(mutex_t *mtx) {
+    mtx->initialized = true;
+    mtx->owned = false;
+}
+
+bool mutex_is_initialized(mutex_t *mtx) {
+    return mtx->initialized;
+}
+
+void mutex_enter_blocking(mutex_t *mtx) {
+    // Only an interrupt handler can release it now
+    while (mtx->owned) wait_for_interrupt();
+    mtx->owned = true;
+}
+
+void mutex_exit(mutex_t *mtx) {
+    mtx->owned = false;
+}
+
+void sem_init(semaphore_t *sem, int16_t initial_permits, int16_t max_permits) {
+    sem->permits = initial_permits;
+    sem->max_permits = max_permits;
+}
+
+int sem_available(semaphore_t *sem) {
+    return sem->permits;
+}
+
+bool sem_release(semaphore_t *sem) {
+    if (sem->permits >= sem->max_permits) return false;
+    sem->permits++;
+    __sev();
+    return true;
+}
+
+void sem_reset(semaphore_t *sem, int16_t permits) {
+    sem->permits = permits;
+}
+
+bool sem_try_acquire(semaphore_t *sem) {
+    if (sem->permits <= 0) return false;
+    sem->permits--;
+    return true;
+}
+
+bool sem_acquire_timeout_ms(semaphore_t *sem, uint32_t timeout_ms) {
+    const uint64_t deadline_ns = now_ns + (uint64_t)timeout_ms * 1000000;
+    while (sem->permits <= 0) {
+        if (now_ns >= deadline_ns) return false;
+        wait_for_interrupt_until(deadline_ns);
+    }
+    sem->permits--;
+    return true;
+}
+
+/* GPIO: chip selects */
+
+void emu_attach_card(sd_emu_card_t *card) {
+    if (card_count == MAX_CARDS || card->cs_gpio >= NUM_GPIOS) fatal("cannot attach card");
+    cards[card_count++] = card;
+    gpio_level[card->cs_gpio] = true;
+}
+
+void gpio_put(uint gpio, bool value) {
+    if (gpio >= NUM_GPIOS || gpio_level[gpio] == value) return;
+    gpio_level[gpio] = value;
+    for (size_t i = 0; i < card_count; i++)
+        if (cards[i]->cs_gpio == gpio) sd_emu_card_select(cards[i], !value, now_ns);
+}
+
+bool gpio_get(uint gpio) {
+    return gpio < NUM_GPIOS && gpio_level[gpio];
+}
+
+void gpio_init(uint gpio) {
+    (void)gpio;
+}
+
+void gpio_set_dir(uint gpio, bool out) {
+    (void)gpio;
+    (void)out;
+}
+
+void gpio_pull_up(uint gpio) {
+    (void)gpio;
+}
+
+void gpio_set_function(uint gpio, enum gpio_function fn) {
+    (void)gpio;
+    (void)fn;
+}
+
+void gpio_set_drive_strength(uint gpio, enum gpio_drive_strength drive) {
+    (void)gpio;
+    (void)drive;
+}
+
+/* SPI bus */
+
+// The PL022 prescaler and post-divider search of the SDK, from clk_peri
+uint spi_set_baudrate(spi_inst_t *spi, uint baudrate) {
+    uint prescale, postdiv;
+    for (prescale = 2; prescale <= 254; prescale += 2) {
+        if (CLK_PERI_HZ < (prescale + 2) * 256 * (uint64_t)baudrate) break;
+    }
+    for (postdiv = 256; postdiv > 1; --postdiv) {
+        if (CLK_PERI_HZ / (prescale * (postdiv - 1)) > baudrate) break;
+    }
+    spi->baud_rate = CLK_PERI_HZ / (prescale * postdiv);
+    return spi->baud_rate;
+}
+
+uint spi_init(spi_inst_t *spi, uint baudrate) {
+    return spi_set_baudrate(spi, baudrate);
+}
+
+uint spi_get_baudrate(const spi_inst_t *spi) {
+    return spi->baud_rate;
+}
+
+void spi_set_format(spi_inst_t *spi, uint data_bits, spi_cpol_t cpol, spi_cpha_t cpha,
+                    spi_order_t order) {
+    if (data_bits != 8 || cpol != SPI_CPOL_0 || cpha != SPI_CPHA_0 || order != SPI_MSB_FIRST)
+        fatal("SPI format is not SD mode 0");
+    (void)spi;
+}
+
+bool spi_is_busy(const spi_inst_t *spi) {
+    (void)spi;
+    return false;
+}
+
+bool spi_is_readable(const spi_inst_t *spi) {
+    (void)spi;
+    return false;
+}
+
+// Clocks length bytes from t_ns on, to and from whichever card on the bus is
+// selected; DO floats high (pulled up) otherwise. A stride of 0 repeats the
+// first byte of tx, or keeps only the last one in rx. Returns when the last
+// byte is done.
+static uint64_t bus_transfer(spi_inst_t *spi, const volatile uint8_t *tx, size_t tx_stride,
+                             volatile uint8_t *rx, size_t rx_stride, size_t length,
+                             uint64_t t_ns) {
+    const uint64_t byte_ns = 8000000000ull / spi->baud_rate;
+    for (size_t i = 0; i < length; i++) {
+        t_ns += byte_ns;
+        uint8_t out = tx[i * tx_stride];
+        uint8_t in = 0xFF;
+        for (size_t j = 0; j < card_count; j++)
+            if (cards[j]->spi == spi && !gpio_level[cards[j]->cs_gpio])
+                in &= sd_emu_card_exchange(cards[j], out, t_ns, spi->baud_rate);
+        if (rx) rx[i * rx_stride] = in;
+    }
+    return t_ns;
+}
+
+// The blocking transfers are timed straight on the clock, also in handlers
+int spi_write_read_blocking(spi_inst_t *spi, const uint8_t *src, uint8_t *dst, size_t len) {
+    now_ns = bus_transfer(spi, src, 1, dst, 1, len, now_ns);
+    dispatch();
+    return (int)len;
+}
+
+int spi_write_blocking(spi_inst_t *spi, const uint8_t *src, size_t len) {
+    now_ns = bus_transfer(spi, src, 1, NULL, 0, len, now_ns);
+    dispatch();
+    return (int)len;
+}
+
+int spi_read_blocking(spi_inst_t *spi, uint8_t repeated_tx_data, uint8_t *dst, size_t len) {
+    now_ns = bus_transfer(spi, &repeated_tx_data, 0, dst, 1, len, now_ns);
+    dispatch();
+    return (int)len;
+}
@@ -0,0 +1,7 @@
+// Host stand-in for the Pico SDK header of the same name
+#pragma once
+
+#include "pico/types.h"
+
+uint32_t hw_claim_lock(void);
+void hw_claim_unlock(uint32_t token);
@@ -0,0 +1,97 @@
+// Host stand-in for the Pico SDK header of the same name: the DMA channels
+// spi.c drives, and the sniffer. A channel paced by an SPI moves its bytes
+// as the emulated bus clocks them; any other channel copies memory at once.
+// The sniffer sees a byte when it goes by, not when the channel is started.
+#pragma once
+
+#include "pico/types.h"
+
+enum dma_channel_transfer_size { DMA_SIZE_8 = 0, DMA_SIZE_16 = 1, DMA_SIZE_32 = 2 };
+
+#define DREQ_SPI0_TX 16
+#define DREQ_SPI0_RX 17
+#define DREQ_SPI1_TX 18
+#define DREQ_SPI1_RX 19
+#define DREQ_FORCE 0x3f
+
+#define DMA_SNIFF_CTRL_CALC_VALUE_CRC16 0x2  // CRC-16-CCITT, the only one modelled
+
+// CTRL register fields, as on the RP2040
+#define DMA_CH0_CTRL_TRIG_EN_BITS 0x00000001u
+#define DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB 2
+#define DMA_CH0_CTRL_TRIG_DATA_SIZE_BITS 0x0000000cu
+#define DMA_CH0_CTRL_TRIG_INCR_READ_BITS 0x00000010u
+#define DMA_CH0_CTRL_TRIG_INCR_WRITE_BITS 0x00000020u
+#define DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB 11
+#define DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB 15
+#define DMA_CH0_CTRL_TRIG_TREQ_SEL_BITS 0x001f8000u
+#define DMA_CH0_CTRL_TRIG_SNIFF_EN_BITS 0x00800000u
+
+typedef struct {
+    uint32_t ctrl;
+} dma_channel_config;
+
+// Only the masked interrupt status registers, which are valid inside a DMA
+// IRQ handler: they show one channel at a time, and writing a channel's bit
+// clears it.
+typedef struct {
+    io_rw_32 ints0;
+    io_rw_32 ints1;
+} dma_hw_t;
+
+extern dma_hw_t emu_dma_hw;
+#define dma_hw (&emu_dma_hw)
+
+static inline void channel_config_set_read_increment(dma_channel_config *c, bool incr) {
+    c->ctrl = incr ? c->ctrl | DMA_CH0_CTRL_TRIG_INCR_READ_BITS
+                   : c->ctrl & ~DMA_CH0_CTRL_TRIG_INCR_READ_BITS;
+}
+
+static inline void channel_config_set_write_increment(dma_channel_config *c, bool incr) {
+    c->ctrl = incr ? c->ctrl | DMA_CH0_CTRL_TRIG_INCR_WRITE_BITS
+                   : c->ctrl & ~DMA_CH0_CTRL_TRIG_INCR_WRITE_BITS;
+}
+
+static inline void channel_config_set_dreq(dma_channel_config *c, uint dreq) {
+    c->ctrl = (c->ctrl & ~DMA_CH0_CTRL_TRIG_TREQ_SEL_BITS) |
+              (dreq << DMA_CH0_CTRL_TRIG_TREQ_SEL_LSB);
+}
+
+static inline void channel_config_set_transfer_data_size(dma_channel_config *c,
+                                                         enum dma_channel_transfer_size size) {
+    c->ctrl = (c->ctrl & ~DMA_CH0_CTRL_TRIG_DATA_SIZE_BITS) |
+              ((uint)size << DMA_CH0_CTRL_TRIG_DATA_SIZE_LSB);
+}
+
+static inline void channel_config_set_sniff_enable(dma_channel_config *c, bool sniff_enable) {
+    c->ctrl = sniff_enable ? c->ctrl | DMA_CH0_CTRL_TRIG_SNIFF_EN_BITS
+                           : c->ctrl & ~DMA_CH0_CTRL_TRIG_SNIFF_EN_BITS;
+}
+
+static inline dma_channel_config dma_channel_get_default_config(uint channel) {
+    dma_channel_config c = {.ctrl = DMA_CH0_CTRL_TRIG_EN_BITS |
+                                    channel << DMA_CH0_CTRL_TRIG_CHAIN_TO_LSB};
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_dreq(&c, DREQ_FORCE);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    return c;
+}
+
+int dma_claim_unused_channel(bool required);
+void dma_channel_configure(uint channel, const dma_channel_config *config,
+                           volatile void *write_addr, const volatile void *read_addr,
+                           uint transfer_count, bool trigger);
+void dma_start_channel_mask(uint32_t chan_mask);
+bool dma_channel_is_busy(uint channel);
+void dma_channel_wait_for_finish_blocking(uint channel);
+void dma_channel_abort(uint channel);
+void dma_channel_set_irq0_enabled(uint channel, bool enabled);
+void dma_channel_set_irq1_enabled(uint channel, bool enabled);
+bool dma_channel_get_irq0_status(uint channel);
+bool dma_channel_get_irq1_status(uint channel);
+void dma_channel_acknowledge_irq0(uint channel);
+void dma_channel_acknowledge_irq1(uint channel);
+void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable);
+void dma_sniffer_disable(void);
+void dma_sniffer_set_data_accumulator(uint32_t seed_value);
+uint32_t dma_sniffer_get_data_accumulator(void);
@@ -0,0 +1,24 @@
+// Host stand-in for the Pico SDK header of the same name. Chip selects of
+// the emulated cards are watched; other pins only keep their level.
+#pragma once
+
+#include "pico/types.h"
+
+enum gpio_drive_strength {
+    GPIO_DRIVE_STRENGTH_2MA = 0,
+    GPIO_DRIVE_STRENGTH_4MA = 1,
+    GPIO_DRIVE_STRENGTH_8MA = 2,
+    GPIO_DRIVE_STRENGTH_12MA = 3
+};
+enum gpio_function { GPIO_FUNC_SPI = 1, GPIO_FUNC_SIO = 5 };
+
+#define GPIO_OUT 1
+#define GPIO_IN 0
+
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_put(uint gpio, bool value);
+bool gpio_get(uint gpio);
+void gpio_pull_up(uint gpio);
+void gpio_set_function(uint gpio, enum gpio_function fn);
+void gpio_set_drive_strength(uint gpio, enum gpio_drive_strength drive);
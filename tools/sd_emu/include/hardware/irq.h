@@ -0,0 +1,15 @@
+// Host stand-in for the Pico SDK header of the same name: the DMA IRQ lines.
+// Their handlers run as the virtual clock passes a DMA completion.
+#pragma once
+
+#include "pico/types.h"
+
+typedef void (*irq_handler_t)(void);
+
+enum { DMA_IRQ_0 = 11, DMA_IRQ_1 = 12 };
+
+#define PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY 0x80
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler);
+void irq_add_shared_handler(uint num, irq_handler_t handler, uint8_t order_priority);
+void irq_set_enabled(uint num, bool enabled);
@@ -0,0 +1,39 @@
+// Host stand-in for the Pico SDK header of the same name: an SPI instance
+// keeps its clock rate, which sets how long every byte takes on the emulated
+// bus. Bytes cross it whole, so the FIFOs are always drained.
+#pragma once
+
+#include "pico/types.h"
+
+typedef enum { SPI_CPHA_0 = 0, SPI_CPHA_1 = 1 } spi_cpha_t;
+typedef enum { SPI_CPOL_0 = 0, SPI_CPOL_1 = 1 } spi_cpol_t;
+typedef enum { SPI_LSB_FIRST = 0, SPI_MSB_FIRST = 1 } spi_order_t;
+
+typedef struct spi_inst {
+    io_rw_32 dr;     // Only the DMA address; never read or written
+    uint baud_rate;  // Actual rate, as the PL022 dividers give it
+} spi_inst_t;
+typedef spi_inst_t spi_hw_t;
+
+extern spi_inst_t emu_spi_inst[2];
+#define spi0 (&emu_spi_inst[0])
+#define spi1 (&emu_spi_inst[1])
+
+static inline spi_hw_t *spi_get_hw(spi_inst_t *spi) {
+    return spi;
+}
+
+static inline uint spi_get_index(const spi_inst_t *spi) {
+    return spi == spi1;
+}
+
+uint spi_init(spi_inst_t *spi, uint baudrate);
+uint spi_set_baudrate(spi_inst_t *spi, uint baudrate);
+uint spi_get_baudrate(const spi_inst_t *spi);
+void spi_set_format(spi_inst_t *spi, uint data_bits, spi_cpol_t cpol, spi_cpha_t cpha,
+                    spi_order_t order);
+bool spi_is_busy(const spi_inst_t *spi);
+bool spi_is_readable(const spi_inst_t *spi);
+int spi_write_read_blocking(spi_inst_t *spi, const uint8_t *src, uint8_t *dst, size_t len);
+int spi_write_blocking(spi_inst_t *spi, const uint8_t *src, size_t len);
+int spi_read_blocking(spi_inst_t *spi, uint8_t repeated_tx_data, uint8_t *dst, size_t len);
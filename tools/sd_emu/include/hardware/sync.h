@@ -0,0 +1,10 @@
+// Host stand-in for the Pico SDK header of the same name. __wfe lets virtual
+// time pass up to the next interrupt, unless __sev came first.
+#pragma once
+
+#include "pico/types.h"
+
+void __wfe(void);
+void __sev(void);
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t status);
@@ -0,0 +1,7 @@
+// Host stand-in for the Pico SDK header of the same name
+#pragma once
+
+#include "pico/types.h"
+
+uint64_t time_us_64(void);
+void busy_wait_us(uint64_t delay_us);
@@ -0,0 +1,19 @@
+// Host stand-in for the Pico SDK header of the same name. There is a single
+// core: waiting for a mutex lets virtual time pass until an interrupt
+// handler releases it.
+#pragma once
+
+#include "pico/platform.h"
+#include "pico/time.h"
+
+typedef struct {
+    bool initialized;
+    bool owned;
+} mutex_t;
+
+#define auto_init_mutex(name) static mutex_t name = {.initialized = true}
+
+void mutex_init(mutex_t *mtx);
+bool mutex_is_initialized(mutex_t *mtx);
+void mutex_enter_blocking(mutex_t *mtx);
+void mutex_exit(mutex_t *mtx);
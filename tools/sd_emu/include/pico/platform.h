@@ -0,0 +1,9 @@
+// Host stand-in for the Pico SDK header of the same name
+#pragma once
+
+#include "pico/types.h"
+
+uint get_core_num(void);
+void tight_loop_contents(void);  // Lets a little virtual time pass
+// The exception number of the running interrupt handler, 0 outside them
+uint __get_current_exception(void);
@@ -0,0 +1,17 @@
+// Host stand-in for the Pico SDK header of the same name. Waiting for a
+// permit lets virtual time pass until an interrupt handler releases one.
+#pragma once
+
+#include "pico/types.h"
+
+typedef struct {
+    int16_t permits;
+    int16_t max_permits;
+} semaphore_t;
+
+void sem_init(semaphore_t *sem, int16_t initial_permits, int16_t max_permits);
+int sem_available(semaphore_t *sem);
+bool sem_release(semaphore_t *sem);
+void sem_reset(semaphore_t *sem, int16_t permits);
+bool sem_try_acquire(semaphore_t *sem);
+bool sem_acquire_timeout_ms(semaphore_t *sem, uint32_t timeout_ms);
@@ -0,0 +1,7 @@
+// Host stand-in for the Pico SDK header of the same name
+#pragma once
+
+#include "hardware/gpio.h"
+#include "pico/platform.h"
+#include "pico/time.h"
+#include "pico/types.h"
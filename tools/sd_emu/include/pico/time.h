@@ -0,0 +1,15 @@
+// Host stand-in for the Pico SDK header of the same name: time is the
+// emulator's virtual clock, and alarms fire as it passes them.
+#pragma once
+
+#include "pico/types.h"
+
+typedef int32_t alarm_id_t;
+typedef int64_t (*alarm_callback_t)(alarm_id_t id, void *user_data);
+
+absolute_time_t get_absolute_time(void);
+absolute_time_t make_timeout_time_ms(uint32_t ms);
+int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to);
+alarm_id_t add_alarm_in_us(uint64_t us, alarm_callback_t callback, void *user_data,
+                           bool fire_if_past);
+bool cancel_alarm(alarm_id_t alarm_id);
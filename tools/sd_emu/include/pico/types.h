@@ -0,0 +1,14 @@
+// Host stand-in for the Pico SDK header of the same name, declaring only what
+// the SD driver uses. Implemented in tools/sd_emu/host.c.
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;  // Microseconds of virtual time
+typedef volatile uint32_t io_rw_32;
+
+#define __not_in_flash_func(func_name) func_name
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
@@ -0,0 +1,486 @@
+// Benchmarks the SD driver on the host against an emulated card. The driver
+// (lib/FatFs_SPI: sd_card.c, sd_spi.c, spi.c, crc.c, sd_latency.c, sd_raid.c
+// and glue.c), FatFs and the logger's log_writer.c run unmodified, on host
+// stand-ins for the Pico SDK (include/, host.c: DMA, its IRQs and sniffer
+// included) and a model of an SDHC card in SPI mode (card.c) backed by an
+// image file.
+// Everything is timed on a virtual clock, from the SPI clock rate and the
+// card's timing model, so runs are repeatable: compare driver changes with
+// it rather than take the figures for those of a particular card.
+//
+// Build on the host from the repository root, with any of the driver's or
+// the log writer's options as -D flags (e.g. -DSD_WRITE_STREAMING=0):
+//   cc -O2 -Itools/sd_emu/include -Itools/sd_emu -Ilib -Ilib/FatFs_SPI/include -Ilib/FatFs_SPI/sd_driver -Ilib/FatFs_SPI/ff15/source -o sd_emu tools/sd_emu/*.c lib/FatFs_SPI/sd_driver/{sd_card,sd_spi,spi,crc,sd_latency,sd_raid}.c lib/FatFs_SPI/src/glue.c lib/FatFs_SPI/ff15/source/{ff,ffsystem,ffunicode}.c lib/log_writer.c lib/record_format.c -lm
+// Usage (the image is created if missing, and reformatted on every run):
+//   ./sd_emu [options] card.img
+// The exit status is 1 if data read back differs from what was written or
+// the card saw a bad CRC or a protocol error after initialization, 2 on a
+// setup error.
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hardware/timer.h"
+
+#include "ff.h"
+//
+#include "diskio.h"
+#include "disk_stats.h"
+#include "hw_config.h"
+#include "log_writer.h"
+#include "record_format.h"
+#include "sd_card.h"
+#include "sd_emu.h"
+#include "sd_raid.h"
+
+#define RAW_CHUNK_SECTORS 64
+#define RANDOM_WRITES 1000
+#define READ_CHUNK_SIZE (32 * 1024)
+
+/* Hardware configuration: as hw_config.c, chosen at run time */
+
+static spi_t spi_controllers[] = {
+    {.hw_inst = spi0, .miso_gpio = 16, .mosi_gpio = 19, .sck_gpio = 18, .baud_rate = 1000 * 1000},
+    {.hw_inst = spi1, .miso_gpio = 28, .mosi_gpio = 27, .sck_gpio = 26, .baud_rate = 1000 * 1000},
+};
+
+static sd_card_t single_card = {
+    .pcName = "0:", .spi = &spi_controllers[0], .ss_gpio = 17, .card_detected_true = -1};
+
+static sd_card_t raid_members[] = {
+    {.pcName = "0:a", .spi = &spi_controllers[0], .ss_gpio = 17, .card_detected_true = -1},
+    {.pcName = "0:b", .spi = &spi_controllers[1], .ss_gpio = 20, .card_detected_true = -1},
+};
+static sd_raid_t raid = {
+    .member_count = count_of(raid_members),
+    .members = {&raid_members[0], &raid_members[1]},
+};
+static sd_card_t raid_device = {.pcName = "0:", .raid = &raid};
+
+static sd_card_t *storage_device = &single_card;
+
+size_t sd_get_num() { return 1; }
+sd_card_t *sd_get_by_num(size_t num) { return num ? NULL : storage_device; }
+size_t spi_get_num() { return count_of(spi_controllers); }
+spi_t *spi_get_by_num(size_t num) {
+    return num < count_of(spi_controllers) ? &spi_controllers[num] : NULL;
+}
+
+static bool verbose;
+
+void my_printf(const char *pcFormat, ...) {
+    if (!verbose) return;
+    va_list args;
+    va_start(args, pcFormat);
+    vprintf(pcFormat, args);
+    va_end(args);
+}
+
+void my_assert_func(const char *file, int line, const char *func, const char *pred) {
+    fprintf(stderr, "assertion \"%s\" failed: file \"%s\", line %d, function: %s\n", pred, file,
+            line, func);
+    exit(2);
+}
+
+DWORD get_fattime(void) {
+    return (DWORD)(2026 - 1980) << 25 | 10 << 21 | 16 << 16;
+}
+
+/* Measurements */
+
+static sd_emu_card_t cards[2];
+static size_t card_count = 1;
+
+typedef struct {
+    uint64_t start_ns;
+    sd_emu_stats_t stats[2];
+} mark_t;
+
+static mark_t mark(void) {
+    mark_t m = {.start_ns = emu_now_ns()};
+    for (size_t i = 0; i < card_count; i++) m.stats[i] = cards[i].stats;
+    return m;
+}
+
+static uint32_t command_count(const sd_emu_stats_t *stats) {
+    uint32_t count = 0;
+    for (int i = 0; i < 64; i++) count += stats->commands[i] + stats->app_commands[i];
+    return count;
+}
+
+// One line per benchmark: throughput, time per operation, and what went over
+// the bus besides the data itself, per sector
+static void report(const char *name, uint64_t bytes, uint32_t operations, const mark_t *since) {
+    double us = (emu_now_ns() - since->start_ns) / 1e3;
+    uint32_t commands = 0;
+    uint64_t overhead = 0, busy = 0;
+    for (size_t i = 0; i < card_count; i++) {
+        const sd_emu_stats_t *now = &cards[i].stats, *then = &since->stats[i];
+        commands += command_count(now) - command_count(then);
+        overhead += (now->bus_bytes - then->bus_bytes) - (now->data_bytes - then->data_bytes);
+        busy += now->busy_bytes - then->busy_bytes;
+    }
+    uint64_t sectors = bytes / SD_EMU_BLOCK_SIZE;
+    printf("%-22s %8.2f MB/s %9.1f us/op %8lu cmds %7.1f bus/sector (%.1f busy)\n", name,
+           bytes / us, us / operations, (unsigned long)commands,
+           sectors ? (double)overhead / sectors : 0.0, sectors ? (double)busy / sectors : 0.0);
+}
+
+static void fill_sector(uint8_t *data, uint64_t sector, uint32_t round) {
+    uint32_t x = (uint32_t)sector * 2654435761u ^ round;
+    for (size_t i = 0; i < SD_EMU_BLOCK_SIZE; i += 4) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        memcpy(data + i, &x, 4);
+    }
+}
+
+static bool check_sectors(const uint8_t *data, uint64_t sector, uint32_t count, uint32_t round) {
+    uint8_t expected[SD_EMU_BLOCK_SIZE];
+    for (uint32_t i = 0; i < count; i++) {
+        fill_sector(expected, sector + i, round);
+        if (memcmp(data + i * SD_EMU_BLOCK_SIZE, expected, SD_EMU_BLOCK_SIZE)) {
+            printf("Sector %lu differs\n", (unsigned long)(sector + i));
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Benchmarks */
+
+// Sequential writes, blocking and then asynchronous, two chunks in flight,
+// and reads through the driver, then scattered single sector writes, each
+// committed on its own as FatFs does for its tables
+static bool raw_benchmarks(sd_card_t *sd, uint64_t sectors) {
+    static uint8_t buffers[2][RAW_CHUNK_SECTORS * SD_EMU_BLOCK_SIZE];
+    uint8_t *buffer = buffers[0];
+    bool ok = true;
+    sectors -= sectors % (2 * RAW_CHUNK_SECTORS);
+
+    mark_t start = mark();
+    int status = SD_BLOCK_DEVICE_ERROR_NONE;
+    for (uint64_t s = 0; s < sectors && !status; s += RAW_CHUNK_SECTORS) {
+        for (uint32_t i = 0; i < RAW_CHUNK_SECTORS; i++)
+            fill_sector(buffer + i * SD_EMU_BLOCK_SIZE, s + i, 1);
+        status = sd->write_blocks(sd, buffer, s, RAW_CHUNK_SECTORS);
+    }
+    if (!status) status = sd_write_session_close(sd);
+    report("sequential write", sectors * SD_EMU_BLOCK_SIZE, sectors / RAW_CHUNK_SECTORS, &start);
+
+    start = mark();
+    for (uint64_t s = 0; s < sectors && !status; s += 2 * RAW_CHUNK_SECTORS) {
+        for (uint32_t b = 0; b < 2 && !status; b++) {
+            uint64_t first = s + b * RAW_CHUNK_SECTORS;
+            for (uint32_t i = 0; i < RAW_CHUNK_SECTORS; i++)
+                fill_sector(buffers[b] + i * SD_EMU_BLOCK_SIZE, first + i, 1);
+            status = sd_write_blocks_async(sd, buffers[b], first, RAW_CHUNK_SECTORS, NULL, NULL);
+        }
+        int wait_status = sd_write_async_wait(sd);
+        if (!status) status = wait_status;
+    }
+    if (!status) status = sd_write_session_close(sd);
+    report("sequential async write", sectors * SD_EMU_BLOCK_SIZE, sectors / RAW_CHUNK_SECTORS,
+           &start);
+
+    start = mark();
+    for (uint64_t s = 0; s < sectors && !status; s += RAW_CHUNK_SECTORS) {
+        status = sd->read_blocks(sd, buffer, s, RAW_CHUNK_SECTORS);
+        ok = ok && check_sectors(buffer, s, RAW_CHUNK_SECTORS, 1);
+    }
+    report("sequential read", sectors * SD_EMU_BLOCK_SIZE, sectors / RAW_CHUNK_SECTORS, &start);
+
+    // Distinct sectors all over the region: the stride is odd, the region
+    // a multiple of RAW_CHUNK_SECTORS
+    uint32_t writes = sectors < RANDOM_WRITES ? sectors : RANDOM_WRITES;
+    const uint64_t stride = sectors / writes | 1;
+    start = mark();
+    for (uint32_t i = 0; i < writes && !status; i++) {
+        uint64_t s = i * stride % sectors;
+        fill_sector(buffer, s, 2);
+        status = sd->write_blocks(sd, buffer, s, 1);
+        if (!status) status = sd_write_session_close(sd);
+    }
+    report("random 1-sector write", (uint64_t)writes * SD_EMU_BLOCK_SIZE, writes, &start);
+    for (uint32_t i = 0; i < writes && !status; i++) {
+        uint64_t s = i * stride % sectors;
+        status = sd->read_blocks(sd, buffer, s, 1);
+        ok = ok && check_sectors(buffer, s, 1, 2);
+    }
+    if (status) printf("Driver error %d\n", status);
+    return ok && !status;
+}
+
+static void make_sample(sensor_sample_t *sample, uint32_t sequence, uint32_t interval_us) {
+    sample->sequence = sequence;
+    sample->time_us = (uint64_t)sequence * (interval_us ? interval_us : 1000);
+    for (int axis = 0; axis < 3; axis++) {
+        sample->motion[axis] = (int16_t)(sequence * (7 + axis) % 4096 - 2048);
+        sample->rotation[axis] = (int16_t)(sequence * (13 + axis) % 65536 - 32768);
+    }
+    sample->heat = (int16_t)(sequence % 1000);
+}
+
+// A recording as the logger makes it, one CSV line per sample through the
+// log writer, every interval_us if not 0 and as fast as it goes otherwise;
+// then the file is read back and compared.
+static bool log_benchmark(uint64_t bytes, uint32_t interval_us) {
+    static FIL file;
+    static log_writer_t writer;
+    char line[RECORD_CSV_MAX_LENGTH];
+    sensor_sample_t sample;
+
+    if (f_open(&file, "0:/bench.csv", FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
+        printf("Cannot create the log file\n");
+        return false;
+    }
+    disk_stats_reset();
+    mark_t start = mark();
+    log_writer_init(&writer, &file);
+    FRESULT result = FR_OK;
+#if LOG_PREALLOCATE_MB > 0
+    result = log_writer_preallocate(&writer, (FSIZE_t)LOG_PREALLOCATE_MB * 1024 * 1024);
+    if (result == FR_DENIED) result = FR_OK;  // Grows as it goes instead
+#endif
+    uint64_t written = 0, stall_max_us = 0, next_us = time_us_64();
+    uint32_t records = 0, syncs = 0;
+    while (written < bytes && result == FR_OK) {
+        make_sample(&sample, records, interval_us);
+        size_t length = record_format_csv(line, &sample);
+        uint64_t t0 = time_us_64();
+        result = log_writer_append(&writer, line, length);
+        log_writer_poll(&writer);
+        if (result == FR_OK) result = log_writer_checkpoint(&writer);
+        uint64_t stall_us = time_us_64() - t0;
+        if (stall_us > stall_max_us) stall_max_us = stall_us;
+        if (result == FR_OK && writer.syncs != syncs) {
+            // A checkpoint must leave the file ending where the data does
+            FILINFO info;
+            syncs = writer.syncs;
+            result = f_stat("0:/bench.csv", &info);
+            if (result == FR_OK && info.fsize != f_tell(&file)) {
+                printf("Checkpoint committed %lu bytes, %lu written\n",
+                       (unsigned long)info.fsize, (unsigned long)f_tell(&file));
+                result = FR_INT_ERR;
+            }
+        }
+        written += length;
+        records++;
+        if (interval_us) {
+            next_us += interval_us;
+            if (time_us_64() < next_us) busy_wait_us(next_us - time_us_64());
+        }
+    }
+    if (result == FR_OK) result = log_writer_finish(&writer);
+    FRESULT close_result = f_close(&file);
+    if (result == FR_OK) result = close_result;
+    report("log writer", written, records, &start);
+    printf("  %lu records, longest append %lu us, %lu checkpoints (avg %lu us, max %lu us)\n",
+           (unsigned long)records, (unsigned long)stall_max_us, (unsigned long)writer.syncs,
+           (unsigned long)(writer.syncs ? writer.sync_time_total_us / writer.syncs : 0),
+           (unsigned long)writer.sync_time_max_us);
+    printf("  disk_write: %lu calls, %lu sectors; disk_read: %lu calls, %lu sectors\n",
+           (unsigned long)disk_stats.write_calls, (unsigned long)disk_stats.write_sectors,
+           (unsigned long)disk_stats.read_calls, (unsigned long)disk_stats.read_sectors);
+    if (result != FR_OK) {
+        printf("Log writer error %d\n", result);
+        return false;
+    }
+
+    // Read back, regenerating the lines to compare with
+    static uint8_t chunk[READ_CHUNK_SIZE];
+    static char expected[READ_CHUNK_SIZE + RECORD_CSV_MAX_LENGTH];
+    size_t expected_length = 0;
+    uint32_t sequence = 0;
+    uint64_t read = 0;
+    bool ok = true;
+    if (f_open(&file, "0:/bench.csv", FA_READ) != FR_OK) {
+        printf("Cannot open the log file\n");
+        return false;
+    }
+    start = mark();
+    UINT n;
+    while (ok && (result = f_read(&file, chunk, sizeof chunk, &n)) == FR_OK && n > 0) {
+        while (expected_length < n) {
+            make_sample(&sample, sequence++, interval_us);
+            expected_length += record_format_csv(expected + expected_length, &sample);
+        }
+        if (memcmp(chunk, expected, n)) {
+            printf("Log file differs after byte %lu\n", (unsigned long)read);
+            ok = false;
+        }
+        memmove(expected, expected + n, expected_length - n);
+        expected_length -= n;
+        read += n;
+    }
+    report("log read back", read, (read + sizeof chunk - 1) / sizeof chunk, &start);
+    f_close(&file);
+    if (read != written) {
+        printf("Log file has %lu bytes, %lu written\n", (unsigned long)read,
+               (unsigned long)written);
+        ok = false;
+    }
+    return ok && result == FR_OK;
+}
+
+static void print_card(const sd_card_t *sd, const sd_emu_card_t *card) {
+    const sd_emu_stats_t *stats = &card->stats;
+    printf("%s %lu blocks read, %lu written, %lu stalls, busy %.1f ms, %lu garbled bytes, "
+           "%lu CRC errors, %lu protocol errors\n",
+           sd->pcName, (unsigned long)stats->blocks_read, (unsigned long)stats->blocks_written,
+           (unsigned long)stats->stalls, stats->busy_us / 1e3, (unsigned long)stats->garbled_bytes,
+           (unsigned long)stats->crc_errors, (unsigned long)stats->protocol_errors);
+    printf("  commands:");
+    for (int i = 0; i < 64; i++)
+        if (stats->commands[i]) printf(" CMD%d %lu", i, (unsigned long)stats->commands[i]);
+    for (int i = 0; i < 64; i++)
+        if (stats->app_commands[i]) printf(" ACMD%d %lu", i, (unsigned long)stats->app_commands[i]);
+    printf("\n");
+    sd_latency_print(&sd->latency, sd->pcName);
+}
+
+static bool parse_pair(const char *text, uint32_t *first, uint32_t *second) {
+    char *end;
+    *first = strtoul(text, &end, 10);
+    if (*end != ':') return false;
+    *second = strtoul(end + 1, &end, 10);
+    return !*end;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options] image\n"
+            "  -s MB         size of the image when it is created (64)\n"
+            "  -n MB         data written by each benchmark (8)\n"
+            "  -i us         sample interval of the log benchmark, 0: flat out (0)\n"
+            "  -R stripe|mirror  two cards as one drive, the second on image.b\n"
+            "  -c Hz         highest SPI clock the wiring carries (no limit)\n"
+            "  -H            card without High Speed mode\n"
+            "  -b min:mean   busy time of a written block, us (150:250)\n"
+            "  -g ppm:us     garbage collection stalls per million blocks, and their length (500:40000)\n"
+            "  -e us         busy time to commit a write command (800)\n"
+            "  -a first:next read access time, us (300:20)\n"
+            "  -o ns         software time of each SPI transfer (2000)\n"
+            "  -S seed       card serial number and timing seed (1)\n"
+            "  -v            print the driver's debug output\n",
+            program);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    sd_emu_config_t config = {
+        .init_us = 20000,
+        .read_us = 300,
+        .read_next_us = 20,
+        .busy_min_us = 150,
+        .busy_mean_us = 250,
+        .stall_ppm = 500,
+        .stall_us = 40000,
+        .close_us = 800,
+        .erase_au_us = 5000,
+        .high_speed = true,
+    };
+    uint64_t image_mb = 64, bench_mb = 8;
+    uint32_t interval_us = 0, seed = 1;
+    int level = SD_RAID_NONE;
+    emu_transfer_overhead_ns = 2000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:i:R:c:Hb:g:e:a:o:S:vh")) != -1) {
+        switch (opt) {
+            case 's': image_mb = strtoull(optarg, NULL, 10); break;
+            case 'n': bench_mb = strtoull(optarg, NULL, 10); break;
+            case 'i': interval_us = strtoul(optarg, NULL, 10); break;
+            case 'R':
+                if (!strcmp(optarg, "stripe"))
+                    level = SD_RAID_STRIPE;
+                else if (!strcmp(optarg, "mirror"))
+                    level = SD_RAID_MIRROR;
+                else
+                    usage(argv[0]);
+                break;
+            case 'c': config.max_hz = strtoul(optarg, NULL, 10); break;
+            case 'H': config.high_speed = false; break;
+            case 'b':
+                if (!parse_pair(optarg, &config.busy_min_us, &config.busy_mean_us)) usage(argv[0]);
+                break;
+            case 'g':
+                if (!parse_pair(optarg, &config.stall_ppm, &config.stall_us)) usage(argv[0]);
+                break;
+            case 'e': config.close_us = strtoul(optarg, NULL, 10); break;
+            case 'a':
+                if (!parse_pair(optarg, &config.read_us, &config.read_next_us)) usage(argv[0]);
+                break;
+            case 'o': emu_transfer_overhead_ns = strtoul(optarg, NULL, 10); break;
+            case 'S': seed = strtoul(optarg, NULL, 10); break;
+            case 'v': verbose = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) usage(argv[0]);
+
+    // The cards, wired as the drive's members
+    const char *path = argv[optind];
+    char path_b[4096];
+    snprintf(path_b, sizeof path_b, "%s.b", path);
+    sd_card_t *members[2] = {&single_card};
+    if (level != SD_RAID_NONE) {
+        raid.level = level;
+        storage_device = &raid_device;
+        members[0] = &raid_members[0];
+        members[1] = &raid_members[1];
+        card_count = 2;
+    }
+    for (size_t i = 0; i < card_count; i++) {
+        cards[i].config = config;
+        cards[i].spi = members[i]->spi->hw_inst;
+        cards[i].cs_gpio = members[i]->ss_gpio;
+        if (!sd_emu_card_open(&cards[i], i ? path_b : path, image_mb << 20, seed + i)) return 2;
+        emu_attach_card(&cards[i]);
+    }
+
+    // Mount, as the logger does
+    mark_t start = mark();
+    if (disk_initialize(0) & STA_NOINIT) {
+        printf("The card did not initialize\n");
+        return 2;
+    }
+    sd_card_t *sd = sd_get_by_num(0);
+    printf("Initialized in %.1f ms: %lu sectors\n", (emu_now_ns() - start.start_ns) / 1e6,
+           (unsigned long)sd->sectors);
+    for (size_t i = 0; i < card_count; i++) {
+        printf("%s SPI clock %u Hz, %s\n", members[i]->pcName,
+               spi_get_baudrate(members[i]->spi->hw_inst),
+               members[i]->high_speed ? "high speed" : "default speed");
+        // Clock calibration provokes errors on purpose: count from here on
+        sd_latency_reset(&members[i]->latency);
+        memset(&cards[i].stats, 0, sizeof cards[i].stats);
+    }
+
+    uint64_t bench_sectors = (bench_mb << 20) / SD_EMU_BLOCK_SIZE;
+    if (bench_sectors > sd->sectors) bench_sectors = sd->sectors;
+    bool ok = raw_benchmarks(sd, bench_sectors);
+
+    static BYTE work[FF_MAX_SS * 8];
+    static FATFS fs;
+    FRESULT result = f_mkfs("0:", NULL, work, sizeof work);
+    if (result == FR_OK) result = f_mount(&fs, "0:", 1);
+    if (result != FR_OK) {
+        printf("Cannot format or mount: %d\n", result);
+        return 2;
+    }
+    ok = log_benchmark(bench_sectors * SD_EMU_BLOCK_SIZE, interval_us) && ok;
+    f_unmount("0:");
+
+    printf("\nVirtual time %.3f s\n", emu_now_ns() / 1e9);
+    for (size_t i = 0; i < card_count; i++) {
+        print_card(members[i], &cards[i]);
+        ok = ok && !cards[i].stats.crc_errors && !cards[i].stats.protocol_errors;
+        sd_emu_card_close(&cards[i]);
+    }
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
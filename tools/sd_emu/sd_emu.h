@@ -0,0 +1,106 @@
+// SD card SPI-mode emulator: the card model (card.c) and the host side of
+// the bus (host.c), on which the SD driver runs unmodified. See sd_emu.c.
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hardware/spi.h"
+
+#define SD_EMU_BLOCK_SIZE 512
+
+// Virtual time, in nanoseconds. It only passes as bytes cross the bus and
+// as the driver waits.
+uint64_t emu_now_ns(void);
+
+// Software cost of each DMA transfer on the target (setup and completion
+// IRQ), added to its time on the bus
+extern uint32_t emu_transfer_overhead_ns;
+
+// Timing of the card model, in microseconds
+typedef struct {
+    uint32_t init_us;       // From the first ACMD41 until the card is ready
+    uint32_t read_us;       // Access time before the first block of a read
+    uint32_t read_next_us;  // and between the blocks of a CMD18
+    // Programming time of a written block: at least busy_min_us, busy_mean_us
+    // on average, with an exponential tail
+    uint32_t busy_min_us;
+    uint32_t busy_mean_us;
+    // Garbage collection: a block not covered by ACMD23 pre-erase stalls
+    // stall_us longer with probability stall_ppm per million
+    uint32_t stall_ppm;
+    uint32_t stall_us;
+    uint32_t close_us;     // Extra busy time to commit a CMD24 or a Stop Tran
+    uint32_t erase_au_us;  // Erase time per allocation unit
+    // Highest SPI clock the wiring carries, 0 for no limit below the card's
+    // own (25 MHz, 50 MHz in High Speed mode). Faster, bytes get garbled.
+    uint32_t max_hz;
+    bool high_speed;  // Supports High Speed mode (CMD6)
+} sd_emu_config_t;
+
+typedef struct {
+    uint32_t commands[64];      // CMDn received, by n
+    uint32_t app_commands[64];  // ACMDn received, by n
+    uint64_t bus_bytes;         // Bytes clocked while selected
+    uint64_t data_bytes;        // Of which data block payload
+    uint64_t busy_bytes;        // Of which read back as busy
+    uint32_t blocks_read;
+    uint32_t blocks_written;
+    uint32_t stalls;
+    uint64_t busy_us;          // Programming time of the written blocks
+    uint32_t crc_errors;       // Commands and data blocks with a bad CRC
+    uint32_t garbled_bytes;    // Bytes corrupted by a too fast clock
+    uint32_t protocol_errors;  // Commands or tokens sent while busy, etc.
+} sd_emu_stats_t;
+
+// An SDHC card in SPI mode, backed by an image file
+typedef struct {
+    sd_emu_config_t config;
+    sd_emu_stats_t stats;  // Reset it freely
+    spi_inst_t *spi;       // Bus and chip select it is wired to
+    uint cs_gpio;
+    // Internal state, see card.c
+    int fd;
+    uint64_t sectors;
+    uint32_t serial;
+    uint64_t rng;
+    bool spi_mode;
+    bool ready;  // Initialization (ACMD41) complete
+    bool init_started;
+    uint64_t init_start_ns;
+    bool app;  // Last command was CMD55
+    bool crc_on;
+    bool high_speed;
+    uint8_t cmd[6];
+    size_t cmd_length;
+    uint8_t out[SD_EMU_BLOCK_SIZE + 16];  // Bytes queued for DO
+    size_t out_head;
+    size_t out_length;
+    int state;
+    bool multi;
+    uint64_t address;  // Next block of a read or write
+    uint64_t ready_ns;
+    uint64_t busy_until_ns;
+    uint8_t block[SD_EMU_BLOCK_SIZE + 2];  // Data block being received, with CRC
+    size_t block_length;
+    uint32_t pre_erased;  // Blocks left of the ACMD23 count
+    uint64_t erase_first;
+    uint64_t erase_last;
+    uint8_t erase_set;  // Bit 0: CMD32 received, bit 1: CMD33
+    uint8_t r2;         // Second byte of the next CMD13 response
+} sd_emu_card_t;
+
+// Opens the image, creating it with create_bytes if it does not exist. The
+// card's capacity is the image size, down to a multiple of 512 KiB. serial
+// goes into the CID and seeds the timing randomness.
+bool sd_emu_card_open(sd_emu_card_t *card, const char *path, uint64_t create_bytes,
+                      uint32_t serial);
+void sd_emu_card_close(sd_emu_card_t *card);
+
+// Bus side: chip select changes, and one byte in each direction at time t_ns
+void sd_emu_card_select(sd_emu_card_t *card, bool selected, uint64_t t_ns);
+uint8_t sd_emu_card_exchange(sd_emu_card_t *card, uint8_t in, uint64_t t_ns, uint baud_rate);
+
+// Connects the card to its bus (card->spi, card->cs_gpio)
+void emu_attach_card(sd_emu_card_t *card);